@@ -5,7 +5,7 @@
 COMPONENT_SRCDIRS := src
 COMPONENT_ADD_INCLUDEDIRS := src/include
 
-COMPONENT_OBJS := src/ps4.o src/ps4_spp.o src/ps4_parser.o src/ps4_l2cap.o
+COMPONENT_OBJS := src/ps4.o src/ps4_spp.o src/ps4_parser.o src/ps4_l2cap.o src/ps4_subscriber.o src/ps4_crc.o src/ps4_lightbar.o src/ps4_rumble.o src/ps4_mixer.o src/ps4_output.o src/ps4_mailbox.o src/ps4_connection.o src/ps4_storage.o src/ps4_gap.o src/ps4_buffer.o src/ps4_trace.o src/ps4_metrics.o src/ps4_stack.o
 
 COMPONENT_EXTRA_INCLUDES +=     $(IDF_PATH)/components/bt/common/include/                     \
                                 $(IDF_PATH)/components/bt/host/bluedroid/common/include/      \
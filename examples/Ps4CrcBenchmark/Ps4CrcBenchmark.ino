@@ -0,0 +1,51 @@
+#include <Ps4Controller.h>
+
+/* Measures the throughput of the CRC used on output reports,
+   and optionally on input reports (see Ps4.setInputCrcCheck).
+   make -C fuzz bench runs the same measurement on the host */
+
+static uint8_t buffer[4096];
+
+void benchmark(size_t len, int rounds)
+{
+    uint32_t crc = 0;
+    unsigned long start = micros();
+
+    for (int i = 0; i < rounds; i++) {
+        crc = ps4Crc32(crc, buffer, len);
+    }
+
+    unsigned long elapsed = micros() - start;
+
+    Serial.print(len);
+    Serial.print(" bytes: ");
+    Serial.print((float)elapsed / rounds);
+    Serial.print(" us, ");
+    Serial.print((float)len * rounds / elapsed);
+    Serial.print(" MB/s (crc ");
+    Serial.print(crc, HEX);
+    Serial.println(")");
+}
+
+
+void setup()
+{
+    Serial.begin(115200);
+
+    for (size_t i = 0; i < sizeof(buffer); i++) {
+        buffer[i] = i * 7;
+    }
+
+    // Check value of CRC-32
+    Serial.print("crc(\"123456789\") = ");
+    Serial.println(ps4Crc32(0, (const uint8_t*)"123456789", 9), HEX);
+
+    benchmark(75, 10000);   // covered part of a 0x11 report
+    benchmark(sizeof(buffer), 100);
+}
+
+
+void loop()
+{
+
+}
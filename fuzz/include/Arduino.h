@@ -0,0 +1,28 @@
+/* Host stand-in for the Arduino core, declaring what the wrapper uses */
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+class String {
+    public:
+        String() {}
+        String(const char *value) : _value(value) {}
+        const char *c_str() const { return _value.c_str(); }
+
+    private:
+        std::string _value;
+};
+
+/* Bluetooth is brought up by the harness */
+inline bool btStarted() { return true; }
+inline bool btStart() { return true; }
+
+#define PS4_FUZZ_ARDUINO_LOG(...) do { if (0) { printf(__VA_ARGS__); } } while (0)
+#define log_e(...) PS4_FUZZ_ARDUINO_LOG(__VA_ARGS__)
+#define log_w(...) PS4_FUZZ_ARDUINO_LOG(__VA_ARGS__)
+#define log_i(...) PS4_FUZZ_ARDUINO_LOG(__VA_ARGS__)
+
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
@@ -0,0 +1,6 @@
+/* Host stand-in for the ESP-IDF header, declaring what the library uses */
+#pragma once
+#include <stdint.h>
+#define ESP_BD_ADDR_LEN 6
+typedef uint8_t esp_bd_addr_t[ESP_BD_ADDR_LEN];
+#define ESP_BD_ADDR_STR "%02x:%02x:%02x:%02x:%02x:%02x"
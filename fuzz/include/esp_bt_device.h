@@ -0,0 +1,15 @@
+/* Host stand-in for the ESP-IDF header, declaring what the library uses */
+#pragma once
+#include "esp_err.h"
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+const uint8_t *esp_bt_dev_get_address(void);
+esp_err_t esp_bt_dev_set_device_name(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,23 @@
+/* Host stand-in for the ESP-IDF header, declaring what the library uses */
+#pragma once
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    ESP_BLUEDROID_STATUS_UNINITIALIZED,
+    ESP_BLUEDROID_STATUS_INITIALIZED,
+    ESP_BLUEDROID_STATUS_ENABLED
+} esp_bluedroid_status_t;
+
+esp_bluedroid_status_t esp_bluedroid_get_status(void);
+esp_err_t esp_bluedroid_init(void);
+esp_err_t esp_bluedroid_enable(void);
+esp_err_t esp_bluedroid_disable(void);
+esp_err_t esp_bluedroid_deinit(void);
+
+#ifdef __cplusplus
+}
+#endif
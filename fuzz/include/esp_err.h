@@ -0,0 +1,18 @@
+/* Host stand-in for the ESP-IDF header, declaring what the library uses */
+#pragma once
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NVS_NOT_FOUND 0x1102
+#define ESP_ERR_NO_MEM 0x101
+const char *esp_err_to_name(esp_err_t);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,7 @@
+/* Host stand-in for the ESP-IDF header, declaring what the library uses */
+#pragma once
+#include "esp_err.h"
+#include "esp_bt_defs.h"
+typedef enum { ESP_BT_NON_CONNECTABLE, ESP_BT_CONNECTABLE } esp_bt_connection_mode_t;
+typedef enum { ESP_BT_NON_DISCOVERABLE, ESP_BT_LIMITED_DISCOVERABLE, ESP_BT_GENERAL_DISCOVERABLE } esp_bt_discovery_mode_t;
+esp_err_t esp_bt_gap_set_scan_mode(esp_bt_connection_mode_t, esp_bt_discovery_mode_t);
@@ -0,0 +1,7 @@
+/* Host stand-in for the ESP-IDF header, declaring what the library uses */
+#pragma once
+#include <stddef.h>
+#define MALLOC_CAP_DEFAULT 1
+#define MALLOC_CAP_INTERNAL 2
+#define MALLOC_CAP_SPIRAM 4
+size_t heap_caps_get_free_size(unsigned caps);
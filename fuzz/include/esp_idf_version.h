@@ -0,0 +1,3 @@
+/* Host stand-in for the ESP-IDF header, declaring what the library uses */
+#define ESP_IDF_VERSION_VAL(major, minor, patch) ((major << 16) | (minor << 8) | (patch))
+#define ESP_IDF_VERSION ESP_IDF_VERSION_VAL(4,4,0)
@@ -0,0 +1,10 @@
+/* Host stand-in for the ESP-IDF header, declaring what the library uses.
+ * Nothing is printed, but the arguments are still used and the formats
+ * checked against them */
+#pragma once
+#include <stdio.h>
+#define PS4_FUZZ_LOG(tag, ...) do { if (0) { (void)(tag); printf(__VA_ARGS__); } } while (0)
+#define ESP_LOGE(tag, ...) PS4_FUZZ_LOG(tag, __VA_ARGS__)
+#define ESP_LOGW(tag, ...) PS4_FUZZ_LOG(tag, __VA_ARGS__)
+#define ESP_LOGI(tag, ...) PS4_FUZZ_LOG(tag, __VA_ARGS__)
+#define ESP_LOGD(tag, ...) PS4_FUZZ_LOG(tag, __VA_ARGS__)
@@ -0,0 +1,8 @@
+/* Host stand-in for the ESP-IDF header, declaring what the library uses */
+#pragma once
+#include "esp_err.h"
+#include <stddef.h>
+esp_err_t esp_base_mac_addr_set(const uint8_t *mac);
+esp_err_t esp_base_mac_addr_get(uint8_t *mac);
+uint32_t esp_get_free_heap_size(void);
+uint32_t esp_get_minimum_free_heap_size(void);
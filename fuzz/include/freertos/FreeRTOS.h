@@ -0,0 +1,39 @@
+/* Host stand-in for the ESP-IDF header, declaring what the library uses */
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint8_t StackType_t;
+
+/* The harnesses are single threaded, critical sections do nothing */
+typedef struct { volatile uint32_t owner; volatile uint32_t count; } portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {0,0}
+
+void vPortEnterCritical(portMUX_TYPE*);
+void vPortExitCritical(portMUX_TYPE*);
+
+#define portENTER_CRITICAL(m) vPortEnterCritical(m)
+#define portEXIT_CRITICAL(m) vPortExitCritical(m)
+#define taskENTER_CRITICAL(m) vPortEnterCritical(m)
+#define taskEXIT_CRITICAL(m) vPortExitCritical(m)
+
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(x) (x)
+#define pdPASS 1
+#define pdTRUE 1
+#define pdFALSE 0
+#define portMAX_DELAY 0xffffffff
+#define tskNO_AFFINITY 0x7fffffff
+
+int xPortGetCoreID(void);
+
+#ifdef __cplusplus
+}
+#endif
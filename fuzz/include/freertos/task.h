@@ -0,0 +1,23 @@
+/* Host stand-in for the ESP-IDF header, declaring what the library uses */
+#pragma once
+#include "FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void* TaskHandle_t;
+typedef void (*TaskFunction_t)(void*);
+
+void vTaskDelay(TickType_t);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t);
+uint8_t *pxTaskGetStackStart(TaskHandle_t);
+const char *pcTaskGetTaskName(TaskHandle_t);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t, const char*, uint32_t, void*, UBaseType_t, TaskHandle_t*, BaseType_t);
+BaseType_t xTaskCreate(TaskFunction_t, const char*, uint32_t, void*, UBaseType_t, TaskHandle_t*);
+void vTaskDelete(TaskHandle_t);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,12 @@
+/* Host stand-in for the ESP-IDF header, declaring what the library uses */
+#pragma once
+#include "esp_err.h"
+#include <stddef.h>
+typedef uint32_t nvs_handle_t;
+typedef enum { NVS_READONLY, NVS_READWRITE } nvs_open_mode_t;
+esp_err_t nvs_open(const char*, nvs_open_mode_t, nvs_handle_t*);
+esp_err_t nvs_get_blob(nvs_handle_t, const char*, void*, size_t*);
+esp_err_t nvs_set_blob(nvs_handle_t, const char*, const void*, size_t);
+esp_err_t nvs_erase_key(nvs_handle_t, const char*);
+esp_err_t nvs_commit(nvs_handle_t);
+void nvs_close(nvs_handle_t);
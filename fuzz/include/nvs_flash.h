@@ -0,0 +1,4 @@
+/* Host stand-in for the ESP-IDF header, declaring what the library uses */
+#pragma once
+#include "esp_err.h"
+esp_err_t nvs_flash_init(void);
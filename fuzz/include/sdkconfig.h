@@ -0,0 +1,6 @@
+/* Host stand-in for the ESP-IDF header, declaring what the library uses */
+#define CONFIG_BT_ENABLED 1
+#define CONFIG_BLUEDROID_ENABLED 1
+#define CONFIG_CLASSIC_BT_ENABLED 1
+#define CONFIG_BT_SPP_ENABLED 1
+#define CONFIG_BTDM_CONTROLLER_MODE_BR_EDR_ONLY 1
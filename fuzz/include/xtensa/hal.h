@@ -0,0 +1,4 @@
+/* Host stand-in for the ESP-IDF header, declaring what the library uses */
+#pragma once
+#include <stdint.h>
+uint32_t xthal_get_ccount(void);
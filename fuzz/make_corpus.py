@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+"""Writes the seed corpus of the fuzzing harnesses, see README.md.
+
+The reports follow what a DualShock 4 sends over Bluetooth: 0x01 reports
+until it is enabled, 0x11 reports with a trailing CRC after that, feature
+replies and handshakes on the control channel.
+"""
+
+import os
+import struct
+import zlib
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+
+def short_report(buttons=0x08):
+    # Sticks centred, d-pad released, no buttons
+    return bytes([0xa1, 0x01, 0x80, 0x80, 0x80, 0x80, buttons, 0x00, 0x00, 0x00, 0x00])
+
+
+def full_report(counter=0, buttons=0x08, crc=True):
+    fields = bytearray(71)
+    fields[0:4] = bytes([0x7f, 0x81, 0x80, 0x7e])   # sticks
+    fields[4] = buttons                             # d-pad released
+    fields[6] = counter << 2                        # report counter
+    fields[9:11] = struct.pack('<H', counter * 188) # timestamp
+    fields[12:24] = struct.pack('<6h', 2, -3, 1, 8100, -200, 150)
+    fields[29] = 0x1b                               # cable, battery level
+    fields[34] = 0x00                               # no touch packets
+    report = bytes([0xa1, 0x11, 0xc0, 0x00]) + bytes(fields)
+    checksum = zlib.crc32(report) if crc else 0xdeadbeef
+    return report + struct.pack('<I', checksum)
+
+
+def feature_calibration():
+    return bytes([0xa3, 0x02]) + struct.pack('<18h', 1, -2, 3, 8800, -8800, 8800,
+                                             -8800, 8800, -8800, 540, 540,
+                                             8192, -8192, 8192, -8192, 8192, -8192, 0)
+
+
+def frame(op, delay_ms, payload):
+    return bytes([(delay_ms << 3) | op, len(payload)]) + payload
+
+
+def write(directory, name, data):
+    path = os.path.join(HERE, 'corpus', directory)
+    os.makedirs(path, exist_ok=True)
+    with open(os.path.join(path, name), 'wb') as f:
+        f.write(data)
+
+
+def main():
+    control, interrupt, crc = 0x00, 0x01, 0x02
+
+    write('report', 'short_0x01', bytes([interrupt]) + short_report())
+    write('report', 'full_0x11', bytes([interrupt | crc]) + full_report())
+    write('report', 'full_0x11_bad_crc', bytes([interrupt | crc]) + full_report(crc=False))
+    write('report', 'full_0x11_truncated', bytes([interrupt]) + full_report()[:40])
+    write('report', 'wrong_id', bytes([interrupt]) + b'\xa1\x12' + full_report()[2:])
+    write('report', 'feature_0x02', bytes([control]) + feature_calibration())
+    write('report', 'handshake', bytes([control, 0x00]))
+
+    hidc, hidi, other, congestion = 0, 1, 2, 3
+
+    write('l2cap', 'enable_then_stream', bytes([0x00])
+          + frame(hidi, 1, short_report())
+          + frame(hidc, 1, bytes([0x00]))
+          + frame(hidc, 2, feature_calibration())
+          + b''.join(frame(hidi, 1, full_report(i, 0x28 if i % 2 else 0x08)) for i in range(8)))
+
+    write('l2cap', 'short_reports_only', bytes([0x05])
+          + b''.join(frame(hidi, 10, short_report(0x18 if i % 2 else 0x08)) for i in range(6)))
+
+    write('l2cap', 'stream_then_silence', bytes([0x11])
+          + frame(hidi, 1, full_report(0))
+          + frame(hidi, 1, full_report(1))
+          + b''.join(frame(other, 31, b'') for _ in range(16))
+          + frame(hidi, 1, full_report(2)))
+
+    write('l2cap', 'congested_and_stray', bytes([0x22])
+          + frame(hidi, 1, full_report(0))
+          + frame(congestion | 0x04, 0, b'')
+          + frame(other, 1, full_report(1))
+          + frame(hidi, 1, full_report(2))
+          + frame(congestion, 1, b'')
+          + frame(hidi, 1, full_report(3)))
+
+
+if __name__ == '__main__':
+    main()
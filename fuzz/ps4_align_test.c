@@ -0,0 +1,248 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "include/ps4.h"
+#include "include/ps4_int.h"
+#include "esp_timer.h"
+#include "ps4_fuzz.h"
+
+
+/* Streams a controller while the application changes the rumble and the
+ * lightbar once per input report, at a pseudo random point between two,
+ * first with the output unaligned, then aligned to input report arrival,
+ * and reports the jitter_us of ps4GetReportStats for both.
+ *
+ * The link is modelled as half duplex: an output report keeps it busy for
+ * PS4_ALIGN_TEST_AIRTIME_US, and an input report due meanwhile arrives
+ * once it is done. Unaligned output goes out whenever it changes, so it
+ * delays the input reports it happens to come right before. Aligned
+ * output goes out right after an input report, in the gap before the
+ * next one. */
+
+#define PS4_ALIGN_TEST_INTERVAL_US  4000
+#define PS4_ALIGN_TEST_AIRTIME_US   1250
+#define PS4_ALIGN_TEST_WARMUP       64
+#define PS4_ALIGN_TEST_REPORTS      2000
+
+#define PS4_ALIGN_TEST_HIDC_CID     0x40
+#define PS4_ALIGN_TEST_HIDI_CID     0x41
+
+typedef struct {
+    uint32_t jitter_mean_us;
+    uint32_t jitter_max_us;
+    uint32_t interval_us;
+    uint32_t delayed;
+    uint32_t changes;
+} ps4_align_test_result_t;
+
+static BD_ADDR ps4_align_test_addr = { 0x1c, 0x66, 0x6d, 0x00, 0x00, 0x07 };
+
+static esp_timer_handle_t ps4_align_test_timer = NULL;
+static uint32_t ps4_align_test_random = 1;
+static uint32_t ps4_align_test_counter = 0;
+static uint32_t ps4_align_test_changes = 0;
+
+
+/* Deterministic, so both runs see the same kind of changes */
+static uint32_t ps4_align_test_next()
+{
+    ps4_align_test_random = ps4_align_test_random * 1103515245 + 12345;
+    return ps4_align_test_random >> 8;
+}
+
+
+static void ps4_align_test_connect( const tL2CAP_APPL_INFO *info, uint16_t cid, uint16_t psm, uint8_t id )
+{
+    tL2CAP_CFG_INFO cfg = {0};
+
+    info->pL2CA_ConnectInd_Cb( ps4_align_test_addr, cid, psm, id );
+
+    cfg.mtu_present = true;
+    cfg.mtu = 672;
+    info->pL2CA_ConfigInd_Cb( cid, &cfg );
+
+    cfg.result = 0;
+    info->pL2CA_ConfigCfm_Cb( cid, &cfg );
+}
+
+
+/* A 0x11 input report with a valid CRC */
+static uint16_t ps4_align_test_full_report( uint8_t *report, uint32_t counter )
+{
+    uint8_t *fields = report + 4;
+    uint16_t timestamp = counter * 188;
+
+    memset( report, 0, 79 );
+    report[0] = 0xa1;
+    report[1] = 0x11;
+    report[2] = 0xc0;
+
+    fields[0] = 0x80;
+    fields[1] = 0x80;
+    fields[2] = 0x80;
+    fields[3] = 0x80;
+    fields[4] = 0x08;
+    fields[6] = (counter & 0x3f) << 2;
+    fields[9] = timestamp & 0xff;
+    fields[10] = timestamp >> 8;
+    fields[29] = 0x1b;
+
+    uint32_t crc = ps4Crc32( 0, report, 75 );
+
+    report[75] = crc;
+    report[76] = crc >> 8;
+    report[77] = crc >> 16;
+    report[78] = crc >> 24;
+
+    return 79;
+}
+
+
+/* The application, on a task of its own: new rumble and lightbar */
+static void ps4_align_test_change( void *arg )
+{
+    uint32_t value = ps4_align_test_next();
+    ps4_cmd_t cmd = {
+        .rumble_right_intensity = value,
+        .rumble_left_intensity = value >> 8,
+        .r = value >> 4,
+        .g = value >> 12,
+        .b = ps4_align_test_changes
+    };
+
+    ps4Cmd( cmd );
+    ps4_align_test_changes++;
+}
+
+
+/* Streams with the alignment given, and keeps the jitter seen past the warmup */
+static void ps4_align_test_run( const tL2CAP_APPL_INFO *hidi, bool aligned, ps4_align_test_result_t *result )
+{
+    uint8_t report[79];
+    uint64_t jitter_sum = 0;
+
+    memset( result, 0, sizeof(*result) );
+    ps4SetOutputAlignment( aligned, 0 );
+    ps4_align_test_random = 1;
+    ps4_align_test_changes = 0;
+
+    int64_t due = esp_timer_get_time();
+
+    for (uint32_t i = 0; i < PS4_ALIGN_TEST_WARMUP + PS4_ALIGN_TEST_REPORTS; i++) {
+        ps4_report_stats_t stats;
+
+        due += PS4_ALIGN_TEST_INTERVAL_US;
+        ps4_fuzz_advance( due - esp_timer_get_time() );
+
+        // The report waits for the output on the link, if any
+        if (ps4_fuzz_link_busy() > 0) {
+            result->delayed += i >= PS4_ALIGN_TEST_WARMUP;
+
+            while (ps4_fuzz_link_busy() > 0) {
+                ps4_fuzz_advance( ps4_fuzz_link_busy() );
+            }
+        }
+
+        uint16_t len = ps4_align_test_full_report( report, ps4_align_test_counter++ );
+
+        hidi->pL2CA_DataInd_Cb( PS4_ALIGN_TEST_HIDI_CID, ps4_fuzz_buffer( report, len ) );
+
+        // The next change somewhere before the next report
+        esp_timer_start_once( ps4_align_test_timer, ps4_align_test_next() % PS4_ALIGN_TEST_INTERVAL_US );
+
+        if (i < PS4_ALIGN_TEST_WARMUP) {
+            continue;
+        }
+
+        ps4GetReportStats( &stats );
+        jitter_sum += stats.jitter_us;
+
+        if (stats.jitter_us > result->jitter_max_us) {
+            result->jitter_max_us = stats.jitter_us;
+        }
+
+        result->interval_us = stats.interval_us;
+    }
+
+    esp_timer_stop( ps4_align_test_timer );
+    ps4_fuzz_advance( 100000 );
+
+    result->jitter_mean_us = jitter_sum / PS4_ALIGN_TEST_REPORTS;
+    result->changes = ps4_align_test_changes;
+}
+
+
+static void ps4_align_test_print( const char *name, const ps4_align_test_result_t *result )
+{
+    printf( "ps4_align_test: %-9s jitter_us %4u on average, %4u at most, interval %u us, "
+            "%u of %u reports delayed, %u changes\n", name, (unsigned)result->jitter_mean_us,
+            (unsigned)result->jitter_max_us, (unsigned)result->interval_us, (unsigned)result->delayed,
+            PS4_ALIGN_TEST_REPORTS, (unsigned)result->changes );
+}
+
+
+int main( void )
+{
+    ps4_align_test_result_t unaligned;
+    ps4_align_test_result_t aligned;
+    ps4_output_hold_stats_t hold;
+    int failures = 0;
+
+    ps4_fuzz_init();
+
+    const tL2CAP_APPL_INFO *hidc = ps4_fuzz_l2cap( BT_PSM_HIDC );
+    const tL2CAP_APPL_INFO *hidi = ps4_fuzz_l2cap( BT_PSM_HIDI );
+
+    if (hidc == NULL || hidi == NULL) {
+        fprintf( stderr, "ps4_align_test: the L2CAP services were not registered\n" );
+        return 1;
+    }
+
+    esp_timer_create_args_t args = {
+        .callback = &ps4_align_test_change,
+        .name = "ps4_align_test"
+    };
+
+    if (esp_timer_create( &args, &ps4_align_test_timer ) != ESP_OK) {
+        fprintf( stderr, "ps4_align_test: creating the timer failed\n" );
+        return 1;
+    }
+
+    ps4_align_test_connect( hidc, PS4_ALIGN_TEST_HIDC_CID, BT_PSM_HIDC, 1 );
+    ps4_align_test_connect( hidi, PS4_ALIGN_TEST_HIDI_CID, BT_PSM_HIDI, 2 );
+    ps4_fuzz_set_airtime( PS4_ALIGN_TEST_AIRTIME_US );
+
+    ps4_align_test_run( hidi, false, &unaligned );
+    ps4_align_test_run( hidi, true, &aligned );
+    ps4GetOutputHoldStats( &hold );
+
+    ps4_fuzz_set_airtime( 0 );
+    hidi->pL2CA_DisconnectInd_Cb( PS4_ALIGN_TEST_HIDI_CID, false );
+    hidc->pL2CA_DisconnectInd_Cb( PS4_ALIGN_TEST_HIDC_CID, false );
+    ps4_fuzz_advance( 1000000 );
+
+    ps4_align_test_print( "unaligned", &unaligned );
+    ps4_align_test_print( "aligned", &aligned );
+    printf( "ps4_align_test: aligned output released by %u input reports, %u timeouts, held %u us at most\n",
+            (unsigned)hold.released_by_input, (unsigned)hold.released_by_timeout, (unsigned)hold.hold_max_us );
+
+    if (unaligned.delayed == 0) {
+        fprintf( stderr, "ps4_align_test: no report delayed by unaligned output\n" );
+        failures++;
+    }
+
+    if (aligned.jitter_mean_us >= unaligned.jitter_mean_us) {
+        fprintf( stderr, "ps4_align_test: aligned output did not lower the jitter\n" );
+        failures++;
+    }
+
+    if (hold.released_by_input == 0) {
+        fprintf( stderr, "ps4_align_test: no aligned output sent after an input report\n" );
+        failures++;
+    }
+
+    printf( "ps4_align_test: %d failed\n", failures );
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,258 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "include/ps4.h"
+#include "include/ps4_int.h"
+#include "esp_timer.h"
+#include "ps4_fuzz.h"
+
+
+/* Runs a long session with a streaming controller, with output changing
+ * all along, and fails when the library allocates anything once the
+ * controller streams, other than the buffers output reports are handed
+ * to the stack in, which the stack frees.
+ *
+ * malloc, calloc, realloc and esp_timer_create are wrapped at link time,
+ * see the Makefile. osi_malloc is malloc on the host. The buffers the
+ * stack would hand over with each report are allocated outside of the
+ * counted calls. */
+
+#define PS4_ALLOC_TEST_REPORTS      20000
+#define PS4_ALLOC_TEST_INTERVAL_US  4000
+
+#define PS4_ALLOC_TEST_HIDC_CID     0x40
+#define PS4_ALLOC_TEST_HIDI_CID     0x41
+
+static bool ps4_alloc_test_counting = false;
+static uint32_t ps4_alloc_test_mallocs = 0;
+static uint32_t ps4_alloc_test_timers = 0;
+
+static BD_ADDR ps4_alloc_test_addr = { 0x1c, 0x66, 0x6d, 0x00, 0x00, 0x02 };
+
+
+/********************************************************************************/
+/*                      W R A P P E D    F U N C T I O N S                      */
+/********************************************************************************/
+
+void *__real_malloc( size_t size );
+void *__real_calloc( size_t count, size_t size );
+void *__real_realloc( void *ptr, size_t size );
+esp_err_t __real_esp_timer_create( const esp_timer_create_args_t *args, esp_timer_handle_t *handle );
+
+void *__wrap_malloc( size_t size )
+{
+    if (ps4_alloc_test_counting) ps4_alloc_test_mallocs++;
+    return __real_malloc( size );
+}
+
+void *__wrap_calloc( size_t count, size_t size )
+{
+    if (ps4_alloc_test_counting) ps4_alloc_test_mallocs++;
+    return __real_calloc( count, size );
+}
+
+void *__wrap_realloc( void *ptr, size_t size )
+{
+    if (ps4_alloc_test_counting) ps4_alloc_test_mallocs++;
+    return __real_realloc( ptr, size );
+}
+
+esp_err_t __wrap_esp_timer_create( const esp_timer_create_args_t *args, esp_timer_handle_t *handle )
+{
+    if (ps4_alloc_test_counting) ps4_alloc_test_timers++;
+    return __real_esp_timer_create( args, handle );
+}
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+static void ps4_alloc_test_connect( const tL2CAP_APPL_INFO *info, uint16_t cid, uint16_t psm, uint8_t id )
+{
+    tL2CAP_CFG_INFO cfg = {0};
+
+    info->pL2CA_ConnectInd_Cb( ps4_alloc_test_addr, cid, psm, id );
+
+    cfg.mtu_present = true;
+    cfg.mtu = 672;
+    info->pL2CA_ConfigInd_Cb( cid, &cfg );
+
+    cfg.result = 0;
+    info->pL2CA_ConfigCfm_Cb( cid, &cfg );
+}
+
+
+/* A 0x11 input report with a valid CRC, the buttons and sticks moving */
+static uint16_t ps4_alloc_test_full_report( uint8_t *report, uint32_t counter )
+{
+    uint8_t *fields = report + 4;
+    uint16_t timestamp = counter * 188;
+
+    memset( report, 0, 79 );
+    report[0] = 0xa1;
+    report[1] = 0x11;
+    report[2] = 0xc0;
+
+    fields[0] = 0x80 + (counter % 32);          // sticks
+    fields[1] = 0x81;
+    fields[2] = 0x80;
+    fields[3] = 0x7e - (counter % 16);
+    fields[4] = counter % 64 < 32 ? 0x08 : 0x28; // d-pad released, cross
+    fields[6] = (counter & 0x3f) << 2;          // report counter
+    fields[9] = timestamp & 0xff;
+    fields[10] = timestamp >> 8;
+    fields[29] = 0x1b;                          // cable, battery level
+
+    uint32_t crc = ps4Crc32( 0, report, 75 );
+
+    report[75] = crc;
+    report[76] = crc >> 8;
+    report[77] = crc >> 16;
+    report[78] = crc >> 24;
+
+    return 79;
+}
+
+
+/* Hands a report over on the interrupt channel, the only counted call
+ * besides the time passing after it */
+static void ps4_alloc_test_receive( const tL2CAP_APPL_INFO *hidi, const uint8_t *report, uint16_t len )
+{
+    BT_HDR *buffer = ps4_fuzz_buffer( report, len );
+
+    ps4_alloc_test_counting = true;
+    hidi->pL2CA_DataInd_Cb( PS4_ALLOC_TEST_HIDI_CID, buffer );
+    ps4_alloc_test_counting = false;
+}
+
+
+static void ps4_alloc_test_advance( int64_t us )
+{
+    ps4_alloc_test_counting = true;
+    ps4_fuzz_advance( us );
+    ps4_alloc_test_counting = false;
+}
+
+
+/* Changes the output the ways an application does, from the Bluetooth
+ * task as the harness plays it */
+static void ps4_alloc_test_output( uint32_t i )
+{
+    ps4_alloc_test_counting = true;
+
+    if (i % 50 == 0) {
+        ps4_cmd_t cmd = {0};
+
+        cmd.r = i;
+        cmd.g = i >> 8;
+        cmd.b = 0x40;
+        ps4Cmd( cmd );
+    }
+
+    if (i % 100 == 25) {
+        ps4_cmd_t cmd = {0};
+
+        cmd.rumble_left_intensity = i;
+        ps4CmdStatus( ps4CmdPost( cmd ) );
+    }
+
+    if (i % 500 == 75) {
+        ps4_rumble_step_t step = { .heavy = 0xc0, .light = 0x40, .duration_ms = 150 };
+
+        ps4RumblePlaySteps( ps4_rumble_motor_both, &step, 1, 2, 0 );
+    }
+
+    if (i % 2000 == 100) {
+        ps4LightbarPulse( 0x00, 0x40, 0xff, 600 );
+    }
+
+    if (i % 2000 == 1100) {
+        ps4LightbarFade( 0xff, 0x20, 0x00, 400 );
+    }
+
+    ps4_alloc_test_counting = false;
+}
+
+
+int main( void )
+{
+    static const uint8_t short_report[] = { 0xa1, 0x01, 0x80, 0x80, 0x80, 0x80, 0x08, 0x00, 0x00, 0x00, 0x00 };
+    uint8_t report[79];
+    ps4_alloc_stats_t before;
+    ps4_alloc_stats_t after;
+    int failures = 0;
+
+    ps4_fuzz_init();
+
+    const tL2CAP_APPL_INFO *hidc = ps4_fuzz_l2cap( BT_PSM_HIDC );
+    const tL2CAP_APPL_INFO *hidi = ps4_fuzz_l2cap( BT_PSM_HIDI );
+
+    if (hidc == NULL || hidi == NULL) {
+        fprintf( stderr, "ps4_alloc_test: the L2CAP services were not registered\n" );
+        return 1;
+    }
+
+    // Connecting may allocate, streaming may not
+    ps4_alloc_test_connect( hidc, PS4_ALLOC_TEST_HIDC_CID, BT_PSM_HIDC, 1 );
+    ps4_alloc_test_connect( hidi, PS4_ALLOC_TEST_HIDI_CID, BT_PSM_HIDI, 2 );
+
+    hidi->pL2CA_DataInd_Cb( PS4_ALLOC_TEST_HIDI_CID, ps4_fuzz_buffer( short_report, sizeof(short_report) ) );
+    ps4_fuzz_advance( PS4_ALLOC_TEST_INTERVAL_US );
+    hidi->pL2CA_DataInd_Cb( PS4_ALLOC_TEST_HIDI_CID, ps4_fuzz_buffer( report, ps4_alloc_test_full_report( report, 0 ) ) );
+
+    if (ps4GetConnectionState() != ps4_connection_state_streaming) {
+        fprintf( stderr, "ps4_alloc_test: the controller is not streaming\n" );
+        return 1;
+    }
+
+    ps4GetAllocStats( &before );
+
+    for (uint32_t i = 1; i <= PS4_ALLOC_TEST_REPORTS; i++) {
+        ps4_alloc_test_output( i );
+        ps4_alloc_test_advance( PS4_ALLOC_TEST_INTERVAL_US );
+        ps4_alloc_test_receive( hidi, report, ps4_alloc_test_full_report( report, i ) );
+    }
+
+    ps4GetAllocStats( &after );
+
+    uint32_t send_buffers = after.send_buffers - before.send_buffers;
+
+    printf( "ps4_alloc_test: %u reports, %u send buffers, %u allocations, %u timers created\n",
+            PS4_ALLOC_TEST_REPORTS, (unsigned)send_buffers, (unsigned)ps4_alloc_test_mallocs,
+            (unsigned)ps4_alloc_test_timers );
+
+    if (ps4GetConnectionState() != ps4_connection_state_streaming) {
+        fprintf( stderr, "ps4_alloc_test: the controller stopped streaming\n" );
+        failures++;
+    }
+
+    if (send_buffers == 0) {
+        fprintf( stderr, "ps4_alloc_test: no output report was sent\n" );
+        failures++;
+    }
+
+    if (ps4_alloc_test_mallocs != send_buffers) {
+        fprintf( stderr, "ps4_alloc_test: %u allocations besides the send buffers\n",
+                 (unsigned)(ps4_alloc_test_mallocs - send_buffers) );
+        failures++;
+    }
+
+    if (ps4_alloc_test_timers != 0) {
+        fprintf( stderr, "ps4_alloc_test: %u timers created while streaming\n", (unsigned)ps4_alloc_test_timers );
+        failures++;
+    }
+
+    if (after.allocs != before.allocs || after.failures != before.failures) {
+        fprintf( stderr, "ps4_alloc_test: ps4GetAllocStats counted %u allocations and %u failures\n",
+                 (unsigned)(after.allocs - before.allocs), (unsigned)(after.failures - before.failures) );
+        failures++;
+    }
+
+    hidi->pL2CA_DisconnectInd_Cb( PS4_ALLOC_TEST_HIDI_CID, false );
+    hidc->pL2CA_DisconnectInd_Cb( PS4_ALLOC_TEST_HIDC_CID, false );
+
+    return failures == 0 ? 0 : 1;
+}
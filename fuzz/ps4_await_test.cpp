@@ -0,0 +1,239 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "Ps4Controller.h"
+
+extern "C" {
+#include "ps4_fuzz.h"
+}
+
+
+/* Drives the awaitables of the Arduino wrapper, built as C++20, through
+ * the simulated transport: a controller connects, streams, presses
+ * buttons, goes quiet and disconnects while coroutines wait on it.
+ *
+ * Two of the waits race the change they wait for: it happens between
+ * await_ready and await_suspend, as when another task makes it right after
+ * the awaiter found it had not happened. The coroutine must then resume
+ * right away rather than wait for a change that already passed. */
+
+#ifndef PS4_COROUTINES
+#error "the awaitables need a compiler with C++20 coroutines"
+#endif
+
+#define PS4_AWAIT_TEST_INTERVAL_US  4000
+
+#define PS4_AWAIT_TEST_HIDC_CID     0x40
+#define PS4_AWAIT_TEST_HIDI_CID     0x41
+
+typedef struct {
+    bool done;
+    bool result;
+    ps4_event_t event;
+} ps4_await_test_wait_t;
+
+static BD_ADDR ps4_await_test_addr = { 0x1c, 0x66, 0x6d, 0x00, 0x00, 0x04 };
+
+static const tL2CAP_APPL_INFO *ps4_await_test_hidc = NULL;
+static const tL2CAP_APPL_INFO *ps4_await_test_hidi = NULL;
+static uint32_t ps4_await_test_counter = 0;
+static int ps4_await_test_checks = 0;
+static int ps4_await_test_failures = 0;
+
+
+/* Does what another task would between await_ready and await_suspend */
+struct ps4_await_test_race {
+    Ps4Controller::Awaiter awaiter;
+    void (*meanwhile)();
+
+    bool await_ready()
+    {
+        if (awaiter.await_ready()) {
+            return true;
+        }
+
+        meanwhile();
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) { return awaiter.await_suspend(handle); }
+    Ps4Controller::Awaiter::Result await_resume() const { return awaiter.await_resume(); }
+};
+
+
+template<typename A>
+static Ps4Controller::Task ps4_await_test_wait( A awaiter, ps4_await_test_wait_t *wait )
+{
+    Ps4Controller::Awaiter::Result result = co_await awaiter;
+
+    wait->result = result.result;
+    wait->event = result.event;
+    wait->done = true;
+}
+
+
+static void ps4_await_test_check( const char *name, const ps4_await_test_wait_t &wait, bool done, bool result )
+{
+    ps4_await_test_checks++;
+
+    if (wait.done != done || (done && wait.result != result)) {
+        fprintf( stderr, "ps4_await_test: %s: %s, %s, expected %s, %s\n", name,
+                 wait.done ? "resumed" : "waiting", wait.result ? "true" : "false",
+                 done ? "resumed" : "waiting", result ? "true" : "false" );
+        ps4_await_test_failures++;
+    }
+}
+
+
+/********************************************************************************/
+/*                      S I M U L A T E D    C O N T R O L L E R                */
+/********************************************************************************/
+
+static void ps4_await_test_channel( const tL2CAP_APPL_INFO *info, uint16_t cid, uint16_t psm, uint8_t id )
+{
+    tL2CAP_CFG_INFO cfg = {};
+
+    info->pL2CA_ConnectInd_Cb( ps4_await_test_addr, cid, psm, id );
+
+    cfg.mtu_present = true;
+    cfg.mtu = 672;
+    info->pL2CA_ConfigInd_Cb( cid, &cfg );
+
+    cfg.result = 0;
+    info->pL2CA_ConfigCfm_Cb( cid, &cfg );
+}
+
+
+/* Sends a 0x11 input report with a valid CRC, the left stick at lx and
+ * the face buttons given by the upper nibble of buttons */
+static void ps4_await_test_report( uint8_t lx, uint8_t buttons )
+{
+    uint8_t report[79] = {};
+    uint8_t *fields = report + 4;
+    uint16_t timestamp = ps4_await_test_counter * 188;
+
+    report[0] = 0xa1;
+    report[1] = 0x11;
+    report[2] = 0xc0;
+
+    fields[0] = lx;
+    fields[1] = 0x80;
+    fields[2] = 0x80;
+    fields[3] = 0x80;
+    fields[4] = 0x08 | buttons;
+    fields[6] = (ps4_await_test_counter & 0x3f) << 2;
+    fields[9] = timestamp & 0xff;
+    fields[10] = timestamp >> 8;
+    fields[29] = 0x1b;
+
+    uint32_t crc = ps4Crc32( 0, report, 75 );
+
+    report[75] = crc;
+    report[76] = crc >> 8;
+    report[77] = crc >> 16;
+    report[78] = crc >> 24;
+
+    ps4_await_test_counter++;
+
+    ps4_await_test_hidi->pL2CA_DataInd_Cb( PS4_AWAIT_TEST_HIDI_CID, ps4_fuzz_buffer( report, sizeof(report) ) );
+    ps4_fuzz_advance( PS4_AWAIT_TEST_INTERVAL_US );
+}
+
+
+static void ps4_await_test_connect()
+{
+    ps4_await_test_channel( ps4_await_test_hidc, PS4_AWAIT_TEST_HIDC_CID, BT_PSM_HIDC, 1 );
+    ps4_await_test_channel( ps4_await_test_hidi, PS4_AWAIT_TEST_HIDI_CID, BT_PSM_HIDI, 2 );
+    ps4_await_test_report( 0x80, 0 );
+}
+
+
+static void ps4_await_test_disconnect()
+{
+    ps4_await_test_hidi->pL2CA_DisconnectInd_Cb( PS4_AWAIT_TEST_HIDI_CID, false );
+    ps4_await_test_hidc->pL2CA_DisconnectInd_Cb( PS4_AWAIT_TEST_HIDC_CID, false );
+    ps4_fuzz_advance( 1000000 );
+}
+
+
+static void ps4_await_test_begin()
+{
+    Ps4.beginAsync();
+}
+
+
+int main( void )
+{
+    ps4_interest_t stick = {};
+    ps4_await_test_wait_t ready = {};
+    ps4_await_test_wait_t connected = {};
+    ps4_await_test_wait_t cross = {};
+    ps4_await_test_wait_t moved = {};
+    ps4_await_test_wait_t timeout = {};
+    ps4_await_test_wait_t lost = {};
+    ps4_await_test_wait_t reconnected = {};
+    ps4_await_test_wait_t already = {};
+
+    // Bluetooth comes up right after the start was found not done
+    ps4_await_test_wait( ps4_await_test_race{ Ps4.ready(), ps4_await_test_begin }, &ready );
+    ps4_await_test_check( "ready, racing the start", ready, true, true );
+
+    ps4_await_test_hidc = ps4_fuzz_l2cap( BT_PSM_HIDC );
+    ps4_await_test_hidi = ps4_fuzz_l2cap( BT_PSM_HIDI );
+
+    if (ps4_await_test_hidc == NULL || ps4_await_test_hidi == NULL) {
+        fprintf( stderr, "ps4_await_test: the L2CAP services were not registered\n" );
+        return 1;
+    }
+
+    ps4_await_test_wait( Ps4.connected(), &connected );
+    ps4_await_test_check( "connected, before connecting", connected, false, false );
+
+    ps4_await_test_connect();
+    ps4_await_test_check( "connected", connected, true, true );
+
+    ps4_await_test_wait( Ps4.buttonDown( ps4_interest_button_cross ), &cross );
+    ps4_await_test_report( 0x80, 0x40 );
+    ps4_await_test_check( "cross, circle pressed", cross, false, false );
+
+    ps4_await_test_report( 0x80, 0x20 );
+    ps4_await_test_check( "cross", cross, true, true );
+
+    if (cross.done && !(ps4ButtonMask( &cross.event.button_down ) & ps4_interest_button_cross)) {
+        fprintf( stderr, "ps4_await_test: cross: resumed without the cross pressed\n" );
+        ps4_await_test_failures++;
+    }
+
+    stick.analog = ps4_interest_analog_stick_lx;
+    ps4_await_test_wait( Ps4.nextEvent( stick ), &moved );
+    ps4_await_test_report( 0x80, 0x20 );
+    ps4_await_test_check( "stick, unchanged", moved, false, false );
+
+    ps4_await_test_report( 0xc0, 0x00 );
+    ps4_await_test_check( "stick", moved, true, true );
+
+    ps4_await_test_wait( Ps4.buttonDown( ps4_interest_button_triangle, 50 ), &timeout );
+
+    for (int i = 0; i < 25; i++) {
+        ps4_await_test_report( 0xc0, 0x00 );
+    }
+
+    ps4_await_test_check( "triangle, timed out", timeout, true, false );
+
+    ps4_await_test_wait( Ps4.buttonDown( ps4_interest_button_triangle ), &lost );
+    ps4_await_test_disconnect();
+    ps4_await_test_check( "triangle, disconnected", lost, true, false );
+
+    // The controller connects right after it was found not connected
+    ps4_await_test_wait( ps4_await_test_race{ Ps4.connected(), ps4_await_test_connect }, &reconnected );
+    ps4_await_test_check( "connected, racing the connection", reconnected, true, true );
+
+    ps4_await_test_wait( Ps4.connected(), &already );
+    ps4_await_test_check( "connected, already", already, true, true );
+
+    ps4_await_test_disconnect();
+
+    printf( "ps4_await_test: %d awaits checked, %d failed\n", ps4_await_test_checks, ps4_await_test_failures );
+
+    return ps4_await_test_failures == 0 ? 0 : 1;
+}
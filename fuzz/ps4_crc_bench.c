@@ -0,0 +1,89 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include "include/ps4.h"
+
+
+/* Host counterpart of examples/Ps4CrcBenchmark: measures the throughput of
+ * ps4Crc32 over the covered part of a 0x11 report and over a larger buffer,
+ * against a bytewise CRC-32 for comparison. Built with optimization and
+ * without the sanitizers, see the Makefile. */
+
+static uint8_t ps4_crc_bench_buffer[4096];
+
+
+/* The classic bytewise CRC-32, the table computed on the fly */
+static uint32_t ps4_crc_bench_bytewise( uint32_t crc, const uint8_t *data, size_t len )
+{
+    static uint32_t table[256];
+
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+
+            for (int bit = 0; bit < 8; bit++) {
+                c = c & 1 ? (c >> 1) ^ 0xedb88320 : c >> 1;
+            }
+
+            table[i] = c;
+        }
+    }
+
+    crc = ~crc;
+
+    while (len--) {
+        crc = (crc >> 8) ^ table[(crc ^ *data++) & 0xff];
+    }
+
+    return ~crc;
+}
+
+
+static double ps4_crc_bench_now()
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+
+static void ps4_crc_bench_run( const char *name, uint32_t (*crc32)( uint32_t, const uint8_t*, size_t ),
+                               size_t len, int rounds )
+{
+    uint32_t crc = 0;
+    double start = ps4_crc_bench_now();
+
+    for (int i = 0; i < rounds; i++) {
+        crc = crc32( crc, ps4_crc_bench_buffer, len );
+    }
+
+    double elapsed = ps4_crc_bench_now() - start;
+
+    printf( "ps4_crc_bench: %-9s %4u bytes: %8.4f us, %8.1f MB/s (crc %08x)\n", name, (unsigned)len,
+            elapsed / rounds, len * rounds / elapsed, (unsigned)crc );
+}
+
+
+int main( void )
+{
+    for (size_t i = 0; i < sizeof(ps4_crc_bench_buffer); i++) {
+        ps4_crc_bench_buffer[i] = i * 7;
+    }
+
+    if (ps4Crc32( 0, ps4_crc_bench_buffer, sizeof(ps4_crc_bench_buffer) )
+        != ps4_crc_bench_bytewise( 0, ps4_crc_bench_buffer, sizeof(ps4_crc_bench_buffer) )) {
+        fprintf( stderr, "ps4_crc_bench: ps4Crc32 disagrees with the bytewise CRC-32\n" );
+        return 1;
+    }
+
+    // Covered part of a 0x11 report, with its header
+    ps4_crc_bench_run( "ps4Crc32", ps4Crc32, 75, 200000 );
+    ps4_crc_bench_run( "bytewise", ps4_crc_bench_bytewise, 75, 200000 );
+    ps4_crc_bench_run( "ps4Crc32", ps4Crc32, sizeof(ps4_crc_bench_buffer), 5000 );
+    ps4_crc_bench_run( "bytewise", ps4_crc_bench_bytewise, sizeof(ps4_crc_bench_buffer), 5000 );
+
+    return 0;
+}
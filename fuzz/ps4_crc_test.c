@@ -0,0 +1,98 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "include/ps4.h"
+#include "include/ps4_int.h"
+#include "ps4_fuzz.h"
+
+
+/* Checks the CRC of the 0x11 output reports the library sends against
+ * reports whose CRC is known to be good, that is the CRC-32 of a DATA OUTPUT
+ * header (0xa2), the report ID and the data, as hid-sony and hid-playstation
+ * compute it. The reports themselves go out behind a SET_REPORT header.
+ *
+ * The CRC of the first report sent is calculated over the whole report,
+ * the others are patched for the bytes that changed: each report is sent
+ * patched from the one before it, and from everything off. */
+
+typedef struct {
+    const char *name;
+    uint8_t interval;
+    ps4_cmd_t cmd;
+    uint32_t crc;
+} ps4_crc_test_case_t;
+
+static const ps4_crc_test_case_t ps4_crc_test_cases[] = {
+    { "everything off", 0, { 0 }, 0x512a393e },
+    { "rumble, lightbar, flash and interval", 4,
+      { .rumble_right_intensity = 0x80, .rumble_left_intensity = 0x20,
+        .r = 0xff, .g = 0x40, .b = 0x00, .flash_on = 0x10, .flash_off = 0x20 }, 0x61acca09 },
+    { "everything off again", 0, { 0 }, 0x512a393e }
+};
+
+
+static int ps4_crc_test_send( const ps4_crc_test_case_t *test )
+{
+    uint8_t report[PS4_HID_BUFFER_SIZE];
+
+    ps4_fuzz_sent_clear();
+    ps4_output_set_interval( test->interval );
+    ps4_output_send( &test->cmd );
+
+    uint16_t len = ps4_fuzz_sent( 0, report, sizeof(report) );
+
+    if (len != PS4_HID_BUFFER_SIZE) {
+        fprintf( stderr, "ps4_crc_test: %s: sent %u bytes\n", test->name, len );
+        return 1;
+    }
+
+    uint32_t crc = (uint32_t)report[75] | (uint32_t)report[76] << 8
+                 | (uint32_t)report[77] << 16 | (uint32_t)report[78] << 24;
+
+    if (report[0] != (hid_cmd_code_set_report | hid_cmd_code_type_output)
+        || report[1] != hid_cmd_identifier_ps4_control) {
+        fprintf( stderr, "ps4_crc_test: %s: header %02x %02x\n", test->name, report[0], report[1] );
+        return 1;
+    }
+
+    if (crc != test->crc) {
+        fprintf( stderr, "ps4_crc_test: %s: crc %08x, expected %08x\n", test->name,
+                 (unsigned)crc, (unsigned)test->crc );
+        return 1;
+    }
+
+    return 0;
+}
+
+
+int main( void )
+{
+    static const ps4_cmd_t off = {0};
+    int failures = 0;
+
+    ps4_fuzz_init();
+
+    if (ps4Crc32( 0, (const uint8_t*)"123456789", 9 ) != 0xcbf43926) {
+        fprintf( stderr, "ps4_crc_test: wrong CRC-32 check value\n" );
+        failures++;
+    }
+
+    size_t count = sizeof(ps4_crc_test_cases) / sizeof(ps4_crc_test_cases[0]);
+
+    // Patched from the report before
+    for (size_t i = 0; i < count; i++) {
+        failures += ps4_crc_test_send( &ps4_crc_test_cases[i] );
+    }
+
+    // Patched from everything off
+    for (size_t i = 0; i < count; i++) {
+        ps4_output_set_interval( 0 );
+        ps4_output_send( &off );
+        failures += ps4_crc_test_send( &ps4_crc_test_cases[i] );
+    }
+
+    printf( "ps4_crc_test: %u reports checked, %d failed\n", (unsigned)(2 * count), failures );
+
+    return failures == 0 ? 0 : 1;
+}
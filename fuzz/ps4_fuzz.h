@@ -0,0 +1,59 @@
+#ifndef PS4_FUZZ_H
+#define PS4_FUZZ_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "stack/bt_types.h"
+#include "stack/l2c_api.h"
+
+
+/********************************************************************************/
+/*                      H O S T    P L A T F O R M                              */
+/********************************************************************************/
+
+/* The harnesses run the library on the host, on top of ps4_fuzz_platform.c.
+ * Time only moves when a harness advances it, which fires the timers that
+ * became due, in order, on the calling thread. */
+
+void ps4_fuzz_init();
+void ps4_fuzz_advance( int64_t us );
+
+/* Callbacks the library registered with L2CAP for a PSM, NULL if none */
+const tL2CAP_APPL_INFO* ps4_fuzz_l2cap( uint16_t psm );
+
+/* Copies a payload into a buffer the way the stack hands it over, which
+ * the data indication callback takes ownership of */
+BT_HDR* ps4_fuzz_buffer( const uint8_t *data, uint16_t len );
+
+/* Payloads written to L2CAP since ps4_fuzz_sent_clear. The first 16 are kept:
+ * ps4_fuzz_sent copies one of them, and returns its length, 0 if there is
+ * no such payload. ps4_fuzz_sent_count counts them all */
+uint16_t ps4_fuzz_sent( uint16_t index, uint8_t *data, uint16_t max );
+uint16_t ps4_fuzz_sent_count();
+void ps4_fuzz_sent_clear();
+
+/* Models the link as half duplex, each payload written to L2CAP keeping it
+ * busy for us, one after the other, 0 to turn the model off.
+ * ps4_fuzz_link_busy returns how long the link is still busy for, which a
+ * harness waits out before an input report can arrive */
+void ps4_fuzz_set_airtime( int64_t us );
+int64_t ps4_fuzz_link_busy();
+
+/* Functions of a ps4_storage_t keeping each key in a file of the directory
+ * given as the object, for the known controllers to outlive the process */
+bool ps4_fuzz_file_load( void *dir, const char *key, void *data, size_t len );
+bool ps4_fuzz_file_save( void *dir, const char *key, const void *data, size_t len );
+
+/* Runs a function on a thread playing the Bluetooth task, on a stack of
+ * PS4_FUZZ_STACK_SIZE bytes filled as FreeRTOS fills new stacks, and waits
+ * for it to return.
+ * pxTaskGetStackStart and uxTaskGetStackHighWaterMark report on that stack
+ * meanwhile */
+#define PS4_FUZZ_STACK_SIZE (64 * 1024)
+
+void ps4_fuzz_on_stack( void (*function)( void *arg ), void *arg );
+
+int LLVMFuzzerTestOneInput( const uint8_t *data, size_t size );
+
+#endif
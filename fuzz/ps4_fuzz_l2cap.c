@@ -0,0 +1,99 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "include/ps4.h"
+#include "include/ps4_int.h"
+#include "ps4_fuzz.h"
+
+
+/* Runs a whole connection through the L2CAP callbacks the library registered,
+ * the way Bluedroid drives them from the BTU task: both channels connect and
+ * are configured, a sequence of frames arrives, then both disconnect.
+ *
+ * Input:   [cid] [frame] [frame] ...
+ *          cid             picks the channel ids the stack allocates
+ *
+ * Frame:   [op] [len] [payload ...]
+ *          op bits 0-1     0 data on the control channel
+ *                          1 data on the interrupt channel
+ *                          2 data on a channel that is not the controller's
+ *                          3 congestion, on when bit 2 is set
+ *          op bits 3-7     milliseconds to let pass before the frame
+ *
+ * A frame is cut short at the end of the input. */
+
+static BD_ADDR ps4_fuzz_addr = { 0x1c, 0x66, 0x6d, 0x00, 0x00, 0x01 };
+
+
+static void ps4_fuzz_connect( const tL2CAP_APPL_INFO *info, uint16_t cid, uint16_t psm, uint8_t id )
+{
+    tL2CAP_CFG_INFO cfg = {0};
+
+    info->pL2CA_ConnectInd_Cb( ps4_fuzz_addr, cid, psm, id );
+
+    cfg.mtu_present = true;
+    cfg.mtu = 672;
+    info->pL2CA_ConfigInd_Cb( cid, &cfg );
+
+    cfg.result = 0;
+    info->pL2CA_ConfigCfm_Cb( cid, &cfg );
+}
+
+
+int LLVMFuzzerTestOneInput( const uint8_t *data, size_t size )
+{
+    if (size < 1) return 0;
+
+    ps4_fuzz_init();
+
+    const tL2CAP_APPL_INFO *hidc = ps4_fuzz_l2cap( BT_PSM_HIDC );
+    const tL2CAP_APPL_INFO *hidi = ps4_fuzz_l2cap( BT_PSM_HIDI );
+
+    if (hidc == NULL || hidi == NULL) abort();
+
+    uint16_t hidc_cid = 0x40 + (data[0] & 0x3f) * 2;
+    uint16_t hidi_cid = hidc_cid + 1;
+    size_t at = 1;
+
+    ps4_fuzz_connect( hidc, hidc_cid, BT_PSM_HIDC, 1 );
+    ps4_fuzz_connect( hidi, hidi_cid, BT_PSM_HIDI, 2 );
+
+    while (at + 2 <= size) {
+        uint8_t op = data[at];
+        uint16_t len = data[at + 1];
+
+        at += 2;
+
+        if (len > size - at) {
+            len = size - at;
+        }
+
+        ps4_fuzz_advance( (int64_t)(op >> 3) * 1000 );
+
+        switch (op & 0x03) {
+        case 0:
+            hidc->pL2CA_DataInd_Cb( hidc_cid, ps4_fuzz_buffer( data + at, len ) );
+            break;
+        case 1:
+            hidi->pL2CA_DataInd_Cb( hidi_cid, ps4_fuzz_buffer( data + at, len ) );
+            break;
+        case 2:
+            hidi->pL2CA_DataInd_Cb( hidi_cid + 1, ps4_fuzz_buffer( data + at, len ) );
+            break;
+        default:
+            hidc->pL2CA_CongestionStatus_Cb( hidc_cid, (op & 0x04) != 0 );
+            break;
+        }
+
+        at += len;
+    }
+
+    hidi->pL2CA_DisconnectInd_Cb( hidi_cid, false );
+    hidc->pL2CA_DisconnectInd_Cb( hidc_cid, false );
+
+    // Lets the disconnection settle before the next connection
+    ps4_fuzz_advance( 1000000 );
+
+    return 0;
+}
@@ -0,0 +1,41 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "ps4_fuzz.h"
+
+
+/* Driver for builds without libFuzzer: runs every file given, or stdin when
+ * there are none, which is how AFL hands over its inputs. Also replays the
+ * corpus and crashes under the sanitizers with any compiler. */
+
+static int ps4_fuzz_run( FILE *file )
+{
+    static uint8_t input[1 << 16];
+    size_t size = fread( input, 1, sizeof(input), file );
+
+    if (ferror( file )) return 1;
+
+    LLVMFuzzerTestOneInput( input, size );
+    return 0;
+}
+
+
+int main( int argc, char **argv )
+{
+    if (argc < 2) {
+        return ps4_fuzz_run( stdin );
+    }
+
+    for (int i = 1; i < argc; i++) {
+        FILE *file = fopen( argv[i], "rb" );
+
+        if (file == NULL || ps4_fuzz_run( file ) != 0) {
+            fprintf( stderr, "%s: cannot read %s\n", argv[0], argv[i] );
+            return 1;
+        }
+
+        fclose( file );
+    }
+
+    return 0;
+}
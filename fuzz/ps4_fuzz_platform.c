@@ -0,0 +1,612 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "include/ps4.h"
+#include "include/ps4_int.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_bt.h"
+#include "esp_bt_main.h"
+#include "esp_bt_device.h"
+#include "esp_gap_bt_api.h"
+#include "nvs.h"
+#include "stack/btm_api.h"
+#include "bta/bta_sys.h"
+#include "osi/allocator.h"
+#include "ps4_fuzz.h"
+
+
+/* Host implementations of the ESP-IDF, FreeRTOS and Bluedroid functions the
+ * library calls, just enough to run it single threaded under the harnesses.
+ * Nothing is sent anywhere: outgoing buffers are freed as the stack would,
+ * after the first few are copied for the tests to check. */
+
+#define PS4_FUZZ_TIMERS 32
+#define PS4_FUZZ_ALARMS 8
+#define PS4_FUZZ_PSMS   2
+#define PS4_FUZZ_SENT   16
+
+/* Byte FreeRTOS fills new stacks with */
+#define PS4_FUZZ_STACK_FILL 0xa5
+
+
+/********************************************************************************/
+/*                            L O C A L    T Y P E S                            */
+/********************************************************************************/
+
+struct esp_timer {
+    esp_timer_cb_t callback;
+    void *arg;
+    int64_t deadline;
+    uint64_t period;
+    bool active;
+    bool in_use;
+};
+
+/* A BTA timer, fired on the Bluetooth task */
+typedef struct {
+    TIMER_LIST_ENT *p_tle;
+    int64_t deadline;
+    bool active;
+} ps4_fuzz_alarm_t;
+
+typedef struct {
+    uint16_t psm;
+    const tL2CAP_APPL_INFO *info;
+} ps4_fuzz_service_t;
+
+typedef struct {
+    uint16_t len;
+    uint8_t data[PS4_HID_BUFFER_SIZE];
+} ps4_fuzz_payload_t;
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+static int64_t ps4_fuzz_now = 1000000;
+static struct esp_timer ps4_fuzz_timers[PS4_FUZZ_TIMERS];
+static ps4_fuzz_alarm_t ps4_fuzz_alarms[PS4_FUZZ_ALARMS];
+static ps4_fuzz_service_t ps4_fuzz_services[PS4_FUZZ_PSMS];
+
+/* The first payloads written to L2CAP since ps4_fuzz_sent_clear */
+static ps4_fuzz_payload_t ps4_fuzz_sent_payloads[PS4_FUZZ_SENT];
+static uint16_t ps4_fuzz_sent_total = 0;
+
+/* Time the link takes to carry a payload written to L2CAP, and the time it
+ * is done with the last one */
+static int64_t ps4_fuzz_airtime = 0;
+static int64_t ps4_fuzz_air_free = 0;
+
+static ps4_sample_t ps4_fuzz_batch[4];
+static const uint8_t *ps4_fuzz_retained = NULL;
+static volatile uint8_t ps4_fuzz_sink;
+
+/* The harness and the BTA timers play the Bluetooth task, and the esp_timer
+ * callbacks run on another */
+static int ps4_fuzz_tasks[2];
+static TaskHandle_t ps4_fuzz_task = &ps4_fuzz_tasks[0];
+
+/* Stack of the Bluetooth task while ps4_fuzz_on_stack runs a function */
+static uint8_t ps4_fuzz_stack[PS4_FUZZ_STACK_SIZE] __attribute__((aligned(64)));
+static uint8_t *ps4_fuzz_stack_start = NULL;
+
+
+/********************************************************************************/
+/*                      H A R N E S S    F U N C T I O N S                      */
+/********************************************************************************/
+
+/* Reads everything handed out, so the sanitizers see any byte that is not
+ * there. One raw report at a time is kept until the next one arrives. */
+static void ps4_fuzz_event( void *object, const ps4_t *ps4, const ps4_event_t *event )
+{
+    const uint8_t *bytes = (const uint8_t *)ps4;
+
+    for (size_t i = 0; i < sizeof(*ps4); i++) ps4_fuzz_sink ^= bytes[i];
+}
+
+static void ps4_fuzz_samples( void *object, const ps4_sample_t *samples, uint16_t count )
+{
+    for (uint16_t i = 0; i < count; i++) ps4_fuzz_event( object, &samples[i].ps4, &samples[i].event );
+}
+
+static void ps4_fuzz_raw( void *object, const uint8_t *report, uint16_t len )
+{
+    for (uint16_t i = 0; i < len; i++) ps4_fuzz_sink ^= report[i];
+
+    if (ps4_fuzz_retained != NULL) {
+        ps4ReportRelease( ps4_fuzz_retained );
+    }
+
+    ps4_fuzz_retained = ps4ReportRetain( report );
+}
+
+void ps4_fuzz_init()
+{
+    static bool initialized = false;
+
+    if (initialized) return;
+
+    initialized = true;
+    ps4Init();
+
+    // Short enough for the frame delays to reach
+    ps4SetLinkTimeout( 100 );
+
+    ps4_subscriber_t every = {0};
+    every.interest.button = ps4_interest_button_all;
+    every.interest.analog = ps4_interest_analog_all;
+    every.interest.sensor = ps4_interest_sensor_all;
+    every.interest.status = ps4_interest_status_all;
+    every.event_cb = ps4_fuzz_event;
+    every.raw_cb = ps4_fuzz_raw;
+    ps4Subscribe( &every );
+
+    ps4_subscriber_t latest = every;
+    latest.raw_cb = NULL;
+    latest.delivery = ps4_delivery_latest;
+    latest.interval_ms = 5;
+    ps4Subscribe( &latest );
+
+    ps4_subscriber_t batched = latest;
+    batched.event_cb = NULL;
+    batched.delivery = ps4_delivery_batched;
+    batched.batch_cb = ps4_fuzz_samples;
+    batched.batch = ps4_fuzz_batch;
+    batched.batch_size = sizeof(ps4_fuzz_batch) / sizeof(ps4_fuzz_batch[0]);
+    ps4Subscribe( &batched );
+}
+
+
+void ps4_fuzz_advance( int64_t us )
+{
+    int64_t target = ps4_fuzz_now + us;
+
+    for (;;) {
+        struct esp_timer *due = NULL;
+
+        for (int i = 0; i < PS4_FUZZ_TIMERS; i++) {
+            struct esp_timer *timer = &ps4_fuzz_timers[i];
+
+            if (timer->active && timer->deadline <= target
+                && (due == NULL || timer->deadline < due->deadline)) {
+                due = timer;
+            }
+        }
+
+        ps4_fuzz_alarm_t *alarm = NULL;
+
+        for (int i = 0; i < PS4_FUZZ_ALARMS; i++) {
+            ps4_fuzz_alarm_t *next = &ps4_fuzz_alarms[i];
+
+            if (next->active && next->deadline <= target
+                && (alarm == NULL || next->deadline < alarm->deadline)) {
+                alarm = next;
+            }
+        }
+
+        if (alarm != NULL && (due == NULL || alarm->deadline < due->deadline)) {
+            if (alarm->deadline > ps4_fuzz_now) {
+                ps4_fuzz_now = alarm->deadline;
+            }
+
+            alarm->active = false;
+            alarm->p_tle->in_use = false;
+
+            TaskHandle_t task = ps4_fuzz_task;
+
+            ps4_fuzz_task = &ps4_fuzz_tasks[0];
+            alarm->p_tle->p_cback( alarm->p_tle );
+            ps4_fuzz_task = task;
+            continue;
+        }
+
+        if (due == NULL) break;
+
+        if (due->deadline > ps4_fuzz_now) {
+            ps4_fuzz_now = due->deadline;
+        }
+
+        if (due->period > 0) {
+            due->deadline += due->period;
+        } else {
+            due->active = false;
+        }
+
+        TaskHandle_t task = ps4_fuzz_task;
+
+        ps4_fuzz_task = &ps4_fuzz_tasks[1];
+        due->callback( due->arg );
+        ps4_fuzz_task = task;
+    }
+
+    ps4_fuzz_now = target;
+}
+
+
+typedef struct {
+    void (*function)( void *arg );
+    void *arg;
+} ps4_fuzz_thread_t;
+
+static void *ps4_fuzz_thread( void *arg )
+{
+    ps4_fuzz_thread_t *thread = arg;
+
+    thread->function( thread->arg );
+    return NULL;
+}
+
+void ps4_fuzz_on_stack( void (*function)( void *arg ), void *arg )
+{
+    ps4_fuzz_thread_t thread = { function, arg };
+    pthread_attr_t attr;
+    pthread_t id;
+
+    memset( ps4_fuzz_stack, PS4_FUZZ_STACK_FILL, sizeof(ps4_fuzz_stack) );
+    ps4_fuzz_stack_start = ps4_fuzz_stack;
+
+    if (pthread_attr_init( &attr ) != 0
+        || pthread_attr_setstack( &attr, ps4_fuzz_stack, sizeof(ps4_fuzz_stack) ) != 0
+        || pthread_create( &id, &attr, ps4_fuzz_thread, &thread ) != 0) {
+        abort();
+    }
+
+    pthread_join( id, NULL );
+    ps4_fuzz_stack_start = NULL;
+    pthread_attr_destroy( &attr );
+}
+
+
+const tL2CAP_APPL_INFO* ps4_fuzz_l2cap( uint16_t psm )
+{
+    for (int i = 0; i < PS4_FUZZ_PSMS; i++) {
+        if (ps4_fuzz_services[i].info != NULL && ps4_fuzz_services[i].psm == psm) {
+            return ps4_fuzz_services[i].info;
+        }
+    }
+
+    return NULL;
+}
+
+
+BT_HDR* ps4_fuzz_buffer( const uint8_t *data, uint16_t len )
+{
+    BT_HDR *p_buf = (BT_HDR *)osi_malloc(sizeof(BT_HDR) + L2CAP_MIN_OFFSET + len);
+
+    if (p_buf == NULL) abort();
+
+    memset( p_buf, 0, sizeof(BT_HDR) + L2CAP_MIN_OFFSET );
+    p_buf->offset = L2CAP_MIN_OFFSET;
+    p_buf->len = len;
+
+    if (len > 0) {
+        memcpy( p_buf->data + p_buf->offset, data, len );
+    }
+
+    return p_buf;
+}
+
+
+uint16_t ps4_fuzz_sent( uint16_t index, uint8_t *data, uint16_t max )
+{
+    if (index >= ps4_fuzz_sent_total || index >= PS4_FUZZ_SENT) return 0;
+
+    const ps4_fuzz_payload_t *payload = &ps4_fuzz_sent_payloads[index];
+    uint16_t len = payload->len < max ? payload->len : max;
+
+    memcpy( data, payload->data, len );
+    return len;
+}
+
+
+uint16_t ps4_fuzz_sent_count()
+{
+    return ps4_fuzz_sent_total;
+}
+
+
+void ps4_fuzz_sent_clear()
+{
+    ps4_fuzz_sent_total = 0;
+}
+
+
+void ps4_fuzz_set_airtime( int64_t us )
+{
+    ps4_fuzz_airtime = us;
+}
+
+
+int64_t ps4_fuzz_link_busy()
+{
+    return ps4_fuzz_air_free > ps4_fuzz_now ? ps4_fuzz_air_free - ps4_fuzz_now : 0;
+}
+
+
+/* Each key is a file of the directory, holding the value as is */
+bool ps4_fuzz_file_load( void *dir, const char *key, void *data, size_t len )
+{
+    char path[256];
+    FILE *file;
+    size_t read;
+
+    snprintf( path, sizeof(path), "%s/%s", (const char*)dir, key );
+
+    if ((file = fopen( path, "rb" )) == NULL) {
+        return false;
+    }
+
+    read = fread( data, 1, len, file );
+
+    // Longer than len is as wrong as shorter
+    bool whole = read == len && fgetc( file ) == EOF;
+
+    fclose( file );
+    return whole;
+}
+
+
+bool ps4_fuzz_file_save( void *dir, const char *key, const void *data, size_t len )
+{
+    char path[256];
+    FILE *file;
+
+    snprintf( path, sizeof(path), "%s/%s", (const char*)dir, key );
+
+    if ((file = fopen( path, "wb" )) == NULL) {
+        return false;
+    }
+
+    bool written = fwrite( data, 1, len, file ) == len;
+
+    return fclose( file ) == 0 && written;
+}
+
+
+/********************************************************************************/
+/*                      F R E E R T O S                                         */
+/********************************************************************************/
+
+void vPortEnterCritical( portMUX_TYPE *mux ) { (void)mux; }
+void vPortExitCritical( portMUX_TYPE *mux ) { (void)mux; }
+int xPortGetCoreID( void ) { return 0; }
+
+void vTaskDelay( TickType_t ticks ) { ps4_fuzz_advance( (int64_t)ticks * portTICK_PERIOD_MS * 1000 ); }
+TaskHandle_t xTaskGetCurrentTaskHandle( void ) { return ps4_fuzz_task; }
+/* Only the Bluetooth task has a stack of known bounds, and only while
+ * ps4_fuzz_on_stack runs on it. The high water mark is in bytes, as with
+ * ESP-IDF, counted from the bottom up to the first byte not filled */
+uint8_t *pxTaskGetStackStart( TaskHandle_t task )
+{
+    return task == &ps4_fuzz_tasks[0] ? ps4_fuzz_stack_start : NULL;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark( TaskHandle_t task )
+{
+    const uint8_t *start = pxTaskGetStackStart( task );
+    UBaseType_t free = 0;
+
+    if (start == NULL) return 4096;
+
+    while (free < PS4_FUZZ_STACK_SIZE && start[free] == PS4_FUZZ_STACK_FILL) free++;
+
+    return free;
+}
+const char *pcTaskGetTaskName( TaskHandle_t task ) { (void)task; return "fuzz"; }
+
+/* A task runs to completion as it is created, on another task than the
+ * harness, and deleting it only returns */
+BaseType_t xTaskCreate( TaskFunction_t function, const char *name, uint32_t stack, void *arg,
+                        UBaseType_t priority, TaskHandle_t *handle )
+{
+    TaskHandle_t task = ps4_fuzz_task;
+
+    if (handle != NULL) *handle = &ps4_fuzz_tasks[1];
+
+    ps4_fuzz_task = &ps4_fuzz_tasks[1];
+    function( arg );
+    ps4_fuzz_task = task;
+    return pdPASS;
+}
+
+void vTaskDelete( TaskHandle_t task ) { (void)task; }
+
+uint32_t xthal_get_ccount( void ) { return (uint32_t)(ps4_fuzz_now * 240); }
+
+
+/********************************************************************************/
+/*                      E S P    T I M E R                                      */
+/********************************************************************************/
+
+int64_t esp_timer_get_time( void ) { return ps4_fuzz_now; }
+
+esp_err_t esp_timer_create( const esp_timer_create_args_t *args, esp_timer_handle_t *handle )
+{
+    for (int i = 0; i < PS4_FUZZ_TIMERS; i++) {
+        struct esp_timer *timer = &ps4_fuzz_timers[i];
+
+        if (!timer->in_use) {
+            memset( timer, 0, sizeof(*timer) );
+            timer->callback = args->callback;
+            timer->arg = args->arg;
+            timer->in_use = true;
+            *handle = timer;
+            return ESP_OK;
+        }
+    }
+
+    return ESP_ERR_NO_MEM;
+}
+
+esp_err_t esp_timer_start_once( esp_timer_handle_t timer, uint64_t timeout_us )
+{
+    if (timer->active) return ESP_FAIL;
+
+    timer->deadline = ps4_fuzz_now + timeout_us;
+    timer->period = 0;
+    timer->active = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic( esp_timer_handle_t timer, uint64_t period )
+{
+    if (timer->active) return ESP_FAIL;
+
+    timer->period = period > 0 ? period : 1;
+    timer->deadline = ps4_fuzz_now + timer->period;
+    timer->active = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop( esp_timer_handle_t timer )
+{
+    if (!timer->active) return ESP_FAIL;
+
+    timer->active = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete( esp_timer_handle_t timer )
+{
+    timer->active = false;
+    timer->in_use = false;
+    return ESP_OK;
+}
+
+
+/********************************************************************************/
+/*                      E S P    S Y S T E M                                    */
+/********************************************************************************/
+
+static uint8_t ps4_fuzz_mac[6];
+
+esp_err_t esp_base_mac_addr_set( const uint8_t *mac ) { memcpy( ps4_fuzz_mac, mac, 6 ); return ESP_OK; }
+esp_err_t esp_base_mac_addr_get( uint8_t *mac ) { memcpy( mac, ps4_fuzz_mac, 6 ); return ESP_OK; }
+const uint8_t *esp_bt_dev_get_address( void ) { return ps4_fuzz_mac; }
+uint32_t esp_get_free_heap_size( void ) { return 200000; }
+uint32_t esp_get_minimum_free_heap_size( void ) { return 150000; }
+
+esp_err_t esp_bt_controller_init( esp_bt_controller_config_t *cfg ) { (void)cfg; return ESP_OK; }
+esp_err_t esp_bt_controller_enable( esp_bt_mode_t mode ) { (void)mode; return ESP_OK; }
+esp_err_t esp_bt_controller_disable( void ) { return ESP_OK; }
+esp_err_t esp_bt_controller_deinit( void ) { return ESP_OK; }
+esp_bluedroid_status_t esp_bluedroid_get_status( void ) { return ESP_BLUEDROID_STATUS_ENABLED; }
+esp_err_t esp_bluedroid_init( void ) { return ESP_OK; }
+esp_err_t esp_bluedroid_enable( void ) { return ESP_OK; }
+esp_err_t esp_bluedroid_disable( void ) { return ESP_OK; }
+esp_err_t esp_bluedroid_deinit( void ) { return ESP_OK; }
+esp_err_t esp_bt_dev_set_device_name( const char *name ) { (void)name; return ESP_OK; }
+esp_err_t esp_bt_gap_set_scan_mode( esp_bt_connection_mode_t c, esp_bt_discovery_mode_t d ) { (void)c; (void)d; return ESP_OK; }
+
+
+/********************************************************************************/
+/*                      N V S                                                   */
+/********************************************************************************/
+
+/* Nothing is ever stored, every controller is new */
+esp_err_t nvs_open( const char *name, nvs_open_mode_t mode, nvs_handle_t *handle ) { (void)name; (void)mode; *handle = 1; return ESP_OK; }
+esp_err_t nvs_get_blob( nvs_handle_t h, const char *key, void *value, size_t *len ) { (void)h; (void)key; (void)value; (void)len; return ESP_ERR_NVS_NOT_FOUND; }
+esp_err_t nvs_set_blob( nvs_handle_t h, const char *key, const void *value, size_t len ) { (void)h; (void)key; (void)value; (void)len; return ESP_OK; }
+esp_err_t nvs_erase_key( nvs_handle_t h, const char *key ) { (void)h; (void)key; return ESP_OK; }
+esp_err_t nvs_commit( nvs_handle_t h ) { (void)h; return ESP_OK; }
+void nvs_close( nvs_handle_t h ) { (void)h; }
+
+
+/********************************************************************************/
+/*                      B L U E D R O I D                                       */
+/********************************************************************************/
+
+/* Each timer gets an alarm the first time it is started, and keeps it */
+void bta_sys_start_timer( TIMER_LIST_ENT *p_tle, UINT16 type, INT32 timeout_ms )
+{
+    ps4_fuzz_alarm_t *alarm = NULL;
+
+    for (int i = 0; i < PS4_FUZZ_ALARMS && alarm == NULL; i++) {
+        if (ps4_fuzz_alarms[i].p_tle == p_tle) alarm = &ps4_fuzz_alarms[i];
+    }
+
+    for (int i = 0; i < PS4_FUZZ_ALARMS && alarm == NULL; i++) {
+        if (ps4_fuzz_alarms[i].p_tle == NULL) alarm = &ps4_fuzz_alarms[i];
+    }
+
+    if (alarm == NULL) abort();
+
+    p_tle->event = type;
+    p_tle->ticks = timeout_ms;
+    p_tle->in_use = true;
+
+    alarm->p_tle = p_tle;
+    alarm->deadline = ps4_fuzz_now + (int64_t)timeout_ms * 1000;
+    alarm->active = true;
+}
+
+void bta_sys_stop_timer( TIMER_LIST_ENT *p_tle )
+{
+    for (int i = 0; i < PS4_FUZZ_ALARMS; i++) {
+        if (ps4_fuzz_alarms[i].p_tle == p_tle) ps4_fuzz_alarms[i].active = false;
+    }
+
+    p_tle->in_use = false;
+}
+
+BOOLEAN BTM_SetSecurityLevel( BOOLEAN is_originator, const char *p_name, UINT8 service_id, UINT16 sec_level,
+                              UINT16 psm, UINT32 mx_proto_id, UINT32 mx_chan_id )
+{
+    return true;
+}
+
+UINT16 L2CA_Register( UINT16 psm, tL2CAP_APPL_INFO *p_cb_info )
+{
+    for (int i = 0; i < PS4_FUZZ_PSMS; i++) {
+        if (ps4_fuzz_services[i].info == NULL || ps4_fuzz_services[i].psm == psm) {
+            ps4_fuzz_services[i].psm = psm;
+            ps4_fuzz_services[i].info = p_cb_info;
+            return psm;
+        }
+    }
+
+    return 0;
+}
+
+void L2CA_Deregister( UINT16 psm )
+{
+    for (int i = 0; i < PS4_FUZZ_PSMS; i++) {
+        if (ps4_fuzz_services[i].psm == psm) {
+            ps4_fuzz_services[i].info = NULL;
+        }
+    }
+}
+
+BOOLEAN L2CA_ErtmConnectRsp( BD_ADDR p_bd_addr, UINT8 id, UINT16 lcid, UINT16 result, UINT16 status, tL2CAP_ERTM_INFO *p_ertm_info ) { return true; }
+BOOLEAN L2CA_ConfigReq( UINT16 cid, tL2CAP_CFG_INFO *p_cfg ) { return true; }
+BOOLEAN L2CA_ConfigRsp( UINT16 cid, tL2CAP_CFG_INFO *p_cfg ) { return true; }
+BOOLEAN L2CA_DisconnectReq( UINT16 cid ) { return true; }
+
+UINT8 L2CA_DataWrite( UINT16 cid, BT_HDR *p_data )
+{
+    if (ps4_fuzz_sent_total < PS4_FUZZ_SENT) {
+        ps4_fuzz_payload_t *payload = &ps4_fuzz_sent_payloads[ps4_fuzz_sent_total];
+
+        payload->len = p_data->len < sizeof(payload->data) ? p_data->len : sizeof(payload->data);
+        memcpy( payload->data, p_data->data + p_data->offset, payload->len );
+    }
+
+    if (ps4_fuzz_sent_total < UINT16_MAX) {
+        ps4_fuzz_sent_total++;
+    }
+
+    // Queued behind what the link is still carrying
+    if (ps4_fuzz_airtime > 0) {
+        ps4_fuzz_air_free = (ps4_fuzz_air_free > ps4_fuzz_now ? ps4_fuzz_air_free : ps4_fuzz_now) + ps4_fuzz_airtime;
+    }
+
+    osi_free( p_data );
+    return cid != 0 ? L2CAP_DW_SUCCESS : L2CAP_DW_FAILED;
+}
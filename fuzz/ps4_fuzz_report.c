@@ -0,0 +1,43 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "include/ps4.h"
+#include "include/ps4_int.h"
+#include "include/ps4_report.h"
+#include "ps4_fuzz.h"
+
+
+/* Feeds one payload to ps4_report_event, the entry point every received
+ * L2CAP payload goes through, as if it arrived on either channel.
+ *
+ * Input:   [selector] [payload ...]
+ *          selector bit 0  the interrupt channel rather than the control one
+ *          selector bit 1  input CRC check on
+ *
+ * The payload is copied into a buffer of its exact length, so reading past
+ * it is caught by the sanitizers. */
+
+int LLVMFuzzerTestOneInput( const uint8_t *data, size_t size )
+{
+    if (size < 1 || size > UINT16_MAX) return 0;
+
+    ps4_fuzz_init();
+
+    uint8_t selector = data[0];
+    uint16_t len = size - 1;
+    uint8_t *report = malloc( len > 0 ? len : 1 );
+
+    memcpy( report, data + 1, len );
+
+    ps4SetInputCrcCheck( selector & 0x02 );
+    ps4_report_event( selector & 0x01 ? ps4_report_channel_interrupt : ps4_report_channel_control,
+                      report, len );
+
+    free( report );
+
+    // Lets the held back deliveries and the output timers run
+    ps4_fuzz_advance( 1000 );
+
+    return 0;
+}
@@ -0,0 +1,189 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "include/ps4.h"
+#include "include/ps4_int.h"
+#include "esp_timer.h"
+#include "ps4_fuzz.h"
+
+
+/* Streams a controller that then goes silent, as one out of range or out
+ * of battery does, and checks that the watchdog declares the link lost
+ * within 1.25 link timeouts of the last input report: ps4IsConnected turns
+ * false, and the disconnect callback runs from the Bluetooth task as the
+ * library disconnects the controller. The controller goes silent at a
+ * different point of the watchdog period each connection. */
+
+#define PS4_LINK_TEST_TIMEOUT_MS    100
+#define PS4_LINK_TEST_CONNECTIONS   8
+#define PS4_LINK_TEST_INTERVAL_US   4000
+
+#define PS4_LINK_TEST_HIDC_CID      0x40
+#define PS4_LINK_TEST_HIDI_CID      0x41
+
+static BD_ADDR ps4_link_test_addr = { 0x1c, 0x66, 0x6d, 0x00, 0x00, 0x03 };
+
+static int ps4_link_test_disconnects = 0;
+static bool ps4_link_test_in_task = false;
+static int64_t ps4_link_test_disconnected_at = 0;
+
+
+static void ps4_link_test_connect( const tL2CAP_APPL_INFO *info, uint16_t cid, uint16_t psm, uint8_t id )
+{
+    tL2CAP_CFG_INFO cfg = {0};
+
+    info->pL2CA_ConnectInd_Cb( ps4_link_test_addr, cid, psm, id );
+
+    cfg.mtu_present = true;
+    cfg.mtu = 672;
+    info->pL2CA_ConfigInd_Cb( cid, &cfg );
+
+    cfg.result = 0;
+    info->pL2CA_ConfigCfm_Cb( cid, &cfg );
+}
+
+
+/* A 0x11 input report with a valid CRC */
+static uint16_t ps4_link_test_full_report( uint8_t *report, uint32_t counter )
+{
+    uint8_t *fields = report + 4;
+    uint16_t timestamp = counter * 188;
+
+    memset( report, 0, 79 );
+    report[0] = 0xa1;
+    report[1] = 0x11;
+    report[2] = 0xc0;
+
+    fields[0] = 0x80;
+    fields[1] = 0x80;
+    fields[2] = 0x80;
+    fields[3] = 0x80;
+    fields[4] = 0x08;
+    fields[6] = (counter & 0x3f) << 2;
+    fields[9] = timestamp & 0xff;
+    fields[10] = timestamp >> 8;
+    fields[29] = 0x1b;
+
+    uint32_t crc = ps4Crc32( 0, report, 75 );
+
+    report[75] = crc;
+    report[76] = crc >> 8;
+    report[77] = crc >> 16;
+    report[78] = crc >> 24;
+
+    return 79;
+}
+
+
+static void ps4_link_test_connection( uint8_t is_connected )
+{
+    if (!is_connected) {
+        ps4_link_test_disconnects++;
+        ps4_link_test_in_task = ps4_l2cap_in_task();
+        ps4_link_test_disconnected_at = esp_timer_get_time();
+    }
+}
+
+
+/* Streams, goes silent and waits for the loss. Returns the failures */
+static int ps4_link_test_run( const tL2CAP_APPL_INFO *hidc, const tL2CAP_APPL_INFO *hidi, int connection,
+                              uint32_t *detect_max_us )
+{
+    const uint32_t bound_us = PS4_LINK_TEST_TIMEOUT_MS * 1000 * 5 / 4;
+    uint32_t reports = 100 + connection * 3;
+    uint8_t report[79];
+    ps4_connection_stats_t stats;
+    int failures = 0;
+
+    ps4_link_test_disconnects = 0;
+
+    ps4_link_test_connect( hidc, PS4_LINK_TEST_HIDC_CID, BT_PSM_HIDC, 1 );
+    ps4_link_test_connect( hidi, PS4_LINK_TEST_HIDI_CID, BT_PSM_HIDI, 2 );
+
+    for (uint32_t i = 0; i < reports; i++) {
+        uint16_t len = ps4_link_test_full_report( report, i );
+
+        hidi->pL2CA_DataInd_Cb( PS4_LINK_TEST_HIDI_CID, ps4_fuzz_buffer( report, len ) );
+        ps4_fuzz_advance( PS4_LINK_TEST_INTERVAL_US );
+    }
+
+    if (!ps4IsConnected()) {
+        fprintf( stderr, "ps4_link_test: %d: not connected while streaming\n", connection );
+        return 1;
+    }
+
+    int64_t last_report = esp_timer_get_time() - PS4_LINK_TEST_INTERVAL_US;
+
+    // Silence, a millisecond at a time
+    for (int ms = 0; ms < 4 * PS4_LINK_TEST_TIMEOUT_MS && ps4_link_test_disconnects == 0; ms++) {
+        ps4_fuzz_advance( 1000 );
+    }
+
+    ps4GetConnectionStats( &stats );
+
+    if (stats.loss_detect_us > bound_us) {
+        fprintf( stderr, "ps4_link_test: %d: loss detected after %u us, more than %u us\n",
+                 connection, (unsigned)stats.loss_detect_us, (unsigned)bound_us );
+        failures++;
+    }
+
+    if (ps4IsConnected()) {
+        fprintf( stderr, "ps4_link_test: %d: still connected after the link was lost\n", connection );
+        failures++;
+    }
+
+    if (ps4_link_test_disconnects != 1 || !ps4_link_test_in_task) {
+        fprintf( stderr, "ps4_link_test: %d: %d disconnect callbacks, %s the Bluetooth task\n", connection,
+                 ps4_link_test_disconnects, ps4_link_test_in_task ? "on" : "not on" );
+        failures++;
+    } else if (ps4_link_test_disconnected_at - last_report > bound_us) {
+        fprintf( stderr, "ps4_link_test: %d: disconnect callback %u us after the last report\n",
+                 connection, (unsigned)(ps4_link_test_disconnected_at - last_report) );
+        failures++;
+    }
+
+    if (ps4GetConnectionState() != ps4_connection_state_teardown) {
+        fprintf( stderr, "ps4_link_test: %d: the controller was not disconnected\n", connection );
+        failures++;
+    }
+
+    if (stats.loss_detect_us > *detect_max_us) {
+        *detect_max_us = stats.loss_detect_us;
+    }
+
+    // The stack confirms the disconnection
+    hidi->pL2CA_DisconnectCfm_Cb( PS4_LINK_TEST_HIDI_CID, 0 );
+    hidc->pL2CA_DisconnectCfm_Cb( PS4_LINK_TEST_HIDC_CID, 0 );
+    ps4_fuzz_advance( 1000000 );
+
+    return failures;
+}
+
+
+int main( void )
+{
+    uint32_t detect_max_us = 0;
+    int failures = 0;
+
+    ps4_fuzz_init();
+    ps4SetLinkTimeout( PS4_LINK_TEST_TIMEOUT_MS );
+    ps4SetConnectionCallback( ps4_link_test_connection );
+
+    const tL2CAP_APPL_INFO *hidc = ps4_fuzz_l2cap( BT_PSM_HIDC );
+    const tL2CAP_APPL_INFO *hidi = ps4_fuzz_l2cap( BT_PSM_HIDI );
+
+    if (hidc == NULL || hidi == NULL) {
+        fprintf( stderr, "ps4_link_test: the L2CAP services were not registered\n" );
+        return 1;
+    }
+
+    for (int i = 0; i < PS4_LINK_TEST_CONNECTIONS; i++) {
+        failures += ps4_link_test_run( hidc, hidi, i, &detect_max_us );
+    }
+
+    printf( "ps4_link_test: %d links lost, detected within %u us of a %d ms timeout, %d failed\n",
+            PS4_LINK_TEST_CONNECTIONS, (unsigned)detect_max_us, PS4_LINK_TEST_TIMEOUT_MS, failures );
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,200 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "include/ps4.h"
+#include "include/ps4_int.h"
+#include "ps4_fuzz.h"
+
+
+/* Streams a controller from a thread playing the Bluetooth task, on a stack
+ * of known bounds, and reports the figures of ps4GetStackStats: first with
+ * the library alone, then with a subscriber whose callback uses a known
+ * amount of stack, under a guard that it breaks. Built without the
+ * sanitizers, which would grow the frames measured, see the Makefile. */
+
+#define PS4_STACK_TEST_REPORTS      (16 * PS4_STACK_SAMPLE_REPORTS)
+#define PS4_STACK_TEST_INTERVAL_US  4000
+#define PS4_STACK_TEST_CALLBACK     4096
+
+#define PS4_STACK_TEST_HIDC_CID     0x40
+#define PS4_STACK_TEST_HIDI_CID     0x41
+
+typedef struct {
+    const tL2CAP_APPL_INFO *hidc;
+    const tL2CAP_APPL_INFO *hidi;
+    ps4_stack_stats_t alone;
+    ps4_stack_stats_t deep;
+} ps4_stack_test_t;
+
+static BD_ADDR ps4_stack_test_addr = { 0x1c, 0x66, 0x6d, 0x00, 0x00, 0x05 };
+
+static uint32_t ps4_stack_test_counter = 0;
+
+
+static void ps4_stack_test_connect( const tL2CAP_APPL_INFO *info, uint16_t cid, uint16_t psm, uint8_t id )
+{
+    tL2CAP_CFG_INFO cfg = {0};
+
+    info->pL2CA_ConnectInd_Cb( ps4_stack_test_addr, cid, psm, id );
+
+    cfg.mtu_present = true;
+    cfg.mtu = 672;
+    info->pL2CA_ConfigInd_Cb( cid, &cfg );
+
+    cfg.result = 0;
+    info->pL2CA_ConfigCfm_Cb( cid, &cfg );
+}
+
+
+/* A 0x11 input report with a valid CRC */
+static uint16_t ps4_stack_test_full_report( uint8_t *report, uint32_t counter )
+{
+    uint8_t *fields = report + 4;
+    uint16_t timestamp = counter * 188;
+
+    memset( report, 0, 79 );
+    report[0] = 0xa1;
+    report[1] = 0x11;
+    report[2] = 0xc0;
+
+    fields[0] = 0x80 + (counter & 0x0f);
+    fields[1] = 0x80;
+    fields[2] = 0x80;
+    fields[3] = 0x80;
+    fields[4] = 0x08;
+    fields[6] = (counter & 0x3f) << 2;
+    fields[9] = timestamp & 0xff;
+    fields[10] = timestamp >> 8;
+    fields[29] = 0x1b;
+
+    uint32_t crc = ps4Crc32( 0, report, 75 );
+
+    report[75] = crc;
+    report[76] = crc >> 8;
+    report[77] = crc >> 16;
+    report[78] = crc >> 24;
+
+    return 79;
+}
+
+
+static void ps4_stack_test_stream( const tL2CAP_APPL_INFO *hidi, uint32_t reports )
+{
+    uint8_t report[79];
+
+    for (uint32_t i = 0; i < reports; i++) {
+        uint16_t len = ps4_stack_test_full_report( report, ps4_stack_test_counter++ );
+
+        hidi->pL2CA_DataInd_Cb( PS4_STACK_TEST_HIDI_CID, ps4_fuzz_buffer( report, len ) );
+        ps4_fuzz_advance( PS4_STACK_TEST_INTERVAL_US );
+    }
+}
+
+
+/* Touches every byte of a buffer the compiler can't leave out */
+static void ps4_stack_test_deep( void *object, const uint8_t *report, uint16_t len )
+{
+    volatile uint8_t buffer[PS4_STACK_TEST_CALLBACK];
+
+    for (int i = 0; i < PS4_STACK_TEST_CALLBACK; i++) {
+        buffer[i] = report[i % len];
+    }
+
+    (void)buffer[0];
+}
+
+
+/* Runs as the Bluetooth task */
+static void ps4_stack_test_run( void *arg )
+{
+    ps4_stack_test_t *test = arg;
+    ps4_subscriber_t deep = {0};
+
+    ps4_stack_test_connect( test->hidc, PS4_STACK_TEST_HIDC_CID, BT_PSM_HIDC, 1 );
+    ps4_stack_test_connect( test->hidi, PS4_STACK_TEST_HIDI_CID, BT_PSM_HIDI, 2 );
+
+    ps4_stack_test_stream( test->hidi, PS4_STACK_TEST_REPORTS );
+    ps4GetStackStats( &test->alone );
+
+    // Any stack used now is deeper than before, and below the guard
+    deep.raw_cb = ps4_stack_test_deep;
+    ps4Subscribe( &deep );
+    ps4SetStackGuard( UINT16_MAX );
+
+    ps4_stack_test_stream( test->hidi, PS4_STACK_TEST_REPORTS );
+    ps4GetStackStats( &test->deep );
+
+    test->hidi->pL2CA_DisconnectInd_Cb( PS4_STACK_TEST_HIDI_CID, false );
+    test->hidc->pL2CA_DisconnectInd_Cb( PS4_STACK_TEST_HIDC_CID, false );
+    ps4_fuzz_advance( 1000000 );
+}
+
+
+/* Checks the figures of one run, returns the failures */
+static int ps4_stack_test_check( const char *name, const ps4_stack_stats_t *stats, uint32_t used_min )
+{
+    int failures = 0;
+
+    printf( "ps4_stack_test: %s: %u samples on %s, %u bytes used from the dispatch on, "
+            "%u of %u bytes left at least, %u guard warnings\n", name, (unsigned)stats->samples,
+            stats->task, (unsigned)stats->callback_stack_max, (unsigned)stats->stack_free_min,
+            PS4_FUZZ_STACK_SIZE, (unsigned)stats->guard_warnings );
+
+    if (stats->samples == 0) {
+        fprintf( stderr, "ps4_stack_test: %s: no report sampled\n", name );
+        failures++;
+    }
+
+    if (stats->callback_stack_max < used_min || stats->callback_stack_max >= PS4_FUZZ_STACK_SIZE) {
+        fprintf( stderr, "ps4_stack_test: %s: %u bytes used, expected %u to %u\n", name,
+                 (unsigned)stats->callback_stack_max, (unsigned)used_min, PS4_FUZZ_STACK_SIZE );
+        failures++;
+    }
+
+    if (stats->stack_free_min == 0
+        || stats->stack_free_min + stats->callback_stack_max > PS4_FUZZ_STACK_SIZE) {
+        fprintf( stderr, "ps4_stack_test: %s: %u bytes left with %u used, out of %u\n", name,
+                 (unsigned)stats->stack_free_min, (unsigned)stats->callback_stack_max, PS4_FUZZ_STACK_SIZE );
+        failures++;
+    }
+
+    return failures;
+}
+
+
+int main( void )
+{
+    ps4_stack_test_t test = {0};
+    int failures = 0;
+
+    ps4_fuzz_init();
+
+    test.hidc = ps4_fuzz_l2cap( BT_PSM_HIDC );
+    test.hidi = ps4_fuzz_l2cap( BT_PSM_HIDI );
+
+    if (test.hidc == NULL || test.hidi == NULL) {
+        fprintf( stderr, "ps4_stack_test: the L2CAP services were not registered\n" );
+        return 1;
+    }
+
+    ps4_fuzz_on_stack( ps4_stack_test_run, &test );
+
+    failures += ps4_stack_test_check( "alone", &test.alone, 1 );
+    failures += ps4_stack_test_check( "deep callback", &test.deep, PS4_STACK_TEST_CALLBACK );
+
+    if (test.deep.stack_free_min >= test.alone.stack_free_min) {
+        fprintf( stderr, "ps4_stack_test: the deep callback left as much stack as none\n" );
+        failures++;
+    }
+
+    if (test.alone.guard_warnings != 0 || test.deep.guard_warnings == 0) {
+        fprintf( stderr, "ps4_stack_test: %u guard warnings, then %u under the guard\n",
+                 (unsigned)test.alone.guard_warnings, (unsigned)test.deep.guard_warnings );
+        failures++;
+    }
+
+    printf( "ps4_stack_test: %d failed\n", failures );
+
+    return failures == 0 ? 0 : 1;
+}
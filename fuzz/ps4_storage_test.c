@@ -0,0 +1,266 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "include/ps4.h"
+#include "include/ps4_int.h"
+#include "ps4_fuzz.h"
+
+
+/* Keeps the known controllers in files, and checks that a known controller
+ * gets its lightbar and report interval back in the first output report it
+ * is sent, across a reset. A controller connects and is given a lightbar and
+ * a report rate, then more controllers than the table holds connect, the
+ * last replacing the least recently used, not the known one. The table is
+ * then dropped from memory and loaded from the files, as after a reset,
+ * before the known controller reconnects. */
+
+#define PS4_STORAGE_TEST_INTERVAL_US  4000
+#define PS4_STORAGE_TEST_RATE_HZ      250
+
+#define PS4_STORAGE_TEST_HIDC_CID     0x40
+#define PS4_STORAGE_TEST_HIDI_CID     0x41
+
+/* Index of a byte of the report data in an output report as sent */
+#define PS4_STORAGE_TEST_OUTPUT(index) (2 + (index))
+
+static const ps4_cmd_t ps4_storage_test_lightbar = {
+    .r = 0x20, .g = 0x80, .b = 0xc0, .flash_on = 0x30, .flash_off = 0x60
+};
+
+static uint32_t ps4_storage_test_counter = 0;
+
+
+static void ps4_storage_test_address( BD_ADDR addr, uint8_t controller )
+{
+    static const BD_ADDR base = { 0x1c, 0x66, 0x6d, 0x00, 0x06, 0x00 };
+
+    memcpy( addr, base, sizeof(BD_ADDR) );
+    addr[5] = controller;
+}
+
+
+static void ps4_storage_test_channel( const tL2CAP_APPL_INFO *info, BD_ADDR addr, uint16_t cid, uint16_t psm, uint8_t id )
+{
+    tL2CAP_CFG_INFO cfg = {0};
+
+    info->pL2CA_ConnectInd_Cb( addr, cid, psm, id );
+
+    cfg.mtu_present = true;
+    cfg.mtu = 672;
+    info->pL2CA_ConfigInd_Cb( cid, &cfg );
+
+    cfg.result = 0;
+    info->pL2CA_ConfigCfm_Cb( cid, &cfg );
+}
+
+
+/* A 0x11 input report with a valid CRC */
+static uint16_t ps4_storage_test_full_report( uint8_t *report, uint32_t counter )
+{
+    uint8_t *fields = report + 4;
+    uint16_t timestamp = counter * 188;
+
+    memset( report, 0, 79 );
+    report[0] = 0xa1;
+    report[1] = 0x11;
+    report[2] = 0xc0;
+
+    fields[0] = 0x80;
+    fields[1] = 0x80;
+    fields[2] = 0x80;
+    fields[3] = 0x80;
+    fields[4] = 0x08;
+    fields[6] = (counter & 0x3f) << 2;
+    fields[9] = timestamp & 0xff;
+    fields[10] = timestamp >> 8;
+    fields[29] = 0x1b;
+
+    uint32_t crc = ps4Crc32( 0, report, 75 );
+
+    report[75] = crc;
+    report[76] = crc >> 8;
+    report[77] = crc >> 16;
+    report[78] = crc >> 24;
+
+    return 79;
+}
+
+
+/* Connects a controller and streams a few reports from it */
+static void ps4_storage_test_connect( const tL2CAP_APPL_INFO *hidc, const tL2CAP_APPL_INFO *hidi, uint8_t controller )
+{
+    uint8_t report[79];
+    BD_ADDR addr;
+
+    ps4_storage_test_address( addr, controller );
+    ps4_storage_test_channel( hidc, addr, PS4_STORAGE_TEST_HIDC_CID, BT_PSM_HIDC, 1 );
+    ps4_storage_test_channel( hidi, addr, PS4_STORAGE_TEST_HIDI_CID, BT_PSM_HIDI, 2 );
+
+    for (int i = 0; i < 10; i++) {
+        uint16_t len = ps4_storage_test_full_report( report, ps4_storage_test_counter++ );
+
+        hidi->pL2CA_DataInd_Cb( PS4_STORAGE_TEST_HIDI_CID, ps4_fuzz_buffer( report, len ) );
+        ps4_fuzz_advance( PS4_STORAGE_TEST_INTERVAL_US );
+    }
+}
+
+
+/* Disconnects the controller, which saves its settings */
+static void ps4_storage_test_disconnect( const tL2CAP_APPL_INFO *hidc, const tL2CAP_APPL_INFO *hidi )
+{
+    hidi->pL2CA_DisconnectInd_Cb( PS4_STORAGE_TEST_HIDI_CID, false );
+    hidc->pL2CA_DisconnectInd_Cb( PS4_STORAGE_TEST_HIDC_CID, false );
+    ps4_fuzz_advance( 1000000 );
+}
+
+
+/* Checks the known controllers, the most recent first. Returns the failures */
+static int ps4_storage_test_known( const char *when, const uint8_t *expected, uint8_t count )
+{
+    ps4_controller_record_t records[PS4_CONTROLLER_TABLE_SIZE + 1];
+    uint8_t known = ps4GetKnownControllers( records, PS4_CONTROLLER_TABLE_SIZE + 1 );
+
+    if (known != count) {
+        fprintf( stderr, "ps4_storage_test: %s: %u known controllers, expected %u\n", when, known, count );
+        return 1;
+    }
+
+    for (uint8_t i = 0; i < count; i++) {
+        BD_ADDR addr;
+
+        ps4_storage_test_address( addr, expected[i] );
+
+        if (memcmp( records[i].address, addr, sizeof(addr) ) != 0) {
+            fprintf( stderr, "ps4_storage_test: %s: controller %u known as %u, expected %u\n",
+                     when, i, records[i].address[5], expected[i] );
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Checks the first 0x11 output report sent. Returns the failures */
+static int ps4_storage_test_first_output( uint8_t interval )
+{
+    const ps4_cmd_t *cmd = &ps4_storage_test_lightbar;
+    uint8_t report[PS4_HID_BUFFER_SIZE];
+    uint16_t count = ps4_fuzz_sent_count();
+
+    for (uint16_t i = 0; i < count; i++) {
+        uint16_t len = ps4_fuzz_sent( i, report, sizeof(report) );
+
+        if (len != PS4_HID_BUFFER_SIZE || report[1] != hid_cmd_identifier_ps4_control) {
+            continue;
+        }
+
+        uint8_t sent_interval = report[PS4_STORAGE_TEST_OUTPUT(ps4_control_packet_index_hw_control)] & 0x3f;
+        const uint8_t *lightbar = &report[PS4_STORAGE_TEST_OUTPUT(ps4_control_packet_index_lightbar_red)];
+
+        printf( "ps4_storage_test: first output report %u of %u, interval %u ms, "
+                "lightbar %02x %02x %02x flashing %02x %02x\n", i + 1, count, sent_interval,
+                lightbar[0], lightbar[1], lightbar[2], lightbar[3], lightbar[4] );
+
+        if (sent_interval != interval || lightbar[0] != cmd->r || lightbar[1] != cmd->g || lightbar[2] != cmd->b
+            || lightbar[3] != cmd->flash_on || lightbar[4] != cmd->flash_off) {
+            fprintf( stderr, "ps4_storage_test: the settings were not restored, expected interval %u ms, "
+                     "lightbar %02x %02x %02x flashing %02x %02x\n", interval,
+                     cmd->r, cmd->g, cmd->b, cmd->flash_on, cmd->flash_off );
+            return 1;
+        }
+
+        return 0;
+    }
+
+    fprintf( stderr, "ps4_storage_test: no output report out of %u sent\n", count );
+    return 1;
+}
+
+
+int main( void )
+{
+    char dir[] = "/tmp/ps4_storage_test.XXXXXX";
+    const uint8_t known = 1;
+    uint8_t expected[PS4_CONTROLLER_TABLE_SIZE];
+    uint8_t others = 0;
+    int failures = 0;
+
+    if (mkdtemp( dir ) == NULL) {
+        perror( "ps4_storage_test: mkdtemp" );
+        return 1;
+    }
+
+    const ps4_storage_t storage = { ps4_fuzz_file_load, ps4_fuzz_file_save, dir };
+
+    ps4_fuzz_init();
+    ps4SetStorage( &storage );
+
+    const tL2CAP_APPL_INFO *hidc = ps4_fuzz_l2cap( BT_PSM_HIDC );
+    const tL2CAP_APPL_INFO *hidi = ps4_fuzz_l2cap( BT_PSM_HIDI );
+
+    if (hidc == NULL || hidi == NULL) {
+        fprintf( stderr, "ps4_storage_test: the L2CAP services were not registered\n" );
+        return 1;
+    }
+
+    // One controller before the known one, to be the least recently used
+    ps4_storage_test_connect( hidc, hidi, 100 + others++ );
+    ps4_storage_test_disconnect( hidc, hidi );
+
+    ps4_storage_test_connect( hidc, hidi, known );
+    ps4Cmd( ps4_storage_test_lightbar );
+    ps4SetReportRate( PS4_STORAGE_TEST_RATE_HZ );
+    ps4_fuzz_advance( 100000 );
+    ps4_storage_test_disconnect( hidc, hidi );
+
+    // The others have settings of their own, and the defaults are back
+    // before the known controller reconnects
+    for (; others < PS4_CONTROLLER_TABLE_SIZE; others++) {
+        ps4_cmd_t cmd = { .r = others, .g = others, .b = others };
+
+        ps4_storage_test_connect( hidc, hidi, 100 + others );
+        ps4Cmd( cmd );
+        ps4SetReportRate( 0 );
+        ps4_fuzz_advance( 100000 );
+        ps4_storage_test_disconnect( hidc, hidi );
+    }
+
+    // The newest first: the others but the first, which was replaced
+    for (uint8_t i = 0; i < PS4_CONTROLLER_TABLE_SIZE - 1; i++) {
+        expected[i] = 100 + others - 1 - i;
+    }
+
+    expected[PS4_CONTROLLER_TABLE_SIZE - 1] = known;
+
+    failures += ps4_storage_test_known( "before the reset", expected, PS4_CONTROLLER_TABLE_SIZE );
+
+    // A reset: the table is dropped, without saving, and loaded again
+    ps4SetStorage( NULL );
+    ps4ForgetControllers();
+    ps4Cmd( (ps4_cmd_t){0} );
+    ps4SetStorage( &storage );
+
+    failures += ps4_storage_test_known( "after the reset", expected, PS4_CONTROLLER_TABLE_SIZE );
+
+    ps4_fuzz_sent_clear();
+    ps4_storage_test_connect( hidc, hidi, known );
+
+    failures += ps4_storage_test_first_output( (1000 + PS4_STORAGE_TEST_RATE_HZ / 2) / PS4_STORAGE_TEST_RATE_HZ );
+
+    ps4_storage_test_disconnect( hidc, hidi );
+
+    char path[sizeof(dir) + 32];
+
+    snprintf( path, sizeof(path), "%s/controllers", dir );
+    unlink( path );
+    rmdir( dir );
+
+    printf( "ps4_storage_test: %u controllers for %u records, %d failed\n",
+            others + 1, PS4_CONTROLLER_TABLE_SIZE, failures );
+
+    return failures == 0 ? 0 : 1;
+}
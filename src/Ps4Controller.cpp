@@ -2,6 +2,9 @@
 
 #include <esp_bt_main.h>
 #include <esp_bt_defs.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 
 extern "C" {
 #include  "esp_bt_device.h"
@@ -22,31 +25,158 @@ Ps4Controller::Ps4Controller()
 
 bool Ps4Controller::begin()
 {
-    ps4SetEventObjectCallback(this, &Ps4Controller::_event_callback);
-    ps4SetConnectionObjectCallback(this, &Ps4Controller::_connection_callback);
+    if (_start_state == start_running) {
+        log_e("Bluetooth is already being started");
+        return false;
+    }
+
+    _start_state = start_running;
+
+    return _start();
+}
+
+
+bool Ps4Controller::beginAsync()
+{
+    if (_start_state == start_running) {
+        log_e("Bluetooth is already being started");
+        return false;
+    }
+
+    _start_state = start_running;
+
+    // Bluedroid waits on its own tasks while it starts, so this one needs
+    // no more than the default priority of the Arduino loop
+    if (xTaskCreate(&Ps4Controller::_start_task, "ps4_start", 4096, this, 1, nullptr) != pdPASS) {
+        log_e("Could not create the start task");
+        _start_state = start_failed;
+        return false;
+    }
+
+    return true;
+}
+
+
+bool Ps4Controller::beginAsync(const char *mac)
+{
+    esp_bd_addr_t addr;
+
+    if (sscanf(mac, ESP_BD_ADDR_HEX_STR, ESP_BD_ADDR_HEX_PTR(addr)) != ESP_BD_ADDR_LEN){
+        log_e("Could not convert %s\n to a MAC address", mac);
+        return false;
+    }
+
+    ps4SetBluetoothMacAddress( addr );
+
+    return beginAsync();
+}
+
+
+bool Ps4Controller::isReady()
+{
+    return _start_state == start_ready;
+}
+
+
+const Ps4Controller::StartStats &Ps4Controller::startStats()
+{
+    return _start_stats;
+}
+
+
+void Ps4Controller::_start_task(void *object)
+{
+    Ps4Controller* This = (Ps4Controller*) object;
+
+    This->_start();
+
+    auto callback_ready = This->_getDelegate(This->_callback_ready);
+    if (callback_ready){
+        callback_ready();
+    }
+
+#ifdef PS4_COROUTINES
+    This->_resumeWaiters(nullptr, nullptr, -1);
+#endif
+
+    vTaskDelete(nullptr);
+}
+
+
+// Brings Bluetooth up step by step, timing each step
+bool Ps4Controller::_start()
+{
+    int64_t started = esp_timer_get_time();
+    int64_t step = started;
+    StartStats stats = {};
+
+    auto lap = [&step]() -> uint32_t {
+        int64_t now = esp_timer_get_time();
+        uint32_t elapsed = now - step;
+        step = now;
+        return elapsed;
+    };
+
+    auto finish = [&](bool ok) -> bool {
+        stats.total_us = esp_timer_get_time() - started;
+        stats.ok = ok;
+        _start_stats = stats;
+        _start_state = ok ? start_ready : start_failed;
+        return ok;
+    };
+
+    if (_subscription < 0) {
+        ps4_subscriber_t subscriber = {};
+
+        subscriber.interest.button = ps4_interest_button_all;
+        subscriber.interest.analog = ps4_interest_analog_all;
+        subscriber.interest.sensor = ps4_interest_sensor_all;
+        subscriber.interest.status = ps4_interest_status_all;
+        subscriber.event_cb = &Ps4Controller::_event_callback;
+        subscriber.connection_cb = &Ps4Controller::_connection_callback;
+        subscriber.raw_cb = &Ps4Controller::_raw_callback;
+        subscriber.object = this;
+
+        _subscription = ps4Subscribe(&subscriber);
+    }
+
+    lap();
 
     if(!btStarted() && !btStart()){
         log_e("btStart failed");
-        return false;
+        return finish(false);
     }
 
+    stats.bt_start_us = lap();
+
     esp_bluedroid_status_t bt_state = esp_bluedroid_get_status();
     if(bt_state == ESP_BLUEDROID_STATUS_UNINITIALIZED){
         if (esp_bluedroid_init()) {
             log_e("esp_bluedroid_init failed");
-            return false;
+            return finish(false);
         }
     }
 
+    stats.bluedroid_init_us = lap();
+
     if(bt_state != ESP_BLUEDROID_STATUS_ENABLED){
         if (esp_bluedroid_enable()) {
             log_e("esp_bluedroid_enable failed");
-            return false;
+            return finish(false);
         }
     }
 
+    stats.bluedroid_enable_us = lap();
+
+#ifdef PS4_COROUTINES
+    _createTimeouts();
+#endif
+
     ps4Init();
-    return true;
+
+    stats.ps4_init_us = lap();
+
+    return finish(true);
 
 }
 
@@ -69,6 +199,9 @@ bool Ps4Controller::begin(const char *mac)
 
 bool Ps4Controller::end()
 {
+    ps4Unsubscribe(_subscription);
+    _subscription = -1;
+
     ps4Deinit();
     return true;
 }
@@ -104,64 +237,210 @@ void Ps4Controller::setPlayer(int player)
 }
 
 
+void Ps4Controller::setLed(uint8_t r, uint8_t g, uint8_t b)
+{
+    ps4SetLightbar(r, g, b);
+}
+
+
+void Ps4Controller::setFlashRate(int on_ms, int off_ms)
+{
+    // The controller counts in units of 10 ms
+    ps4SetLightbarFlash(constrain(on_ms, 0, 2550) / 10, constrain(off_ms, 0, 2550) / 10);
+}
+
+
+void Ps4Controller::fadeLed(uint8_t r, uint8_t g, uint8_t b, uint16_t duration_ms)
+{
+    ps4LightbarFade(r, g, b, duration_ms);
+}
+
+
+void Ps4Controller::pulseLed(uint8_t r, uint8_t g, uint8_t b, uint16_t period_ms)
+{
+    ps4LightbarPulse(r, g, b, period_ms);
+}
+
+
+void Ps4Controller::animateLed(const ps4_lightbar_keyframe_t *keyframes, uint8_t count, bool loop)
+{
+    ps4LightbarAnimate(keyframes, count, loop);
+}
+
+
+void Ps4Controller::showBattery()
+{
+    ps4LightbarBattery();
+}
+
+
+void Ps4Controller::stopLed()
+{
+    ps4LightbarStop();
+}
+
+
+void Ps4Controller::setLedBudget(uint8_t reports_per_second)
+{
+    ps4LightbarSetBudget(reports_per_second);
+}
+
+
+void Ps4Controller::setInputCrcCheck(bool enabled)
+{
+    ps4SetInputCrcCheck(enabled);
+}
+
+
+void Ps4Controller::setReportRate(int hz)
+{
+    ps4SetReportRate(constrain(hz, 0, 1000));
+}
+
+
+int Ps4Controller::reportRate()
+{
+    return ps4GetReportRate();
+}
+
+
+void Ps4Controller::setOutputAlignment(bool enabled, int maxHoldMs)
+{
+    ps4SetOutputAlignment(enabled, constrain(maxHoldMs, 0, 1000));
+}
+
+
+void Ps4Controller::setLinkTimeout(int timeout_ms)
+{
+    ps4SetLinkTimeout(constrain(timeout_ms, 0, UINT16_MAX));
+}
+
+
 void Ps4Controller::setRumble(float intensity, int duration) {
 
-    const float int_min = 0.0;
-    const float int_max = 100.0;
+    uint8_t raw_intensity = constrain(intensity, 0.0f, 100.0f) * 255 / 100;
 
-    const int dur_min = 0;
-    const int dur_max = 5000;
+    setMotors(raw_intensity, raw_intensity, duration);
+
+}
 
-    uint8_t raw_intensity = map(constrain(intensity, int_min, int_max), int_min, int_max, 0, 255);
-    uint8_t raw_duration = map(constrain(duration, dur_min, dur_max), dur_min, dur_max, 0, 254);
 
-    if (duration == -1) {
-        raw_duration = 255;
+void Ps4Controller::setMotors(uint8_t heavy, uint8_t light, int duration)
+{
+    ps4_rumble_step_t step = {};
+
+    step.heavy = heavy;
+    step.light = light;
+
+    // Both motors are set at the lowest priority, a motor that is off
+    // included, so effects of a higher priority keep playing. Without
+    // a duration, a one second step is repeated until changed
+    if (duration < 0) {
+        step.duration_ms = 1000;
+        ps4RumblePlaySteps(ps4_rumble_motor_both, &step, 1, 0, 0);
+    } else if (duration > 0) {
+        step.duration_ms = constrain(duration, 1, (int)UINT16_MAX);
+        ps4RumblePlaySteps(ps4_rumble_motor_both, &step, 1, 1, 0);
     }
+}
 
-    ps4_cmd_t cmd = {};
 
-    cmd.rumble_right_intensity = raw_intensity;
-    cmd.rumble_left_intensity = raw_intensity;
+bool Ps4Controller::playRumble(const ps4_rumble_effect_t &effect)
+{
+    return ps4RumblePlay(&effect);
+}
+
 
-    cmd.rumble_right_duration = raw_duration;
-    cmd.rumble_left_duration = raw_duration;
+bool Ps4Controller::playRumble(const ps4_rumble_step_t *steps, uint8_t count, uint8_t repeat, uint8_t priority)
+{
+    return ps4RumblePlaySteps(ps4_rumble_motor_both, steps, count, repeat, priority);
+}
 
-    ps4SetLedCmd(&cmd, this->player);
-    ps4Cmd(cmd);
 
+void Ps4Controller::stopRumble()
+{
+    ps4RumbleStop(ps4_rumble_motor_both);
 }
 
 
 void Ps4Controller::attach(callback_t callback)
 {
-    _callback_event = callback;
+    _setDelegate(_callback_event, delegate_t(callback));
 
 }
 
 
 void Ps4Controller::attachOnConnect(callback_t callback)
 {
-    _callback_connect = callback;
+    _setDelegate(_callback_connect, delegate_t(callback));
 
 }
 
 void Ps4Controller::attachOnDisconnect(callback_t callback)
 {
-    _callback_disconnect = callback;
+    _setDelegate(_callback_disconnect, delegate_t(callback));
+
+}
+
+
+void Ps4Controller::attachOnReady(callback_t callback)
+{
+    _setDelegate(_callback_ready, delegate_t(callback));
+}
+
 
+void Ps4Controller::attachOnLinkLoss(callback_t callback)
+{
+    _setDelegate(_callback_link_loss, delegate_t(callback));
+    ps4SetSafeStateCallback(this, &Ps4Controller::_safe_state_callback);
 }
 
 
-void Ps4Controller::_event_callback(void *object, ps4_t data, ps4_event_t event)
+void Ps4Controller::_event_callback(void *object, const ps4_t *data, const ps4_event_t *event)
 {
     Ps4Controller* This = (Ps4Controller*) object;
 
-    memcpy(&This->data, &data, sizeof(ps4_t));
-    memcpy(&This->event, &event, sizeof(ps4_event_t));
+#ifdef PS4_COROUTINES
+    ps4_interest_t changed = ps4EventChanges(&This->data, data, event);
+#endif
+
+    memcpy(&This->data, data, sizeof(ps4_t));
+    memcpy(&This->event, event, sizeof(ps4_event_t));
+
+    auto handler_event = This->_getDelegate(This->_handler_event);
+    if (handler_event){
+        handler_event(*data, *event);
+    }
+
+    auto callback_event = This->_getDelegate(This->_callback_event);
+    if (callback_event){
+        callback_event();
+    }
+
+#ifdef PS4_COROUTINES
+    This->_resumeWaiters(event, &changed, -1);
+#endif
+}
+
+
+void Ps4Controller::_raw_callback(void *object, const uint8_t *report, uint16_t len)
+{
+    Ps4Controller* This = (Ps4Controller*) object;
+
+    auto handler_raw = This->_getDelegate(This->_handler_raw);
+    if (handler_raw){
+        handler_raw(Ps4ReportView(report, len));
+    }
+}
+
+
+void Ps4Controller::_safe_state_callback(void *object, uint8_t reason)
+{
+    Ps4Controller* This = (Ps4Controller*) object;
 
-    if (This->_callback_event){
-        This->_callback_event();
+    auto callback_link_loss = This->_getDelegate(This->_callback_link_loss);
+    if (callback_link_loss){
+        callback_link_loss();
     }
 }
 
@@ -175,18 +454,256 @@ void Ps4Controller::_connection_callback(void *object, uint8_t is_connected)
         // Set LED1 by default
         This->setPlayer(1);
 
-        if (This->_callback_connect){
-            This->_callback_connect();
+        auto callback_connect = This->_getDelegate(This->_callback_connect);
+        if (callback_connect){
+            callback_connect();
         }
     }else
     {
-        if (This->_callback_disconnect){
-            This->_callback_disconnect();
+        auto callback_disconnect = This->_getDelegate(This->_callback_disconnect);
+        if (callback_disconnect){
+            callback_disconnect();
         }
     }
 
+#ifdef PS4_COROUTINES
+    This->_resumeWaiters(nullptr, nullptr, is_connected);
+#endif
+}
+
+
+#ifdef PS4_COROUTINES
+
+Ps4Controller::Awaiter Ps4Controller::nextEvent(const ps4_interest_t &interest)
+{
+    Awaiter awaiter(this, Awaiter::kind_event, 0);
+    awaiter._interest = interest;
+    return awaiter;
+}
+
+
+Ps4Controller::Awaiter Ps4Controller::buttonDown(uint32_t buttons, uint32_t timeout_ms)
+{
+    Awaiter awaiter(this, Awaiter::kind_button_down, timeout_ms);
+    awaiter._interest.button = buttons;
+    return awaiter;
+}
+
+
+Ps4Controller::Awaiter Ps4Controller::connected(uint32_t timeout_ms)
+{
+    return Awaiter(this, Awaiter::kind_connected, timeout_ms);
 }
 
+
+Ps4Controller::Awaiter Ps4Controller::ready(uint32_t timeout_ms)
+{
+    return Awaiter(this, Awaiter::kind_ready, timeout_ms);
+}
+
+
+Ps4Controller::Awaiter::Awaiter(Ps4Controller *controller, Kind kind, uint32_t timeout_ms)
+    : _controller(controller), _kind(kind)
+{
+    if (timeout_ms > 0) {
+        _deadline = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+    }
+}
+
+
+bool Ps4Controller::Awaiter::await_ready()
+{
+    return _satisfied();
+}
+
+
+// Links the awaiter into the controller, unless what it waits for happened
+// since await_ready, in which case the coroutine resumes right away. That
+// is checked again under the lock the waiters are resumed under, as the
+// change is made before they are
+bool Ps4Controller::Awaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    // Once linked, the awaiter may be resumed and destroyed by another
+    // task at any time, so nothing of it is read after that
+    Ps4Controller *controller = _controller;
+    bool timed = _deadline != 0;
+
+    _handle = handle;
+
+    portENTER_CRITICAL(&controller->_waiters_lock);
+
+    if (_satisfied()) {
+        portEXIT_CRITICAL(&controller->_waiters_lock);
+        return false;
+    }
+
+    _next = controller->_waiters;
+    controller->_waiters = this;
+    portEXIT_CRITICAL(&controller->_waiters_lock);
+
+    if (timed) {
+        controller->_armTimeouts();
+    }
+
+    return true;
+}
+
+
+// Whether the connection or the start the awaiter waits for already
+// happened, setting the result if so. Events are only ever awaited
+bool Ps4Controller::Awaiter::_satisfied()
+{
+    if (_kind == kind_connected && _controller->isConnected()) {
+        _result = true;
+        return true;
+    }
+
+    if (_kind == kind_ready && _controller->_start_state >= start_ready) {
+        _result = _controller->_start_state == start_ready;
+        return true;
+    }
+
+    return false;
+}
+
+
+// Unlinks every waiter that is satisfied by the event, the connection
+// change or its deadline, then resumes them outside of the lock. The
+// resumed coroutines run on the task that called this function
+void Ps4Controller::_resumeWaiters(const ps4_event_t *event, const ps4_interest_t *changed, int connection)
+{
+    int64_t now = esp_timer_get_time();
+    Awaiter *ready = nullptr;
+    bool timed = false;
+
+    portENTER_CRITICAL(&_waiters_lock);
+
+    Awaiter **link = &_waiters;
+    while (*link) {
+        Awaiter *waiter = *link;
+        bool done = false;
+
+        switch (waiter->_kind) {
+        case Awaiter::kind_event:
+            if (event && ((waiter->_interest.button & changed->button)
+                       || (waiter->_interest.analog & changed->analog)
+                       || (waiter->_interest.sensor & changed->sensor)
+                       || (waiter->_interest.status & changed->status))) {
+                waiter->_event = *event;
+                waiter->_result = done = true;
+            }
+            break;
+        case Awaiter::kind_button_down:
+            if (event && (ps4ButtonMask(&event->button_down) & waiter->_interest.button)) {
+                waiter->_event = *event;
+                waiter->_result = done = true;
+            }
+            break;
+        case Awaiter::kind_connected:
+            if (connection == 1) {
+                waiter->_result = done = true;
+            }
+            break;
+        case Awaiter::kind_ready:
+            if (_start_state >= start_ready) {
+                waiter->_result = _start_state == start_ready;
+                done = true;
+            }
+            break;
+        }
+
+        if (!done && connection == 0 && waiter->_kind != Awaiter::kind_connected && waiter->_kind != Awaiter::kind_ready) {
+            waiter->_result = false;
+            done = true;
+        }
+
+        if (!done && waiter->_deadline && now >= waiter->_deadline) {
+            waiter->_result = false;
+            done = true;
+        }
+
+        if (done) {
+            *link = waiter->_next;
+            waiter->_next = ready;
+            ready = waiter;
+        } else {
+            timed |= waiter->_deadline != 0;
+            link = &waiter->_next;
+        }
+    }
+
+    if (_timeout_armed && !timed) {
+        _timeout_armed = false;
+        esp_timer_stop(_timeout_timer);
+    }
+
+    portEXIT_CRITICAL(&_waiters_lock);
+
+    while (ready) {
+        // The awaiter is gone once its coroutine is resumed
+        Awaiter *waiter = ready;
+        ready = waiter->_next;
+        waiter->_handle.resume();
+    }
+}
+
+
+// Creates the shared timeout timer once, from _start, so that awaiting
+// never allocates. Deadlines awaited before are timed from then on
+void Ps4Controller::_createTimeouts()
+{
+    if (_timeout_timer) {
+        return;
+    }
+
+    esp_timer_create_args_t args = {};
+    args.callback = &Ps4Controller::_timeout_callback;
+    args.arg = this;
+    args.name = "ps4_await";
+
+    esp_timer_handle_t timer = nullptr;
+
+    if (esp_timer_create(&args, &timer) != ESP_OK) {
+        log_e("Could not create the timeout timer");
+        return;
+    }
+
+    portENTER_CRITICAL(&_waiters_lock);
+    _timeout_timer = timer;
+    portEXIT_CRITICAL(&_waiters_lock);
+
+    _armTimeouts();
+}
+
+
+// Starts the shared timeout timer, which only runs while at least one
+// waiter has a deadline. The timer is only started and stopped under the
+// waiters lock, together with the flag, so the flag always tells whether
+// it runs
+void Ps4Controller::_armTimeouts()
+{
+    const uint64_t timeout_resolution_us = 10 * 1000;
+
+    portENTER_CRITICAL(&_waiters_lock);
+
+    // The waiters may have been resumed before the timer was armed, and
+    // before begin() there is no timer yet
+    if (!_timeout_armed && _waiters && _timeout_timer) {
+        _timeout_armed = esp_timer_start_periodic(_timeout_timer, timeout_resolution_us) == ESP_OK;
+    }
+
+    portEXIT_CRITICAL(&_waiters_lock);
+}
+
+
+void Ps4Controller::_timeout_callback(void *object)
+{
+    Ps4Controller* This = (Ps4Controller*) object;
+    This->_resumeWaiters(nullptr, nullptr, -1);
+}
+
+#endif
+
 #if !defined(NO_GLOBAL_INSTANCES)
 Ps4Controller Ps4;
 #endif
@@ -9,21 +9,56 @@ extern "C" {
 #include  "include/ps4.h"
 }
 
+#include "freertos/FreeRTOS.h"
+
+#include "Ps4Delegate.h"
+#include "Ps4ReportView.h"
+
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+#include <coroutine>
+#include "esp_timer.h"
+#define PS4_COROUTINES 1
+#endif
+
 
 class Ps4Controller
 {
     public:
         typedef void(*callback_t)();
 
+        typedef Ps4Delegate<void()> delegate_t;
+        typedef Ps4Delegate<void(const ps4_t&, const ps4_event_t&)> event_delegate_t;
+        typedef Ps4Delegate<void(const Ps4ReportView&)> raw_delegate_t;
+
         ps4_t data;
         ps4_event_t event;
 
         Ps4Controller();
 
+        // Time spent in each step of bringing Bluetooth up, in us
+        struct StartStats {
+            uint32_t bt_start_us;
+            uint32_t bluedroid_init_us;
+            uint32_t bluedroid_enable_us;
+            uint32_t ps4_init_us;
+            uint32_t total_us;
+            bool ok;
+        };
+
         bool begin();
         bool begin(const char *mac);
         bool end();
 
+        // Brings Bluetooth up on a task of its own and returns right away,
+        // so that other peripherals can be set up meanwhile. The ready
+        // callback is called from that task once it is done
+        bool beginAsync();
+        bool beginAsync(const char *mac);
+
+        // Whether Bluetooth was brought up, and how long each step took
+        bool isReady();
+        const StartStats &startStats();
+
         String getAddress();
 
         bool isConnected();
@@ -31,19 +66,229 @@ class Ps4Controller
         void setPlayer(int player);
         void setRumble(float intensity, int duration = -1);
 
+        // Independent motor intensities, held for the duration in
+        // milliseconds, or until changed or stopped when -1
+        void setMotors(uint8_t heavy, uint8_t light, int duration = -1);
+
+        // Rumble effects and patterns, played back in the background.
+        // They only replace effects of the same or a lower priority
+        bool playRumble(const ps4_rumble_effect_t &effect);
+        bool playRumble(const ps4_rumble_step_t *steps, uint8_t count, uint8_t repeat = 1, uint8_t priority = 0);
+        void stopRumble();
+
+        // Lightbar color and flashing, with durations in milliseconds
+        void setLed(uint8_t r, uint8_t g, uint8_t b);
+        void setFlashRate(int on_ms, int off_ms);
+
+        // Lightbar animations, evaluated in the background. Only changes
+        // that can be seen are sent, at most `budget` times per second
+        void fadeLed(uint8_t r, uint8_t g, uint8_t b, uint16_t duration_ms);
+        void pulseLed(uint8_t r, uint8_t g, uint8_t b, uint16_t period_ms);
+        void animateLed(const ps4_lightbar_keyframe_t *keyframes, uint8_t count, bool loop = false);
+        void showBattery();
+        void stopLed();
+        void setLedBudget(uint8_t reports_per_second);
+
+        // Drops full reports whose CRC doesn't match before they are parsed
+        void setInputCrcCheck(bool enabled);
+
+        // Requested input report rate, 0 for the controller default, and
+        // the rate reports are actually arriving at
+        void setReportRate(int hz);
+        int reportRate();
+
+        // Holds output back to be sent right after the next input report,
+        // for at most maxHoldMs, or 10 ms when 0
+        void setOutputAlignment(bool enabled, int maxHoldMs = 0);
+
+        // Declares the link lost after timeout_ms without input reports,
+        // 0 to only rely on disconnections
+        void setLinkTimeout(int timeout_ms);
+
         void attach(callback_t callback);
         void attachOnConnect(callback_t callback);
         void attachOnDisconnect(callback_t callback);
+        void attachOnReady(callback_t callback);
+
+        // Called as soon as the link is lost, before the disconnect
+        // callback, to put whatever the controller drives in a safe state
+        void attachOnLinkLoss(callback_t callback);
+
+        // Attaches a lambda, function object or function receiving the
+        // report and its event directly
+        template<typename F>
+        auto attach(F handler) -> decltype(handler(std::declval<const ps4_t&>(), std::declval<const ps4_event_t&>()), void())
+        {
+            _setDelegate(_handler_event, event_delegate_t(handler));
+        }
+
+        // Attaches a member function receiving the report and its event
+        template<typename T>
+        void attach(T *object, void (T::*method)(const ps4_t&, const ps4_event_t&))
+        {
+            _setDelegate(_handler_event, event_delegate_t::bind(object, method));
+        }
+
+        // Attaches a handler receiving every report unparsed, which only
+        // decodes the fields it reads
+        template<typename F>
+        void attachRaw(F handler)
+        {
+            _setDelegate(_handler_raw, raw_delegate_t(handler));
+        }
+
+        template<typename F>
+        auto attachOnConnect(F handler) -> decltype(handler(), void())
+        {
+            _setDelegate(_callback_connect, delegate_t(handler));
+        }
+
+        template<typename F>
+        auto attachOnDisconnect(F handler) -> decltype(handler(), void())
+        {
+            _setDelegate(_callback_disconnect, delegate_t(handler));
+        }
+
+        template<typename F>
+        auto attachOnReady(F handler) -> decltype(handler(), void())
+        {
+            _setDelegate(_callback_ready, delegate_t(handler));
+        }
+
+        template<typename F>
+        auto attachOnLinkLoss(F handler) -> decltype(handler(), void())
+        {
+            _setDelegate(_callback_link_loss, delegate_t(handler));
+            ps4SetSafeStateCallback(this, &Ps4Controller::_safe_state_callback);
+        }
+
+#ifdef PS4_COROUTINES
+        class Awaiter;
+
+        // Fire-and-forget coroutine type for control logic written
+        // as a series of co_await's on controller input
+        struct Task {
+            struct promise_type {
+                Task get_return_object() { return {}; }
+                std::suspend_never initial_suspend() noexcept { return {}; }
+                std::suspend_never final_suspend() noexcept { return {}; }
+                void return_void() {}
+                void unhandled_exception() { abort(); }
+            };
+        };
+
+        // Resumes with the event of the next report in which one of the
+        // fields in the interest changed, or an empty event on disconnect
+        Awaiter nextEvent(const ps4_interest_t &interest);
+
+        // Resumes with true once one of the buttons is pressed, or false
+        // on timeout or disconnect. A timeout of 0 waits indefinitely
+        Awaiter buttonDown(uint32_t buttons, uint32_t timeout_ms = 0);
+
+        // Resumes with true once a controller is connected, or false on
+        // timeout. A timeout of 0 waits indefinitely
+        Awaiter connected(uint32_t timeout_ms = 0);
+
+        // Resumes with true once beginAsync brought Bluetooth up, or false
+        // when it failed or on timeout. The coroutine then runs on the
+        // starting task. A timeout of 0 waits indefinitely
+        Awaiter ready(uint32_t timeout_ms = 0);
+
+        // Awaiters live in the awaiting coroutine frame and are linked into
+        // the controller while suspended, so awaiting never allocates
+        class Awaiter {
+            public:
+                // Converts to the event for nextEvent, and to the
+                // result for the other awaitables
+                struct Result {
+                    ps4_event_t event;
+                    bool result;
+                    operator bool() const { return result; }
+                    operator ps4_event_t() const { return event; }
+                };
+
+                bool await_ready();
+                bool await_suspend(std::coroutine_handle<> handle);
+                Result await_resume() const { return { _event, _result }; }
+
+            private:
+                friend class Ps4Controller;
+
+                enum Kind { kind_event, kind_button_down, kind_connected, kind_ready };
+
+                Awaiter(Ps4Controller *controller, Kind kind, uint32_t timeout_ms);
+
+                bool _satisfied();
+
+                Ps4Controller *_controller;
+                Kind _kind;
+                ps4_interest_t _interest = {};
+                int64_t _deadline = 0;
+                std::coroutine_handle<> _handle;
+                ps4_event_t _event = {};
+                bool _result = false;
+                Awaiter *_next = nullptr;
+        };
+#endif
 
     private:
-        static void _event_callback(void *object, ps4_t data, ps4_event_t event);
+        static void _event_callback(void *object, const ps4_t *data, const ps4_event_t *event);
         static void _connection_callback(void *object, uint8_t is_connected);
+        static void _raw_callback(void *object, const uint8_t *report, uint16_t len);
+        static void _safe_state_callback(void *object, uint8_t reason);
+        static void _start_task(void *object);
+
+        enum StartState { start_idle, start_running, start_ready, start_failed };
+
+        bool _start();
+
+        // Handlers are attached from application tasks while the Bluetooth
+        // task invokes them, so they are only copied under the lock
+        template<typename D>
+        void _setDelegate(D &target, const D &value)
+        {
+            portENTER_CRITICAL(&_delegates_lock);
+            target = value;
+            portEXIT_CRITICAL(&_delegates_lock);
+        }
+
+        template<typename D>
+        D _getDelegate(const D &source)
+        {
+            portENTER_CRITICAL(&_delegates_lock);
+            D delegate = source;
+            portEXIT_CRITICAL(&_delegates_lock);
+            return delegate;
+        }
 
         int player;
 
-        callback_t _callback_event = nullptr;
-        callback_t _callback_connect = nullptr;
-        callback_t _callback_disconnect = nullptr;
+        volatile StartState _start_state = start_idle;
+        StartStats _start_stats = {};
+
+        ps4_subscription_t _subscription = -1;
+
+        delegate_t _callback_event;
+        delegate_t _callback_connect;
+        delegate_t _callback_disconnect;
+        delegate_t _callback_link_loss;
+        delegate_t _callback_ready;
+        event_delegate_t _handler_event;
+        raw_delegate_t _handler_raw;
+        portMUX_TYPE _delegates_lock = portMUX_INITIALIZER_UNLOCKED;
+
+#ifdef PS4_COROUTINES
+        static void _timeout_callback(void *object);
+
+        void _resumeWaiters(const ps4_event_t *event, const ps4_interest_t *changed, int connection);
+        void _createTimeouts();
+        void _armTimeouts();
+
+        Awaiter *_waiters = nullptr;
+        portMUX_TYPE _waiters_lock = portMUX_INITIALIZER_UNLOCKED;
+        esp_timer_handle_t _timeout_timer = nullptr;
+        bool _timeout_armed = false;
+#endif
 
 };
 
@@ -0,0 +1,116 @@
+#ifndef Ps4Delegate_h
+#define Ps4Delegate_h
+
+#include <stddef.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+
+// Non-allocating callable wrapper. The callable is stored by value in a
+// small inline buffer and invoked through a single function pointer, so
+// lambdas with captures, function objects, plain functions and bound
+// member functions can be attached without touching the heap.
+//
+// Stored callables must be trivially copyable, fit in the buffer and
+// need no more than pointer alignment, all of which are checked at
+// compile time. A delegate is copied as plain memory and is not safe to
+// assign while another task invokes it; the owner has to serialize that.
+template<typename Signature, size_t Capacity = 3 * sizeof(void*)>
+class Ps4Delegate;
+
+template<typename R, typename... Args, size_t Capacity>
+class Ps4Delegate<R(Args...), Capacity>
+{
+    public:
+        Ps4Delegate() {}
+
+        Ps4Delegate(std::nullptr_t) {}
+
+        Ps4Delegate(R (*function)(Args...))
+        {
+            if (function) {
+                _store(function);
+            }
+        }
+
+        template<typename F, typename = typename std::enable_if<
+            !std::is_same<typename std::decay<F>::type, Ps4Delegate>::value>::type>
+        Ps4Delegate(F callable)
+        {
+            _store(callable);
+        }
+
+        // Binds a member function known at compile time, which is invoked
+        // as a direct call on the object
+        template<typename T, R (T::*Method)(Args...)>
+        static Ps4Delegate bind(T *object)
+        {
+            Ps4Delegate delegate;
+            delegate._place(object);
+            delegate._invoke = &Ps4Delegate::_invokeMember<T, Method>;
+            return delegate;
+        }
+
+        // Binds a member function pointer known only at run time
+        template<typename T>
+        static Ps4Delegate bind(T *object, R (T::*method)(Args...))
+        {
+            Ps4Delegate delegate;
+            delegate._store(_BoundMember<T>{ object, method });
+            return delegate;
+        }
+
+        explicit operator bool() const { return _invoke != nullptr; }
+
+        R operator()(Args... args) const
+        {
+            return _invoke(_storage, std::forward<Args>(args)...);
+        }
+
+    private:
+        template<typename T>
+        struct _BoundMember {
+            T *object;
+            R (T::*method)(Args...);
+
+            R operator()(Args... args) const
+            {
+                return (object->*method)(std::forward<Args>(args)...);
+            }
+        };
+
+        template<typename F>
+        void _store(F callable)
+        {
+            _place(callable);
+            _invoke = &Ps4Delegate::_invokeCallable<F>;
+        }
+
+        template<typename F>
+        void _place(F value)
+        {
+            static_assert(sizeof(F) <= Capacity, "Callable does not fit in the delegate buffer");
+            static_assert(alignof(F) <= alignof(void*), "Callable is over-aligned for the delegate buffer");
+            static_assert(std::is_trivially_copyable<F>::value, "Callable must be trivially copyable");
+
+            new (_storage) F(value);
+        }
+
+        template<typename F>
+        static R _invokeCallable(const void *storage, Args... args)
+        {
+            return (*static_cast<const F*>(storage))(std::forward<Args>(args)...);
+        }
+
+        template<typename T, R (T::*Method)(Args...)>
+        static R _invokeMember(const void *storage, Args... args)
+        {
+            return ((*static_cast<T* const*>(storage))->*Method)(std::forward<Args>(args)...);
+        }
+
+        alignas(void*) unsigned char _storage[Capacity];
+        R (*_invoke)(const void*, Args...) = nullptr;
+};
+
+#endif
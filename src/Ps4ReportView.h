@@ -0,0 +1,208 @@
+#ifndef Ps4ReportView_h
+#define Ps4ReportView_h
+
+#include <inttypes.h>
+
+extern "C" {
+#include  "include/ps4.h"
+#include  "include/ps4_report.h"
+}
+
+
+// Read-only view over an unparsed input report, as handed out by the raw
+// report callback. Nothing is decoded up front: each accessor decodes its
+// field straight from the report, using the layout from the table below,
+// and returns 0 for fields the report doesn't carry.
+class Ps4ReportView
+{
+    public:
+        enum Field {
+            stick_lx,
+            stick_ly,
+            stick_rx,
+            stick_ry,
+            trigger_l2,
+            trigger_r2,
+            buttons,
+            timestamp,
+            temperature,
+            gyroscope_x,
+            gyroscope_y,
+            gyroscope_z,
+            accelerometer_x,
+            accelerometer_y,
+            accelerometer_z,
+            battery_level,
+            cable,
+            touch_released,
+            touch_x,
+            touch_y,
+            field_count
+        };
+
+        struct Layout {
+            uint8_t offset;     // relative to the start of the input fields
+            uint8_t width;      // in bytes
+            bool little_endian;
+            bool is_signed;
+            uint8_t shift;      // applied after assembling the bytes
+            uint16_t mask;      // applied after shifting, 0 keeps all bits
+            int16_t bias;       // added to the extracted value
+        };
+
+        template<typename = void>
+        struct Table {
+            static constexpr Layout fields[field_count] = {
+                /* stick_lx        */ { ps4_report_index_analog_stick_lx,        1, true,  false, 0, 0,      -0x80 },
+                /* stick_ly        */ { ps4_report_index_analog_stick_ly,        1, true,  false, 0, 0,      -0x80 },
+                /* stick_rx        */ { ps4_report_index_analog_stick_rx,        1, true,  false, 0, 0,      -0x80 },
+                /* stick_ry        */ { ps4_report_index_analog_stick_ry,        1, true,  false, 0, 0,      -0x80 },
+                /* trigger_l2      */ { ps4_report_index_analog_button_l2,       1, true,  false, 0, 0,      0 },
+                /* trigger_r2      */ { ps4_report_index_analog_button_r2,       1, true,  false, 0, 0,      0 },
+                /* buttons         */ { ps4_report_index_buttons,                3, true,  false, 0, 0,      0 },
+                /* timestamp       */ { ps4_report_index_timestamp,              2, true,  false, 0, 0,      0 },
+                /* temperature     */ { ps4_report_index_temperature,            1, true,  false, 0, 0,      0 },
+                /* gyroscope_x     */ { ps4_report_index_sensor_gyroscope_x,     2, true,  true,  0, 0,      0 },
+                /* gyroscope_y     */ { ps4_report_index_sensor_gyroscope_y,     2, true,  true,  0, 0,      0 },
+                /* gyroscope_z     */ { ps4_report_index_sensor_gyroscope_z,     2, true,  true,  0, 0,      0 },
+                /* accelerometer_x */ { ps4_report_index_sensor_accelerometer_x, 2, true,  true,  0, 0,      0 },
+                /* accelerometer_y */ { ps4_report_index_sensor_accelerometer_y, 2, true,  true,  0, 0,      0 },
+                /* accelerometer_z */ { ps4_report_index_sensor_accelerometer_z, 2, true,  true,  0, 0,      0 },
+                /* battery_level   */ { ps4_report_index_status,                 1, true,  false, 0, 0x0f,   0 },
+                /* cable           */ { ps4_report_index_status,                 1, true,  false, 4, 0x01,   0 },
+                /* touch_released  */ { ps4_report_index_touch_finger,           1, true,  false, 7, 0x01,   0 },
+                /* touch_x         */ { ps4_report_index_touch_position,         2, true,  false, 0, 0x0fff, 0 },
+                /* touch_y         */ { ps4_report_index_touch_position + 1,     2, true,  false, 4, 0x0fff, 0 },
+            };
+        };
+
+        Ps4ReportView(const uint8_t *report, uint16_t len)
+            : _report(report), _len(len)
+        {
+            _fields = id() == ps4_report_id_full ? ps4_report_prefix_full : ps4_report_prefix_short;
+        }
+
+        uint8_t id() const
+        {
+            return _len > ps4_report_prefix_id ? _report[ps4_report_prefix_id] : 0;
+        }
+
+        const uint8_t *data() const { return _report; }
+        uint16_t length() const { return _len; }
+
+        // Whether the report is long enough to carry the field
+        bool has(Field field) const
+        {
+            return _contains(Table<>::fields[field]);
+        }
+
+        // Decodes a field known at compile time, which folds the layout
+        // lookup into the generated code
+        template<Field F>
+        int32_t get() const
+        {
+            return _decode(Table<>::fields[F]);
+        }
+
+        int32_t get(Field field) const
+        {
+            return _decode(Table<>::fields[field]);
+        }
+
+        int8_t lx() const { return get<stick_lx>(); }
+        int8_t ly() const { return get<stick_ly>(); }
+        int8_t rx() const { return get<stick_rx>(); }
+        int8_t ry() const { return get<stick_ry>(); }
+
+        uint8_t l2() const { return get<trigger_l2>(); }
+        uint8_t r2() const { return get<trigger_r2>(); }
+
+        int16_t gyroscopeX() const { return get<gyroscope_x>(); }
+        int16_t gyroscopeY() const { return get<gyroscope_y>(); }
+        int16_t gyroscopeZ() const { return get<gyroscope_z>(); }
+
+        int16_t accelerometerX() const { return get<accelerometer_x>(); }
+        int16_t accelerometerY() const { return get<accelerometer_y>(); }
+        int16_t accelerometerZ() const { return get<accelerometer_z>(); }
+
+        uint8_t batteryLevel() const { return get<battery_level>(); }
+        bool isCharging() const { return get<cable>(); }
+
+        bool isTouched() const { return has(touch_released) && !get<touch_released>(); }
+        uint16_t touchX() const { return get<touch_x>(); }
+        uint16_t touchY() const { return get<touch_y>(); }
+
+        // Pressed buttons as ps4_interest_button flags
+        uint32_t buttonMask() const
+        {
+            static const uint8_t dpad[8] = {
+                ps4_interest_button_up,
+                ps4_interest_button_up   | ps4_interest_button_right,
+                ps4_interest_button_right,
+                ps4_interest_button_right | ps4_interest_button_down,
+                ps4_interest_button_down,
+                ps4_interest_button_down | ps4_interest_button_left,
+                ps4_interest_button_left,
+                ps4_interest_button_left | ps4_interest_button_up
+            };
+
+            if (!has(buttons)) {
+                return 0;
+            }
+
+            uint32_t raw = get<buttons>();
+            uint8_t direction = raw & 0x0f;
+
+            // Apart from the d-pad, the bits line up with the interest flags
+            return (raw & ps4_interest_button_all & ~0x0fu) | (direction < 8 ? dpad[direction] : 0);
+        }
+
+        bool isPressed(uint32_t mask) const
+        {
+            return (buttonMask() & mask) != 0;
+        }
+
+    private:
+        bool _contains(const Layout &field) const
+        {
+            return _fields + field.offset + field.width <= _len;
+        }
+
+        int32_t _decode(const Layout &field) const
+        {
+            if (!_contains(field)) {
+                return 0;
+            }
+
+            const uint8_t *bytes = _report + _fields + field.offset;
+            uint32_t raw = 0;
+
+            for (uint8_t i = 0; i < field.width; i++) {
+                uint8_t byte = field.little_endian ? bytes[i] : bytes[field.width - 1 - i];
+                raw |= (uint32_t)byte << (8 * i);
+            }
+
+            raw >>= field.shift;
+
+            if (field.mask) {
+                raw &= field.mask;
+            }
+
+            int32_t value = (int32_t)raw;
+
+            if (field.is_signed && field.width < 4 && (raw & (1u << (8 * field.width - 1)))) {
+                value -= (int32_t)(1u << (8 * field.width));
+            }
+
+            return value + field.bias;
+        }
+
+        const uint8_t *_report;
+        uint16_t _len;
+        uint8_t _fields;
+};
+
+template<typename T>
+constexpr Ps4ReportView::Layout Ps4ReportView::Table<T>::fields[Ps4ReportView::field_count];
+
+#endif
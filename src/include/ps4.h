@@ -129,6 +129,15 @@ typedef struct {
     uint8_t led2 : 1;
     uint8_t led3 : 1;
     uint8_t led4 : 1;
+
+    /* Lightbar color */
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+
+    /* Lightbar flashing, in units of 10 ms, both 0 for a steady light */
+    uint8_t flash_on;
+    uint8_t flash_off;
 } ps4_cmd_t;
 
 typedef struct {
@@ -145,6 +154,490 @@ typedef struct {
 } ps4_t;
 
 
+/*****************/
+/*   M I X E R   */
+/*****************/
+
+/* Parts of the output a mixer channel drives */
+enum ps4_mixer_field {
+    ps4_mixer_field_heavy    = 1 << 0,
+    ps4_mixer_field_light    = 1 << 1,
+    ps4_mixer_field_lightbar = 1 << 2,
+    ps4_mixer_field_flash    = 1 << 3,
+
+    ps4_mixer_field_rumble   = ps4_mixer_field_heavy | ps4_mixer_field_light,
+    ps4_mixer_field_all      = (1 << 4) - 1
+};
+
+/* How a channel combines with the channels of lower priority */
+enum ps4_mixer_blend {
+    ps4_mixer_blend_override,
+    ps4_mixer_blend_max,
+    ps4_mixer_blend_additive
+};
+
+/* Priorities of the built-in channels. ps4Cmd is the base channel */
+enum ps4_mixer_priority {
+    ps4_mixer_priority_base     = 0,
+    ps4_mixer_priority_effects  = 100
+};
+
+typedef int ps4_mixer_channel_t;
+
+/* Time output was held back to be sent after an input report, in buckets
+ * of [0, 1), [1, 2), [2, 4) ... milliseconds, the last one open ended */
+#define PS4_OUTPUT_HOLD_BUCKETS 8
+
+typedef struct {
+    uint32_t released_by_input;
+    uint32_t released_by_timeout;
+    uint32_t hold_max_us;
+    uint32_t hold_histogram[PS4_OUTPUT_HOLD_BUCKETS];
+} ps4_output_hold_stats_t;
+
+
+/***************************/
+/*   C O N N E C T I O N   */
+/***************************/
+
+/* Steps of a connection, in the order they are normally taken */
+enum ps4_connection_state {
+    ps4_connection_state_idle,
+    ps4_connection_state_control,       /* control channel connected      */
+    ps4_connection_state_interrupt,     /* interrupt channel connected    */
+    ps4_connection_state_configured,    /* both channels configured       */
+    ps4_connection_state_enabling,      /* enable report sent             */
+    ps4_connection_state_streaming,     /* first full input report        */
+    ps4_connection_state_teardown,      /* a channel was disconnected     */
+    ps4_connection_state_count
+};
+
+/* Why the link to the controller was declared lost */
+enum ps4_link_loss {
+    ps4_link_loss_disconnected,
+    ps4_link_loss_silence       /* no input report within the link timeout */
+};
+
+typedef struct {
+    uint8_t state;
+    uint8_t enable_retries;
+
+    uint32_t connects;
+    uint32_t streams;
+    uint32_t timeouts;
+
+    /* Time from the control channel connecting to reaching each state, for
+     * the current or last connection, 0 for states it didn't reach */
+    uint32_t state_us[ps4_connection_state_count];
+
+    /* Time from the control channel connecting to the first full input
+     * report, for the last connection that got there, and the longest one */
+    uint32_t first_report_us;
+    uint32_t first_report_max_us;
+
+    /* Time from the last input report to the link being declared lost,
+     * for the last loss, and the longest one */
+    uint32_t link_losses;
+    uint32_t loss_detect_us;
+    uint32_t loss_detect_max_us;
+
+    /* Time from boot to the first full input report since, and whether the
+     * current or last controller was a known one */
+    uint32_t boot_to_first_report_us;
+    bool known;
+} ps4_connection_stats_t;
+
+
+/*********************/
+/*   S T O R A G E   */
+/*********************/
+
+/* Key-value store the known controllers are kept in. Both functions
+ * return whether they succeeded, load fails when the key is missing or
+ * its value isn't len bytes long */
+typedef struct {
+    bool (*load)( void *object, const char *key, void *data, size_t len );
+    bool (*save)( void *object, const char *key, const void *data, size_t len );
+    void *object;
+} ps4_storage_t;
+
+/* Controller that connected before, with the settings it last had */
+typedef struct {
+    uint8_t address[6];
+    uint8_t report_interval;    /* ms between input reports, 0 by default */
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+    uint8_t flash_on;
+    uint8_t flash_off;
+    uint32_t connects;
+    uint32_t last_used;         /* higher for more recent connections */
+} ps4_controller_record_t;
+
+
+/*********************/
+/*   M A I L B O X   */
+/*********************/
+
+enum ps4_cmd_status {
+    ps4_cmd_status_queued,
+    ps4_cmd_status_sent,
+    ps4_cmd_status_congested,   /* sent, but held by the stack on a busy link */
+    ps4_cmd_status_dropped,
+    ps4_cmd_status_expired      /* too old for its status to be kept */
+};
+
+/* Command posted to the mailbox. 0 is never returned for a posted
+ * command, and reads as dropped */
+typedef uint32_t ps4_cmd_handle_t;
+
+typedef struct {
+    uint32_t posted;
+    uint32_t sent;
+    uint32_t congested;
+    uint32_t dropped;
+    uint8_t depth;
+    uint8_t depth_max;
+
+    /* Smoothed and longest time from posting a command to sending it */
+    uint32_t latency_us;
+    uint32_t latency_max_us;
+} ps4_mailbox_stats_t;
+
+
+/***********************/
+/*   L I G H T B A R   */
+/***********************/
+
+enum ps4_lightbar_curve {
+    ps4_lightbar_curve_step,
+    ps4_lightbar_curve_linear
+};
+
+/* Color reached at the end of a keyframe, going from the color of the
+ * previous one, or the current color for the first keyframe */
+typedef struct {
+    uint16_t duration_ms;
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+    uint8_t curve;
+} ps4_lightbar_keyframe_t;
+
+typedef struct {
+    uint32_t frames;
+    uint32_t sent;
+    uint32_t unchanged;
+    uint32_t deferred;
+} ps4_lightbar_stats_t;
+
+
+/*******************/
+/*   R U M B L E   */
+/*******************/
+
+enum ps4_rumble_motor {
+    ps4_rumble_motor_heavy = 1 << 0,    /* left, low frequency  */
+    ps4_rumble_motor_light = 1 << 1,    /* right, high frequency */
+    ps4_rumble_motor_both  = (1 << 2) - 1
+};
+
+/* Intensity over time of an effect, relative to its peak intensity */
+typedef struct {
+    uint16_t attack_ms;
+    uint16_t decay_ms;
+    uint8_t sustain;        /* level held after the decay, 255 is the peak */
+    uint16_t sustain_ms;
+    uint16_t release_ms;
+} ps4_rumble_envelope_t;
+
+typedef struct {
+    /* Peak intensities, a motor at 0 is left to other effects */
+    uint8_t heavy;
+    uint8_t light;
+
+    ps4_rumble_envelope_t envelope;
+
+    /* Number of times the envelope is played, 0 until stopped */
+    uint8_t repeat;
+    uint16_t pause_ms;
+
+    /* Effects only replace running effects of the same or lower priority */
+    uint8_t priority;
+} ps4_rumble_effect_t;
+
+/* Step of a rumble pattern, holding both motors at fixed intensities */
+typedef struct {
+    uint16_t duration_ms;
+    uint8_t heavy;
+    uint8_t light;
+} ps4_rumble_step_t;
+
+typedef struct {
+    uint32_t played;
+    uint32_t rejected;
+    uint32_t steps;
+    uint32_t sent;
+} ps4_rumble_stats_t;
+
+
+/*******************************/
+/*   S U B S C R I P T I O N   */
+/*******************************/
+
+enum ps4_interest_button {
+    ps4_interest_button_up       = 1 << 0,
+    ps4_interest_button_right    = 1 << 1,
+    ps4_interest_button_down     = 1 << 2,
+    ps4_interest_button_left     = 1 << 3,
+
+    ps4_interest_button_square   = 1 << 4,
+    ps4_interest_button_cross    = 1 << 5,
+    ps4_interest_button_circle   = 1 << 6,
+    ps4_interest_button_triangle = 1 << 7,
+
+    ps4_interest_button_l1       = 1 << 8,
+    ps4_interest_button_r1       = 1 << 9,
+    ps4_interest_button_l2       = 1 << 10,
+    ps4_interest_button_r2       = 1 << 11,
+
+    ps4_interest_button_share    = 1 << 12,
+    ps4_interest_button_option   = 1 << 13,
+    ps4_interest_button_l3       = 1 << 14,
+    ps4_interest_button_r3       = 1 << 15,
+
+    ps4_interest_button_ps       = 1 << 16,
+    ps4_interest_button_touch    = 1 << 17,
+
+    ps4_interest_button_all      = (1 << 18) - 1
+};
+
+enum ps4_interest_analog {
+    ps4_interest_analog_stick_lx  = 1 << 0,
+    ps4_interest_analog_stick_ly  = 1 << 1,
+    ps4_interest_analog_stick_rx  = 1 << 2,
+    ps4_interest_analog_stick_ry  = 1 << 3,
+    ps4_interest_analog_button_l2 = 1 << 4,
+    ps4_interest_analog_button_r2 = 1 << 5,
+
+    ps4_interest_analog_all       = (1 << 6) - 1
+};
+
+enum ps4_interest_sensor {
+    ps4_interest_sensor_accelerometer_x = 1 << 0,
+    ps4_interest_sensor_accelerometer_y = 1 << 1,
+    ps4_interest_sensor_accelerometer_z = 1 << 2,
+    ps4_interest_sensor_gyroscope_z     = 1 << 3,
+
+    ps4_interest_sensor_all             = (1 << 4) - 1
+};
+
+enum ps4_interest_status {
+    ps4_interest_status_battery    = 1 << 0,
+    ps4_interest_status_connection = 1 << 1,
+    ps4_interest_status_charging   = 1 << 2,
+    ps4_interest_status_rumbling   = 1 << 3,
+
+    ps4_interest_status_all        = (1 << 4) - 1
+};
+
+/* Fields a subscriber cares about, or the fields that changed in a report */
+typedef struct {
+    uint32_t button;
+    uint8_t analog;
+    uint8_t sensor;
+    uint8_t status;
+} ps4_interest_t;
+
+/* Handle returned by ps4Subscribe, negative when the registration failed */
+typedef int ps4_subscription_t;
+
+enum ps4_delivery {
+    /* Every report with a change of interest, as it arrives */
+    ps4_delivery_every_report,
+    /* The newest state at most every interval, with edges accumulated */
+    ps4_delivery_latest,
+    /* All reports since the previous call, as one contiguous array */
+    ps4_delivery_batched
+};
+
+typedef struct {
+    ps4_t ps4;
+    ps4_event_t event;
+} ps4_sample_t;
+
+
+/***************************/
+/*   I N I T   S T A T S   */
+/***************************/
+
+typedef struct {
+    /* Whether the SPP server was left out, see PS4_GAP_ONLY */
+    bool gap_only;
+
+    /* Time and heap taken from ps4Init to accepting connections */
+    uint32_t connectable_us;
+    int32_t heap_used;
+} ps4_init_stats_t;
+
+
+/*****************************/
+/*   A L L O C   S T A T S   */
+/*****************************/
+
+typedef struct {
+    /* Allocations the library made for itself, 0 when ps4Init set
+     * everything up */
+    uint32_t allocs;
+
+    /* Buffers allocated for output reports. The stack takes them over
+     * and frees them once sent, so they can't be kept and reused */
+    uint32_t send_buffers;
+    uint32_t send_bytes;
+
+    uint32_t failures;
+} ps4_alloc_stats_t;
+
+
+/*******************************/
+/*   B U F F E R   S T A T S   */
+/*******************************/
+
+typedef struct {
+    /* Reports retained by keeping the buffer they were received in,
+     * by copying them, and not at all as there was no room left */
+    uint32_t retained;
+    uint32_t copied;
+    uint32_t exhausted;
+
+    /* Received buffers and copies held now, and the most buffers held */
+    uint8_t held;
+    uint8_t held_max;
+    uint8_t copies;
+} ps4_buffer_stats_t;
+
+
+/*****************************/
+/*   S T A C K   S T A T S   */
+/*****************************/
+
+typedef struct {
+    /* Task reports are dispatched and callbacks run on */
+    char task[16];
+
+    /* Least stack ever left on that task, and the most stack used from
+     * the dispatch of a report on, in bytes, over the reports sampled */
+    uint32_t stack_free_min;
+    uint32_t callback_stack_max;
+    uint32_t samples;
+
+    /* Times the stack left got below the guard, see ps4SetStackGuard */
+    uint32_t guard_warnings;
+
+    /* Allocations the library counted itself since the controller
+     * connected, see ps4GetAllocStats, and the least heap ever left free
+     * by anything */
+    ps4_alloc_stats_t heap;
+    uint32_t heap_free_min;
+} ps4_stack_stats_t;
+
+
+/*********************/
+/*   M E T R I C S   */
+/*********************/
+
+/* Health counters of the whole library, see ps4GetMetrics */
+typedef struct {
+    /* Input reports received, those handed on to be parsed, and those
+     * rejected, see ps4GetReportStats for why */
+    uint32_t reports_received;
+    uint32_t reports_parsed;
+    uint32_t reports_rejected;
+
+    /* Input reports by ID */
+    uint32_t reports_short;
+    uint32_t reports_full;
+    uint32_t reports_unknown_id;
+
+    /* Output reports and commands sent, and not sent */
+    uint32_t sends;
+    uint32_t send_failures;
+    uint32_t send_congestions;
+
+    /* Reports whose callbacks took longer than the time between reports */
+    uint32_t callback_overruns;
+
+    /* Send buffers the Bluetooth stack could not allocate, and retained
+     * reports that could not be had as all buffers were in use. Commands
+     * posted to a full mailbox are counted by ps4GetMailboxStats */
+    uint32_t buffer_exhaustions;
+
+    /* Connections, those after a controller already streamed, and links
+     * lost while streaming */
+    uint32_t connects;
+    uint32_t reconnects;
+    uint32_t link_losses;
+} ps4_metrics_t;
+
+
+/*****************/
+/*   T R A C E   */
+/*****************/
+
+/* Events recorded when built with PS4_TRACE, keep tools/ps4_trace.py
+ * in sync when adding to them */
+enum ps4_trace_event {
+    ps4_trace_event_report,         /* input report received, arg: length */
+    ps4_trace_event_parse,          /* arg: ps4_report_type */
+    ps4_trace_event_raw,            /* raw report callbacks */
+    ps4_trace_event_dispatch,       /* event callbacks and subscribers */
+    ps4_trace_event_output,         /* posted and held output after a report */
+    ps4_trace_event_send,           /* arg: length, then ps4_send_result */
+    ps4_trace_event_congested,      /* arg: whether the channel is congested */
+    ps4_trace_event_state,          /* arg: ps4_connection_state */
+    ps4_trace_event_count
+};
+
+enum ps4_trace_phase {
+    ps4_trace_phase_begin,
+    ps4_trace_phase_end,
+    ps4_trace_phase_instant,
+
+    /* The top bit holds the core the event was recorded on */
+    ps4_trace_phase_mask = 0x7f
+};
+
+typedef struct {
+    uint32_t cycles;        /* CPU cycle counter of the recording core */
+    uint8_t event;
+    uint8_t phase;
+    uint16_t arg;
+} ps4_trace_record_t;
+
+
+/*******************************/
+/*   R E P O R T   S T A T S   */
+/*******************************/
+
+typedef struct {
+    uint32_t received;
+    uint32_t parsed_short;
+    uint32_t parsed_full;
+    uint32_t feature;
+    uint32_t handshake;
+    uint32_t rejected_channel;
+    uint32_t rejected_header;
+    uint32_t rejected_id;
+    uint32_t rejected_length;
+    uint32_t rejected_crc;
+
+    /* Smoothed time between input reports, 0 until two have arrived,
+     * and the smoothed deviation of that time from one report to the next */
+    uint32_t interval_us;
+    uint32_t jitter_us;
+} ps4_report_stats_t;
+
+
 /***************************/
 /*    C A L L B A C K S    */
 /***************************/
@@ -152,9 +645,34 @@ typedef struct {
 typedef void(*ps4_connection_callback_t)( uint8_t is_connected );
 typedef void(*ps4_connection_object_callback_t)( void *object, uint8_t is_connected );
 
+typedef void(*ps4_safe_state_callback_t)( void *object, uint8_t reason );
+
 typedef void(*ps4_event_callback_t)( ps4_t ps4, ps4_event_t event );
 typedef void(*ps4_event_object_callback_t)( void *object, ps4_t ps4, ps4_event_t event );
 
+typedef void(*ps4_subscriber_callback_t)( void *object, const ps4_t *ps4, const ps4_event_t *event );
+typedef void(*ps4_subscriber_batch_callback_t)( void *object, const ps4_sample_t *samples, uint16_t count );
+typedef void(*ps4_subscriber_raw_callback_t)( void *object, const uint8_t *report, uint16_t len );
+
+typedef struct {
+    ps4_interest_t interest;
+    ps4_subscriber_callback_t event_cb;
+    ps4_connection_object_callback_t connection_cb;
+    void *object;
+
+    /* Rate limiting, the defaults deliver every report */
+    enum ps4_delivery delivery;
+    uint16_t interval_ms;
+
+    /* Batched delivery, the storage is owned by the subscriber */
+    ps4_subscriber_batch_callback_t batch_cb;
+    ps4_sample_t *batch;
+    uint16_t batch_size;
+
+    /* Unparsed reports, starting at the HID header, see ps4_report.h */
+    ps4_subscriber_raw_callback_t raw_cb;
+} ps4_subscriber_t;
+
 
 /********************************************************************************/
 /*                             F U N C T I O N S                                */
@@ -171,7 +689,59 @@ void ps4SetEventCallback( ps4_event_callback_t cb );
 void ps4SetEventObjectCallback( void *object, ps4_event_object_callback_t cb );
 void ps4SetLed( uint8_t player );
 void ps4SetLedCmd( ps4_cmd_t *cmd, uint8_t player );
+void ps4SetLightbar( uint8_t r, uint8_t g, uint8_t b );
+void ps4SetLightbarFlash( uint8_t on, uint8_t off );
+void ps4LightbarAnimate( const ps4_lightbar_keyframe_t *keyframes, uint8_t count, bool loop );
+void ps4LightbarFade( uint8_t r, uint8_t g, uint8_t b, uint16_t duration_ms );
+void ps4LightbarPulse( uint8_t r, uint8_t g, uint8_t b, uint16_t period_ms );
+void ps4LightbarBattery();
+void ps4LightbarStop();
+void ps4LightbarSetBudget( uint8_t reports_per_second );
+void ps4LightbarGetStats( ps4_lightbar_stats_t *stats );
+bool ps4RumblePlay( const ps4_rumble_effect_t *effect );
+bool ps4RumblePlaySteps( uint8_t motors, const ps4_rumble_step_t *steps, uint8_t count, uint8_t repeat, uint8_t priority );
+void ps4RumbleStop( uint8_t motors );
+void ps4RumbleGetStats( ps4_rumble_stats_t *stats );
+ps4_mixer_channel_t ps4MixerOpen( uint8_t priority, uint8_t blend );
+void ps4MixerClose( ps4_mixer_channel_t channel );
+void ps4MixerSet( ps4_mixer_channel_t channel, const ps4_cmd_t *cmd, uint8_t fields );
+void ps4MixerRelease( ps4_mixer_channel_t channel, uint8_t fields );
+void ps4MixerGetOutput( ps4_cmd_t *cmd );
+void ps4SetOutputAlignment( bool enabled, uint16_t max_hold_ms );
+void ps4GetOutputHoldStats( ps4_output_hold_stats_t *stats );
+void ps4SetStorage( const ps4_storage_t *storage );
+uint8_t ps4GetKnownControllers( ps4_controller_record_t *records, uint8_t max );
+void ps4ForgetControllers();
+void ps4SetSafeStateCallback( void *object, ps4_safe_state_callback_t cb );
+void ps4SetLinkTimeout( uint16_t timeout_ms );
+uint8_t ps4GetConnectionState();
+void ps4GetConnectionStats( ps4_connection_stats_t *stats );
+ps4_cmd_handle_t ps4CmdPost( ps4_cmd_t cmd );
+ps4_cmd_handle_t ps4MixerPost( ps4_mixer_channel_t channel, const ps4_cmd_t *cmd, uint8_t fields );
+uint8_t ps4CmdStatus( ps4_cmd_handle_t handle );
+uint8_t ps4CmdWait( ps4_cmd_handle_t handle, uint32_t timeout_ms );
+void ps4GetMailboxStats( ps4_mailbox_stats_t *stats );
 void ps4SetBluetoothMacAddress( const uint8_t *mac );
+ps4_subscription_t ps4Subscribe( const ps4_subscriber_t *subscriber );
+void ps4Unsubscribe( ps4_subscription_t subscription );
+uint32_t ps4ButtonMask( const ps4_button_t *button );
+void ps4GetReportStats( ps4_report_stats_t *stats );
+void ps4GetInitStats( ps4_init_stats_t *stats );
+void ps4GetAllocStats( ps4_alloc_stats_t *stats );
+const uint8_t* ps4ReportRetain( const uint8_t *report );
+void ps4ReportRelease( const uint8_t *report );
+void ps4GetBufferStats( ps4_buffer_stats_t *stats );
+void ps4GetMetrics( ps4_metrics_t *metrics, bool reset );
+void ps4SetStackGuard( uint16_t min_free );
+void ps4GetStackStats( ps4_stack_stats_t *stats );
+void ps4SetTrace( bool enabled );
+uint16_t ps4TraceRead( ps4_trace_record_t *records, uint16_t max );
+void ps4TraceDump();
+void ps4SetInputCrcCheck( bool enabled );
+void ps4SetReportRate( uint16_t hz );
+uint16_t ps4GetReportRate();
+uint32_t ps4Crc32( uint32_t crc, const uint8_t *data, size_t len );
+ps4_interest_t ps4EventChanges( const ps4_t *prev, const ps4_t *cur, const ps4_event_t *event );
 
 
 #endif
@@ -18,7 +18,7 @@
 #error "The ESP32-PS4 module requires Classic Bluetooth to be enabled in the project's menuconfig"
 #endif
 
-#ifndef CONFIG_BT_SPP_ENABLED
+#if !defined(CONFIG_BT_SPP_ENABLED) && !defined(PS4_GAP_ONLY)
 #error "The ESP32-PS4 module requires Classic Bluetooth's SPP to be enabled in the project's menuconfig"
 #endif
 
@@ -70,9 +70,122 @@
 #endif // __has_include("esp_idf_version.h")
 
 
-/** Size of the output report buffer for the Dualshock and Navigation controllers */
-#define PS4_REPORT_BUFFER_SIZE 48
-#define PS4_HID_BUFFER_SIZE    50
+/** Size of the 0x11 output report following the report ID, including its CRC */
+#define PS4_REPORT_BUFFER_SIZE 77
+#define PS4_HID_BUFFER_SIZE    79
+
+/** Size of the CRC trailing the 0x11 output report */
+#define PS4_REPORT_CRC_SIZE    4
+
+/** Longest input report interval the controller accepts, in ms. The field
+ *  holds 63, but the controller does not take it */
+#define PS4_REPORT_INTERVAL_MAX_MS 62
+
+/** Maximum number of simultaneously registered event subscribers */
+#ifndef PS4_MAX_SUBSCRIBERS
+#define PS4_MAX_SUBSCRIBERS 8
+#endif
+
+/** Maximum number of output mixer channels, including the built-in ones */
+#ifndef PS4_MIXER_MAX_CHANNELS
+#define PS4_MIXER_MAX_CHANNELS 8
+#endif
+
+/** Maximum number of keyframes in a lightbar animation */
+#ifndef PS4_LIGHTBAR_MAX_KEYFRAMES
+#define PS4_LIGHTBAR_MAX_KEYFRAMES 16
+#endif
+
+/** Interval at which lightbar animations are evaluated */
+#ifndef PS4_LIGHTBAR_TICK_MS
+#define PS4_LIGHTBAR_TICK_MS 20
+#endif
+
+/** Low color bits dropped from animated colors, so that changes below
+ *  what can be seen don't cost an output report */
+#ifndef PS4_LIGHTBAR_QUANTIZE_BITS
+#define PS4_LIGHTBAR_QUANTIZE_BITS 2
+#endif
+
+/** Default maximum number of output reports sent for animations per second */
+#ifndef PS4_LIGHTBAR_BUDGET
+#define PS4_LIGHTBAR_BUDGET 25
+#endif
+
+/** Maximum number of steps a rumble effect is precomputed into, per motor */
+#ifndef PS4_RUMBLE_MAX_STEPS
+#define PS4_RUMBLE_MAX_STEPS 32
+#endif
+
+/** Shortest step of a rumble envelope ramp, and the most steps per ramp */
+#ifndef PS4_RUMBLE_RAMP_STEP_MS
+#define PS4_RUMBLE_RAMP_STEP_MS 20
+#endif
+
+#ifndef PS4_RUMBLE_RAMP_STEPS
+#define PS4_RUMBLE_RAMP_STEPS 6
+#endif
+
+/** Time a connection may take to get from one step to the next, and the
+ *  number of times the enable report is sent again when no input report
+ *  follows it in time */
+#ifndef PS4_CONNECTION_SETUP_TIMEOUT_MS
+#define PS4_CONNECTION_SETUP_TIMEOUT_MS 2000
+#endif
+
+#ifndef PS4_CONNECTION_ENABLE_TIMEOUT_MS
+#define PS4_CONNECTION_ENABLE_TIMEOUT_MS 250
+#endif
+
+#ifndef PS4_CONNECTION_ENABLE_RETRIES
+#define PS4_CONNECTION_ENABLE_RETRIES 4
+#endif
+
+/** Default time without input reports after which the link is declared
+ *  lost, 0 to only rely on disconnections, see ps4SetLinkTimeout */
+#ifndef PS4_LINK_TIMEOUT_MS
+#define PS4_LINK_TIMEOUT_MS 0
+#endif
+
+/** Number of known controllers remembered, the least recent is replaced */
+#ifndef PS4_CONTROLLER_TABLE_SIZE
+#define PS4_CONTROLLER_TABLE_SIZE 4
+#endif
+
+/** Most commands waiting in the mailbox, see ps4CmdPost */
+#ifndef PS4_MAILBOX_DEPTH
+#define PS4_MAILBOX_DEPTH 8
+#endif
+
+/** Default longest time output is held back waiting for an input report */
+#ifndef PS4_OUTPUT_MAX_HOLD_MS
+#define PS4_OUTPUT_MAX_HOLD_MS 10
+#endif
+
+/** Most received buffers kept by ps4ReportRetain, and the number of
+ *  reports copied once they are all held */
+#ifndef PS4_REPORT_RETAIN_MAX
+#define PS4_REPORT_RETAIN_MAX 4
+#endif
+
+#ifndef PS4_REPORT_COPY_SLOTS
+#define PS4_REPORT_COPY_SLOTS 4
+#endif
+
+/** One report out of this many has the stack its dispatch uses measured,
+ *  and a warning is logged when less stack than the guard was left */
+#ifndef PS4_STACK_SAMPLE_REPORTS
+#define PS4_STACK_SAMPLE_REPORTS 64
+#endif
+
+#ifndef PS4_STACK_GUARD_BYTES
+#define PS4_STACK_GUARD_BYTES 512
+#endif
+
+/** Number of events kept by the trace ring, a power of two, see PS4_TRACE */
+#ifndef PS4_TRACE_RECORDS
+#define PS4_TRACE_RECORDS 512
+#endif
 
 /********************************************************************************/
 /*                         S H A R E D   T Y P E S                              */
@@ -86,7 +199,7 @@ enum hid_cmd_code {
 
 enum hid_cmd_identifier {
     hid_cmd_identifier_ps4_enable  = 0xf4,
-    hid_cmd_identifier_ps4_control = 0x01
+    hid_cmd_identifier_ps4_control = 0x11
 };
 
 
@@ -97,24 +210,46 @@ typedef struct {
 
 } hid_cmd_t;
 
+/* Offsets in the data of the 0x11 output report */
 enum ps4_control_packet_index {
-    ps4_control_packet_index_rumble_right_duration = 1,
-    ps4_control_packet_index_rumble_right_intensity = 2,
-    ps4_control_packet_index_rumble_left_duration = 3,
-    ps4_control_packet_index_rumble_left_intensity = 4,
-
-    ps4_control_packet_index_leds = 9,
-    ps4_control_packet_index_led4_arguments = 10,
-    ps4_control_packet_index_led3_arguments = 15,
-    ps4_control_packet_index_led2_arguments = 20,
-    ps4_control_packet_index_led1_arguments = 25
+    ps4_control_packet_index_hw_control     = 0,
+    ps4_control_packet_index_audio_control  = 1,
+    ps4_control_packet_index_flags          = 2,
+
+    ps4_control_packet_index_rumble_right   = 5,
+    ps4_control_packet_index_rumble_left    = 6,
+
+    ps4_control_packet_index_lightbar_red   = 7,
+    ps4_control_packet_index_lightbar_green = 8,
+    ps4_control_packet_index_lightbar_blue  = 9,
+    ps4_control_packet_index_flash_on       = 10,
+    ps4_control_packet_index_flash_off      = 11,
+
+    ps4_control_packet_index_crc            = PS4_REPORT_BUFFER_SIZE - PS4_REPORT_CRC_SIZE
+};
+
+enum ps4_control_hw_control {
+    ps4_control_hw_control_crc = 0x40,
+    ps4_control_hw_control_hid = 0x80,
+
+    /* Input report interval in ms, 0 keeps the controller default */
+    ps4_control_hw_control_interval_mask = 0x3f
+};
+
+enum ps4_control_flags {
+    ps4_control_flags_rumble   = 0x01,
+    ps4_control_flags_lightbar = 0x02,
+    ps4_control_flags_flash    = 0x04
 };
 
-enum ps4_led_mask {
-    ps4_led_mask_led1 = 1 << 1,
-    ps4_led_mask_led2 = 1 << 2,
-    ps4_led_mask_led3 = 1 << 3,
-    ps4_led_mask_led4 = 1 << 4,
+/* Outcome of handing a report to L2CAP, from best to worst */
+enum ps4_send_result {
+    ps4_send_result_ok,
+    ps4_send_result_congested,
+    ps4_send_result_failed,
+
+    /* Left to the send in progress, which reports the outcome */
+    ps4_send_result_deferred
 };
 
 
@@ -123,14 +258,147 @@ enum ps4_led_mask {
 /********************************************************************************/
 
 void ps4_connect_event(uint8_t is_connected);
-void ps4_packet_event( ps4_t ps4, ps4_event_t event );
+void ps4_link_lost( uint8_t reason );
+void ps4_init_done();
+void ps4_enable_poll();
+
+/* Counts in the library-wide metrics, see ps4GetMetrics. Relaxed, as the
+ * counters are independent of each other and of everything else */
+extern ps4_metrics_t ps4_metrics;
+
+#define PS4_METRIC_INC(counter) __atomic_fetch_add( &ps4_metrics.counter, 1, __ATOMIC_RELAXED )
+
+enum ps4_alloc_kind {
+    ps4_alloc_kind_library,
+    ps4_alloc_kind_send
+};
+
+void ps4_alloc_count( uint8_t kind, bool ok, uint32_t size );
+void ps4_alloc_reset();
+void ps4_packet_event( const ps4_t *ps4, const ps4_event_t *event, const ps4_interest_t *changed );
+void ps4_report_event( uint8_t channel, const uint8_t *report, uint16_t len );
+
+
+/********************************************************************************/
+/*                      O U T P U T   F U N C T I O N S                         */
+/********************************************************************************/
+
+uint8_t ps4_output_send( const ps4_cmd_t *cmd );
+void ps4_output_set_interval( uint8_t interval );
+uint8_t ps4_output_get_interval();
+
+
+/********************************************************************************/
+/*                        M I X E R   F U N C T I O N S                         */
+/********************************************************************************/
+
+/* Channels opened at startup, used by ps4Cmd and the effect engines */
+enum ps4_mixer_channel {
+    ps4_mixer_channel_base,
+    ps4_mixer_channel_lightbar,
+    ps4_mixer_channel_rumble,
+    ps4_mixer_channel_count
+};
+
+void ps4_mixer_update( ps4_mixer_channel_t channel, const ps4_cmd_t *cmd, uint8_t set, uint8_t release );
+void ps4_mixer_get( ps4_mixer_channel_t channel, ps4_cmd_t *cmd );
+void ps4_mixer_flush();
+void ps4_mixer_resend();
+uint8_t ps4_mixer_input_done();
+void ps4_mixer_handoff();
+
+
+/********************************************************************************/
+/*                   C O N N E C T I O N   F U N C T I O N S                    */
+/********************************************************************************/
+
+void ps4_connection_init();
+void ps4_connection_set_state( uint8_t state );
+void ps4_connection_feed();
+bool ps4_connection_poll();
+bool ps4_connection_is_silent();
+void ps4_connection_set_known( bool known );
+
+
+/********************************************************************************/
+/*                      S T O R A G E   F U N C T I O N S                       */
+/********************************************************************************/
+
+void ps4_storage_init();
+bool ps4_storage_connected( const uint8_t *address );
+void ps4_storage_disconnected();
+
+
+/********************************************************************************/
+/*                      M A I L B O X   F U N C T I O N S                       */
+/********************************************************************************/
+
+void ps4_mailbox_drain();
+void ps4_mailbox_reset();
+void ps4_mailbox_settle( uint8_t result );
+
+
+/********************************************************************************/
+/*                        S T A C K   F U N C T I O N S                         */
+/********************************************************************************/
+
+void ps4_stack_enter();
+void ps4_stack_leave();
+
+
+/********************************************************************************/
+/*                       B U F F E R   F U N C T I O N S                        */
+/********************************************************************************/
+
+void ps4_buffer_begin( void *buffer, const uint8_t *report, uint16_t len );
+bool ps4_buffer_end();
 
 
 /********************************************************************************/
 /*                      P A R S E R   F U N C T I O N S                         */
 /********************************************************************************/
 
-void ps4_parse_packet( uint8_t *packet);
+enum ps4_report_type {
+    ps4_report_type_rejected,
+    ps4_report_type_handshake,
+    ps4_report_type_feature,
+    ps4_report_type_short,
+    ps4_report_type_full
+};
+
+enum ps4_report_type ps4_parse_report_type( uint8_t channel, const uint8_t *report, uint16_t len );
+void ps4_parse_packet_short( const uint8_t *report );
+void ps4_parse_packet_full( const uint8_t *report, const ps4_interest_t *wanted );
+void ps4_parse_get_stats( ps4_report_stats_t *stats );
+uint32_t ps4_parse_get_interval();
+ps4_interest_t ps4_parse_changes( ps4_t prev, ps4_t cur, ps4_event_t event );
+void ps4_parse_set_crc_check( bool enabled );
+
+
+/********************************************************************************/
+/*                   S U B S C R I B E R   F U N C T I O N S                    */
+/********************************************************************************/
+
+void ps4_subscribers_dispatch( const ps4_t *ps4, const ps4_event_t *event, const ps4_interest_t *changed );
+void ps4_subscribers_connection( uint8_t is_connected );
+void ps4_subscribers_raw( const uint8_t *report, uint16_t len );
+ps4_interest_t ps4_subscribers_interest();
+
+
+/********************************************************************************/
+/*                     L I G H T B A R   F U N C T I O N S                      */
+/********************************************************************************/
+
+void ps4_lightbar_init();
+void ps4_lightbar_status( const ps4_status_t *status );
+uint8_t ps4_lightbar_interest();
+
+
+/********************************************************************************/
+/*                       R U M B L E   F U N C T I O N S                        */
+/********************************************************************************/
+
+void ps4_rumble_init();
 
 
 /********************************************************************************/
@@ -141,6 +409,14 @@ void ps4_spp_init();
 void ps4_spp_deinit();
 
 
+/********************************************************************************/
+/*                          G A P   F U N C T I O N S                           */
+/********************************************************************************/
+
+void ps4_gap_init();
+void ps4_gap_deinit();
+
+
 /********************************************************************************/
 /*                        L 2 C A P   F U N C T I O N S                         */
 /********************************************************************************/
@@ -148,5 +424,19 @@ void ps4_spp_deinit();
 void ps4_l2cap_init_services();
 void ps4_l2cap_deinit_services();
 void ps4_l2cap_send_hid( hid_cmd_t *hid_cmd, uint8_t len );
+uint8_t ps4_l2cap_send_report( const uint8_t *report, uint16_t len );
+void ps4_l2cap_free_buffer( void *buffer );
+/* Work run on the Bluetooth task, see ps4_l2cap_call */
+enum ps4_l2cap_call {
+    ps4_l2cap_call_output,
+    ps4_l2cap_call_enable,
+    ps4_l2cap_call_link,
+    ps4_l2cap_call_count
+};
+
+bool ps4_l2cap_in_task();
+void ps4_l2cap_disconnect();
+void ps4_l2cap_call( uint8_t call, uint32_t delay_ms );
+void ps4_l2cap_call_cancel( uint8_t call );
 
 #endif
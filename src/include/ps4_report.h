@@ -0,0 +1,85 @@
+#ifndef PS4_REPORT_H
+#define PS4_REPORT_H
+
+
+/********************************************************************************/
+/*                      R E P O R T   L A Y O U T                               */
+/********************************************************************************/
+
+/* Reports are addressed from their HID transaction header, the first byte of
+ * the L2CAP payload. The input fields follow a report specific prefix, after
+ * which both report types share the same layout. */
+
+enum ps4_hid_header {
+    ps4_hid_header_input   = 0xa1,
+    ps4_hid_header_output  = 0xa2,
+    ps4_hid_header_feature = 0xa3,
+
+    /* Transaction type, upper nibble of the header */
+    ps4_hid_header_type_mask      = 0xf0,
+    ps4_hid_header_type_handshake = 0x00,
+    ps4_hid_header_type_data      = 0xa0
+};
+
+/* L2CAP channel a report arrived on */
+enum ps4_report_channel {
+    ps4_report_channel_control,
+    ps4_report_channel_interrupt
+};
+
+enum ps4_report_id {
+    ps4_report_id_short = 0x01,
+    ps4_report_id_full  = 0x11
+};
+
+enum ps4_report_prefix {
+    ps4_report_prefix_header = 0,
+    ps4_report_prefix_id     = 1,
+
+    /* Start of the input fields in each report type */
+    ps4_report_prefix_short  = 2,
+    ps4_report_prefix_full   = 4
+};
+
+/* Offsets of the input fields, relative to the start of the input fields */
+enum ps4_report_index {
+    ps4_report_index_analog_stick_lx        = 0,
+    ps4_report_index_analog_stick_ly        = 1,
+    ps4_report_index_analog_stick_rx        = 2,
+    ps4_report_index_analog_stick_ry        = 3,
+
+    ps4_report_index_buttons                = 4,
+
+    ps4_report_index_analog_button_l2       = 7,
+    ps4_report_index_analog_button_r2       = 8,
+
+    ps4_report_index_timestamp              = 9,
+    ps4_report_index_temperature            = 11,
+
+    ps4_report_index_sensor_gyroscope_x     = 12,
+    ps4_report_index_sensor_gyroscope_y     = 14,
+    ps4_report_index_sensor_gyroscope_z     = 16,
+    ps4_report_index_sensor_accelerometer_x = 18,
+    ps4_report_index_sensor_accelerometer_y = 20,
+    ps4_report_index_sensor_accelerometer_z = 22,
+
+    ps4_report_index_status                 = 29,
+
+    ps4_report_index_touch_finger           = 34,
+    ps4_report_index_touch_position         = 35
+};
+
+/* Number of input field bytes carried by each report type */
+enum ps4_report_fields_length {
+    ps4_report_fields_length_short = 9,
+    ps4_report_fields_length_full  = 71
+};
+
+/* CRC trailing the full report, calculated over everything before it.
+ * It follows the full report prefix and input fields. */
+enum ps4_report_crc {
+    ps4_report_crc_full   = 75,
+    ps4_report_crc_length = 4
+};
+
+#endif
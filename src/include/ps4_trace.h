@@ -0,0 +1,66 @@
+#ifndef PS4_TRACE_H
+#define PS4_TRACE_H
+
+#include "ps4.h"
+#include "ps4_int.h"
+
+
+/********************************************************************************/
+/*                              T R A C I N G                                   */
+/********************************************************************************/
+
+/* Events are only recorded when the library is built with PS4_TRACE defined.
+ * Otherwise the macros expand to nothing, and their arguments are not
+ * evaluated. */
+
+#ifdef PS4_TRACE
+
+#include "freertos/FreeRTOS.h"
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+#include "esp_cpu.h"
+#define PS4_TRACE_CLOCK() esp_cpu_get_cycle_count()
+#else
+#include "xtensa/hal.h"
+#define PS4_TRACE_CLOCK() xthal_get_ccount()
+#endif
+
+#if (PS4_TRACE_RECORDS & (PS4_TRACE_RECORDS - 1)) != 0
+#error "PS4_TRACE_RECORDS must be a power of two"
+#endif
+
+extern ps4_trace_record_t ps4_trace_ring[PS4_TRACE_RECORDS];
+extern uint32_t ps4_trace_head;
+extern volatile bool ps4_trace_on;
+
+/* Claims the next record with a single atomic increment, so that events
+ * can be recorded from any task or core without a lock. A record being
+ * written while the ring is read may be torn, see ps4TraceRead */
+static inline void ps4_trace_write( uint8_t event, uint8_t phase, uint16_t arg )
+{
+    if (!ps4_trace_on) {
+        return;
+    }
+
+    uint32_t index = __atomic_fetch_add( &ps4_trace_head, 1, __ATOMIC_RELAXED );
+    ps4_trace_record_t *record = &ps4_trace_ring[index & (PS4_TRACE_RECORDS - 1)];
+
+    record->cycles = PS4_TRACE_CLOCK();
+    record->event = event;
+    record->phase = phase | (xPortGetCoreID() << 7);
+    record->arg = arg;
+}
+
+#define PS4_TRACE_BEGIN(event, arg)   ps4_trace_write( (event), ps4_trace_phase_begin, (arg) )
+#define PS4_TRACE_END(event, arg)     ps4_trace_write( (event), ps4_trace_phase_end, (arg) )
+#define PS4_TRACE_INSTANT(event, arg) ps4_trace_write( (event), ps4_trace_phase_instant, (arg) )
+
+#else
+
+#define PS4_TRACE_BEGIN(event, arg)   do { } while (0)
+#define PS4_TRACE_END(event, arg)     do { } while (0)
+#define PS4_TRACE_INSTANT(event, arg) do { } while (0)
+
+#endif
+
+#endif
@@ -2,15 +2,33 @@
 #include <stdbool.h>
 #include <string.h>
 #include <esp_system.h>
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
 #include "include/ps4.h"
 #include "include/ps4_int.h"
+#include "include/ps4_report.h"
+#include "include/ps4_trace.h"
 
 /********************************************************************************/
 /*                              C O N S T A N T S                               */
 /********************************************************************************/
 
 static const uint8_t hid_cmd_payload_ps4_enable[] = { 0x42, 0x03, 0x00, 0x00 };
-static const uint8_t hid_cmd_payload_led_arguments[] = { 0xff, 0x27, 0x10, 0x00, 0x32 };
+
+/* Lightbar colors of the players, as on the console */
+static const uint8_t ps4_player_colors[][3] = {
+    { 0x00, 0x00, 0x00 },
+    { 0x00, 0x00, 0x40 },   /* blue   */
+    { 0x40, 0x00, 0x00 },   /* red    */
+    { 0x00, 0x40, 0x00 },   /* green  */
+    { 0x20, 0x00, 0x20 },   /* pink   */
+    { 0x40, 0x20, 0x00 },   /* orange */
+    { 0x00, 0x20, 0x20 },   /* cyan   */
+    { 0x30, 0x30, 0x00 },   /* yellow */
+    { 0x10, 0x00, 0x30 },   /* purple */
+    { 0x20, 0x20, 0x20 },   /* white  */
+    { 0x30, 0x08, 0x08 }    /* salmon */
+};
 
 
 /********************************************************************************/
@@ -22,11 +40,23 @@ static ps4_connection_object_callback_t ps4_connection_object_cb = NULL;
 static void *ps4_connection_object = NULL;
 
 
+static ps4_safe_state_callback_t ps4_safe_state_cb = NULL;
+static void *ps4_safe_state_object = NULL;
+
 static ps4_event_callback_t ps4_event_cb = NULL;
 static ps4_event_object_callback_t ps4_event_object_cb = NULL;
 static void *ps4_event_object = NULL;
 
 static bool is_active = false;
+static volatile bool ps4_enable_pending = false;
+
+static int64_t ps4_init_started = 0;
+static uint32_t ps4_init_heap = 0;
+static ps4_init_stats_t ps4_init_stats;
+
+static ps4_alloc_stats_t ps4_alloc_stats;
+static portMUX_TYPE ps4_alloc_lock = portMUX_INITIALIZER_UNLOCKED;
+
 
 
 /********************************************************************************/
@@ -46,7 +76,19 @@ static bool is_active = false;
 *******************************************************************************/
 void ps4Init()
 {
+    ps4_init_started = esp_timer_get_time();
+    ps4_init_heap = esp_get_free_heap_size();
+
+    ps4_storage_init();
+    ps4_lightbar_init();
+    ps4_rumble_init();
+    ps4_connection_init();
+
+#ifdef PS4_GAP_ONLY
+    ps4_gap_init();
+#else
     ps4_spp_init();
+#endif
     ps4_l2cap_init_services();
 }
 
@@ -64,7 +106,11 @@ void ps4Init()
 void ps4Deinit()
 {
     ps4_l2cap_deinit_services();
+#ifdef PS4_GAP_ONLY
+    ps4_gap_deinit();
+#else
     ps4_spp_deinit();
+#endif
 }
 
 
@@ -73,7 +119,8 @@ void ps4Deinit()
 ** Function         ps4IsConnected
 **
 ** Description      This returns whether a PS4 controller is connected, based
-**                  on whether a successful handshake has taken place.
+**                  on whether a successful handshake has taken place, and
+**                  the link was not declared lost since, see ps4SetLinkTimeout.
 **
 **
 ** Returns          bool
@@ -81,7 +128,7 @@ void ps4Deinit()
 *******************************************************************************/
 bool ps4IsConnected()
 {
-    return is_active;
+    return is_active && !ps4_connection_is_silent();
 }
 
 
@@ -90,7 +137,9 @@ bool ps4IsConnected()
 ** Function         ps4Enable
 **
 ** Description      This triggers the PS4 controller to start continually
-**                  sending its data.
+**                  sending its data. Called from another task than the
+**                  Bluetooth one, the report is handed over to the
+**                  Bluetooth task to be sent.
 **
 **
 ** Returns          void
@@ -98,6 +147,14 @@ bool ps4IsConnected()
 *******************************************************************************/
 void ps4Enable()
 {
+    if(!ps4_l2cap_in_task()){
+        ps4_enable_pending = true;
+        ps4_l2cap_call( ps4_l2cap_call_enable, 0 );
+        return;
+    }
+
+    ps4_enable_pending = false;
+
     uint16_t len = sizeof(hid_cmd_payload_ps4_enable);
     hid_cmd_t hid_cmd;
 
@@ -109,11 +166,24 @@ void ps4Enable()
     ps4_l2cap_send_hid( &hid_cmd, len );
 }
 
+/* Sends the enable report ps4Enable left for the Bluetooth task, called
+ * from it by ps4_l2cap_call, or as anything is received if that ran first */
+void ps4_enable_poll()
+{
+    if(ps4_enable_pending){
+        ps4Enable();
+    }
+}
+
 /*******************************************************************************
 **
 ** Function         ps4Cmd
 **
-** Description      Send a command to the PS4 controller.
+** Description      Send a command to the PS4 controller. The command is
+**                  the base channel of the output mixer: channels opened
+**                  with ps4MixerOpen and the lightbar and rumble effects
+**                  are mixed on top of it, and a report is only sent when
+**                  the result changes.
 **
 **
 ** Returns          void
@@ -121,29 +191,64 @@ void ps4Enable()
 *******************************************************************************/
 void ps4Cmd( ps4_cmd_t cmd )
 {
-    hid_cmd_t hid_cmd = { .data = {0} };
-    uint16_t len = sizeof(hid_cmd.data);
+    ps4MixerSet( ps4_mixer_channel_base, &cmd, ps4_mixer_field_all );
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4SetReportRate
+**
+** Description      Sets the rate at which the controller sends its input
+**                  reports. The controller takes it as a whole number of
+**                  milliseconds between reports, so the rate is rounded
+**                  to the nearest interval, from 1000 Hz down to about
+**                  16 Hz. A rate of 0 restores the controller default.
+**
+**                  The rate is applied when a controller connects, and
+**                  right away when one is connected.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4SetReportRate( uint16_t hz )
+{
+    uint16_t interval = 0;
 
-    hid_cmd.code = hid_cmd_code_set_report | hid_cmd_code_type_output;
-    hid_cmd.identifier = hid_cmd_identifier_ps4_control;
+    if (hz > 0) {
+        interval = (1000 + hz / 2) / hz;
 
-    hid_cmd.data[ps4_control_packet_index_rumble_right_duration]  = cmd.rumble_right_duration;
-    hid_cmd.data[ps4_control_packet_index_rumble_right_intensity] = cmd.rumble_right_intensity;
-    hid_cmd.data[ps4_control_packet_index_rumble_left_duration]   = cmd.rumble_left_duration;
-    hid_cmd.data[ps4_control_packet_index_rumble_left_intensity]  = cmd.rumble_left_intensity;
+        if (interval < 1) interval = 1;
+        if (interval > PS4_REPORT_INTERVAL_MAX_MS) interval = PS4_REPORT_INTERVAL_MAX_MS;
+    }
 
-    hid_cmd.data[ps4_control_packet_index_leds] = 0;
-    if (cmd.led1) hid_cmd.data[ps4_control_packet_index_leds] |= ps4_led_mask_led1;
-    if (cmd.led2) hid_cmd.data[ps4_control_packet_index_leds] |= ps4_led_mask_led2;
-    if (cmd.led3) hid_cmd.data[ps4_control_packet_index_leds] |= ps4_led_mask_led3;
-    if (cmd.led4) hid_cmd.data[ps4_control_packet_index_leds] |= ps4_led_mask_led4;
+    ps4_output_set_interval( interval );
+    ps4_mixer_resend();
+}
 
-    if (cmd.led1) memcpy( hid_cmd.data + ps4_control_packet_index_led1_arguments, hid_cmd_payload_led_arguments, sizeof(hid_cmd_payload_led_arguments));
-    if (cmd.led2) memcpy( hid_cmd.data + ps4_control_packet_index_led2_arguments, hid_cmd_payload_led_arguments, sizeof(hid_cmd_payload_led_arguments));
-    if (cmd.led3) memcpy( hid_cmd.data + ps4_control_packet_index_led3_arguments, hid_cmd_payload_led_arguments, sizeof(hid_cmd_payload_led_arguments));
-    if (cmd.led4) memcpy( hid_cmd.data + ps4_control_packet_index_led4_arguments, hid_cmd_payload_led_arguments, sizeof(hid_cmd_payload_led_arguments));
 
-    ps4_l2cap_send_hid( &hid_cmd, len );
+/*******************************************************************************
+**
+** Function         ps4GetReportRate
+**
+** Description      Returns the rate at which input reports are actually
+**                  being received, averaged over the last few reports.
+**
+**
+** Returns          uint16_t, in Hz, 0 when no reports are being received
+**
+*******************************************************************************/
+uint16_t ps4GetReportRate()
+{
+    ps4_report_stats_t stats;
+    ps4_parse_get_stats( &stats );
+
+    if (!is_active || stats.interval_us == 0) {
+        return 0;
+    }
+
+    return (1000000 + stats.interval_us / 2) / stats.interval_us;
 }
 
 
@@ -162,7 +267,7 @@ void ps4SetLed( uint8_t player )
 {
     ps4_cmd_t cmd = {0};
     ps4SetLedCmd(&cmd, player);
-    ps4Cmd(cmd);
+    ps4MixerSet(ps4_mixer_channel_base, &cmd, ps4_mixer_field_lightbar);
 }
 
 
@@ -170,8 +275,9 @@ void ps4SetLed( uint8_t player )
 **
 ** Function         ps4SetLed
 **
-** Description      Sets the LED bits on the PS4 controller command to the
-**                  player number. Up to 10 players are supported.
+** Description      Sets the LED bits and the lightbar color on the PS4
+**                  controller command to the player number. Up to 10
+**                  players are supported.
 **
 **
 ** Returns          void
@@ -192,6 +298,12 @@ void ps4SetLedCmd( ps4_cmd_t *cmd, uint8_t player )
     // player 9  1     1     1
     // player 10 1     1     1     1
 
+    if( player < sizeof(ps4_player_colors) / sizeof(ps4_player_colors[0]) ){
+        cmd->r = ps4_player_colors[player][0];
+        cmd->g = ps4_player_colors[player][1];
+        cmd->b = ps4_player_colors[player][2];
+    }
+
     if( (cmd->led4 = player >= 4) != 0 ) player -= 4;
     if( (cmd->led3 = player >= 3) != 0 ) player -= 3;
     if( (cmd->led2 = player >= 2) != 0 ) player -= 2;
@@ -234,6 +346,28 @@ void ps4SetConnectionObjectCallback( void *object, ps4_connection_object_callbac
     ps4_connection_object = object;
 }
 
+/*******************************************************************************
+**
+** Function         ps4SetSafeStateCallback
+**
+** Description      Registers a callback run as soon as the link to the
+**                  controller is lost, before the connection callbacks, so
+**                  that whatever the controller drives can be stopped. It
+**                  runs on the Bluetooth or timer task and must be short.
+**                  After a link timeout, the connection callbacks only run
+**                  once the Bluetooth stack reports the disconnection, or
+**                  the controller is heard from again and disconnected.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4SetSafeStateCallback( void *object, ps4_safe_state_callback_t cb )
+{
+    ps4_safe_state_cb = cb;
+    ps4_safe_state_object = object;
+}
+
 /*******************************************************************************
 **
 ** Function         ps4SetEventCallback
@@ -271,7 +405,9 @@ void ps4SetEventObjectCallback( void *object, ps4_event_object_callback_t cb )
 **
 ** Function         ps4SetBluetoothMacAddress
 **
-** Description      Writes a Registers a callback for receiving PS4 controller events
+** Description      Sets the Bluetooth MAC address the PS4 controller is
+**                  paired with, by setting the base MAC address. Nothing
+**                  is written when it is already set.
 **
 **
 ** Returns          void
@@ -282,51 +418,343 @@ void ps4SetBluetoothMacAddress( const uint8_t *mac )
     // The bluetooth MAC address is derived from the base MAC address
     // https://docs.espressif.com/projects/esp-idf/en/stable/api-reference/system/system.html#mac-address
     uint8_t base_mac[6];
+    uint8_t current_mac[6];
     memcpy(base_mac, mac, 6);
     base_mac[5] -= 2;
+
+    if(esp_base_mac_addr_get(current_mac) == ESP_OK && memcmp(current_mac, base_mac, 6) == 0){
+        return;
+    }
+
     esp_base_mac_addr_set(base_mac);
 }
 
 
+/*******************************************************************************
+**
+** Function         ps4SetInputCrcCheck
+**
+** Description      Enables validating the CRC of incoming full reports.
+**                  Reports with a mismatching CRC are dropped before they
+**                  reach any callback, and counted as rejected.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4SetInputCrcCheck( bool enabled )
+{
+    ps4_parse_set_crc_check( enabled );
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4GetReportStats
+**
+** Description      Retrieves the number of received reports, by the decoder
+**                  they were routed to or the reason they were rejected.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4GetReportStats( ps4_report_stats_t *stats )
+{
+    ps4_parse_get_stats( stats );
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4ButtonMask
+**
+** Description      Converts the button states into a mask of
+**                  ps4_interest_button flags.
+**
+**
+** Returns          uint32_t
+**
+*******************************************************************************/
+uint32_t ps4ButtonMask( const ps4_button_t *button )
+{
+    uint32_t mask = 0;
+
+    if (button->up)       mask |= ps4_interest_button_up;
+    if (button->right)    mask |= ps4_interest_button_right;
+    if (button->down)     mask |= ps4_interest_button_down;
+    if (button->left)     mask |= ps4_interest_button_left;
+
+    if (button->square)   mask |= ps4_interest_button_square;
+    if (button->cross)    mask |= ps4_interest_button_cross;
+    if (button->circle)   mask |= ps4_interest_button_circle;
+    if (button->triangle) mask |= ps4_interest_button_triangle;
+
+    if (button->l1)       mask |= ps4_interest_button_l1;
+    if (button->r1)       mask |= ps4_interest_button_r1;
+    if (button->l2)       mask |= ps4_interest_button_l2;
+    if (button->r2)       mask |= ps4_interest_button_r2;
+
+    if (button->share)    mask |= ps4_interest_button_share;
+    if (button->option)   mask |= ps4_interest_button_option;
+    if (button->l3)       mask |= ps4_interest_button_l3;
+    if (button->r3)       mask |= ps4_interest_button_r3;
+
+    if (button->ps)       mask |= ps4_interest_button_ps;
+    if (button->touch)    mask |= ps4_interest_button_touch;
+
+    return mask;
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4EventChanges
+**
+** Description      Determines which fields changed between two consecutive
+**                  reports, in the same form as a subscriber interest.
+**
+**
+** Returns          ps4_interest_t
+**
+*******************************************************************************/
+ps4_interest_t ps4EventChanges( const ps4_t *prev, const ps4_t *cur, const ps4_event_t *event )
+{
+    return ps4_parse_changes( *prev, *cur, *event );
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4GetInitStats
+**
+** Description      Copies the time and heap ps4Init took to get to the
+**                  point of accepting connections. Comparing builds with
+**                  and without PS4_GAP_ONLY gives what the SPP server
+**                  costs.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4GetInitStats( ps4_init_stats_t *stats )
+{
+    *stats = ps4_init_stats;
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4GetAllocStats
+**
+** Description      Copies the counters of allocations made by the library
+**                  since the controller connected. Everything the library
+**                  needs for itself is allocated by ps4Init, so only the
+**                  buffers handed to the stack with output reports should
+**                  be counted while streaming.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4GetAllocStats( ps4_alloc_stats_t *stats )
+{
+    portENTER_CRITICAL(&ps4_alloc_lock);
+    *stats = ps4_alloc_stats;
+    portEXIT_CRITICAL(&ps4_alloc_lock);
+}
+
+
 /********************************************************************************/
 /*                      L O C A L    F U N C T I O N S                          */
 /********************************************************************************/
 
+/* Called once connections are accepted, which is only after the SPP
+ * server started when it is used */
+void ps4_init_done()
+{
+#ifdef PS4_GAP_ONLY
+    ps4_init_stats.gap_only = true;
+#endif
+    ps4_init_stats.connectable_us = esp_timer_get_time() - ps4_init_started;
+    ps4_init_stats.heap_used = (int32_t)ps4_init_heap - (int32_t)esp_get_free_heap_size();
+}
+
+
+/* Counts an allocation, failed unless ok */
+void ps4_alloc_count( uint8_t kind, bool ok, uint32_t size )
+{
+    portENTER_CRITICAL(&ps4_alloc_lock);
+
+    if (!ok) {
+        ps4_alloc_stats.failures++;
+    } else if (kind == ps4_alloc_kind_send) {
+        ps4_alloc_stats.send_buffers++;
+        ps4_alloc_stats.send_bytes += size;
+    } else {
+        ps4_alloc_stats.allocs++;
+    }
+
+    portEXIT_CRITICAL(&ps4_alloc_lock);
+}
+
+
+/* Starts counting again, as a controller connects */
+void ps4_alloc_reset()
+{
+    portENTER_CRITICAL(&ps4_alloc_lock);
+    memset( &ps4_alloc_stats, 0, sizeof(ps4_alloc_stats) );
+    portEXIT_CRITICAL(&ps4_alloc_lock);
+}
+
+
 void ps4_connect_event( uint8_t is_connected )
 {
     if(is_connected){
         ps4Enable();
-    }else{
+    }else if(is_active){
         is_active = false;
+        ps4_mailbox_reset();
+
+        if(ps4_connection_cb != NULL)
+        {
+            ps4_connection_cb( is_active );
+        }
+
+        if(ps4_connection_object_cb != NULL && ps4_connection_object != NULL)
+        {
+            ps4_connection_object_cb( ps4_connection_object, is_active );
+        }
+
+        ps4_subscribers_connection( is_active );
     }
 }
 
 
-void ps4_packet_event( ps4_t ps4, ps4_event_t event )
+/* Puts the application in its safe state, ahead of the disconnection
+ * being reported from the Bluetooth task */
+void ps4_link_lost( uint8_t reason )
 {
-    // Trigger packet event, but if this is the very first packet
-    // after connecting, trigger a connection event instead
+    PS4_METRIC_INC(link_losses);
+
+    if(ps4_safe_state_cb != NULL)
+    {
+        ps4_safe_state_cb( ps4_safe_state_object, reason );
+    }
+}
+
+
+/* Reports the connection as the first full input report arrives */
+static void ps4_streaming_event()
+{
+    is_active = true;
+    ps4_connection_set_state( ps4_connection_state_streaming );
+
+    // Restores the output and applies the report rate
+    ps4_mixer_resend();
+
+    if(ps4_connection_cb != NULL)
+    {
+        ps4_connection_cb( is_active );
+    }
+
+    if(ps4_connection_object_cb != NULL && ps4_connection_object != NULL)
+    {
+        ps4_connection_object_cb( ps4_connection_object, is_active );
+    }
+
+    ps4_subscribers_connection( is_active );
+}
+
+
+/* Entry point for every received L2CAP payload. It only depends on the
+ * payload itself, so it can be driven directly with arbitrary input */
+void ps4_report_event( uint8_t channel, const uint8_t *report, uint16_t len )
+{
+    enum ps4_report_type type = ps4_parse_report_type( channel, report, len );
+
+    if(type == ps4_report_type_rejected){
+        PS4_METRIC_INC(reports_rejected);
+    }
+
+    if(type != ps4_report_type_short && type != ps4_report_type_full){
+        return;
+    }
+
+    PS4_METRIC_INC(reports_parsed);
+
+    // The callbacks run from here on
+    ps4_stack_enter();
+
+    // Raw reports are handed out as they arrive, before parsing,
+    // once the connection has been established
     if(is_active){
+        PS4_TRACE_BEGIN( ps4_trace_event_raw, 0 );
+        ps4_subscribers_raw( report, len );
+        PS4_TRACE_END( ps4_trace_event_raw, 0 );
+    }
+
+    PS4_TRACE_BEGIN( ps4_trace_event_parse, type );
+
+    if(type == ps4_report_type_short){
+        ps4_parse_packet_short( report );
+    }else{
+        ps4_interest_t wanted = ps4_subscribers_interest();
+
+        // The single event callbacks receive every field
+        if(ps4_event_cb != NULL || ps4_event_object_cb != NULL){
+            wanted.sensor = ps4_interest_sensor_all;
+            wanted.status = ps4_interest_status_all;
+        }
+
+        // The lightbar can follow the battery level
+        wanted.status |= ps4_lightbar_interest();
+
+        ps4_parse_packet_full( report, &wanted );
+    }
+
+    PS4_TRACE_END( ps4_trace_event_parse, type );
+
+    // The controller sends short reports until it takes the enable
+    // report, so only a full one ends the handshake
+    if(type == ps4_report_type_full && !is_active){
+        ps4_streaming_event();
+    }
+
+    ps4_stack_leave();
+}
+
+
+void ps4_packet_event( const ps4_t *ps4, const ps4_event_t *event, const ps4_interest_t *changed )
+{
+    ps4_connection_feed();
+
+    // Reports before the connection is reported only update the state,
+    // see ps4_report_event
+    if(is_active){
+        int64_t started = esp_timer_get_time();
+        uint32_t interval = ps4_parse_get_interval();
+
+        PS4_TRACE_BEGIN( ps4_trace_event_dispatch, 0 );
+
         if(ps4_event_cb != NULL)
         {
-            ps4_event_cb( ps4, event );
+            ps4_event_cb( *ps4, *event );
         }
 
         if(ps4_event_object_cb != NULL && ps4_event_object != NULL)
         {
-            ps4_event_object_cb( ps4_event_object, ps4, event );
+            ps4_event_object_cb( ps4_event_object, *ps4, *event );
         }
-    }else{
-        is_active = true;
 
-        if(ps4_connection_cb != NULL)
-        {
-            ps4_connection_cb( is_active );
-        }
+        ps4_subscribers_dispatch( ps4, event, changed );
+        ps4_lightbar_status( &ps4->status );
 
-        if(ps4_connection_object_cb != NULL && ps4_connection_object != NULL)
-        {
-            ps4_connection_object_cb( ps4_connection_object, is_active );
+        PS4_TRACE_END( ps4_trace_event_dispatch, 0 );
+
+        // The next report is already waiting
+        if(interval != 0 && esp_timer_get_time() - started > interval){
+            PS4_METRIC_INC(callback_overruns);
         }
     }
 }
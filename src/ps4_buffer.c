@@ -0,0 +1,297 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "include/ps4.h"
+#include "include/ps4_int.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+
+#define  PS4_TAG "PS4_BUFFER"
+
+
+/********************************************************************************/
+/*                            L O C A L    T Y P E S                            */
+/********************************************************************************/
+
+/* A received buffer kept past its dispatch, free when refs is 0 */
+typedef struct {
+    void *buffer;
+    const uint8_t *report;
+    uint8_t refs;
+} ps4_buffer_held_t;
+
+/* A copy of a report, made once all received buffers are held */
+typedef struct {
+    uint8_t report[PS4_HID_BUFFER_SIZE];
+    uint8_t refs;
+} ps4_buffer_copy_t;
+
+
+/********************************************************************************/
+/*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
+/********************************************************************************/
+
+static ps4_buffer_held_t* ps4_buffer_find_held( const uint8_t *report );
+static ps4_buffer_copy_t* ps4_buffer_find_copy( const uint8_t *report );
+static const uint8_t* ps4_buffer_hold();
+static const uint8_t* ps4_buffer_copy();
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+static ps4_buffer_held_t ps4_buffer_held[PS4_REPORT_RETAIN_MAX];
+static ps4_buffer_copy_t ps4_buffer_copies[PS4_REPORT_COPY_SLOTS];
+
+/* The buffer being dispatched, the only one that can be retained by reference */
+static void *ps4_buffer_current = NULL;
+static const uint8_t *ps4_buffer_current_report = NULL;
+static uint16_t ps4_buffer_current_len = 0;
+
+static ps4_buffer_stats_t ps4_buffer_stats;
+static portMUX_TYPE ps4_buffer_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ps4ReportRetain
+**
+** Description      Keeps a report handed to a raw report callback valid past
+**                  the callback, until ps4ReportRelease. Called from the
+**                  callback, the buffer the report was received in is kept
+**                  rather than freed, without copying it. Once as many
+**                  buffers as PS4_REPORT_RETAIN_MAX are held, the report is
+**                  copied instead. Retaining a report that is already
+**                  retained, from any task, adds a reference to it.
+**
+**
+** Returns          const uint8_t*, the report to use and release, which may
+**                  be a copy, or NULL when nothing was left to hold it in
+**
+*******************************************************************************/
+const uint8_t* ps4ReportRetain( const uint8_t *report )
+{
+    const uint8_t *retained = NULL;
+
+    portENTER_CRITICAL(&ps4_buffer_lock);
+
+    ps4_buffer_held_t *held = ps4_buffer_find_held( report );
+    ps4_buffer_copy_t *copy = ps4_buffer_find_copy( report );
+
+    if (held != NULL && held->refs < UINT8_MAX) {
+        held->refs++;
+        retained = report;
+    } else if (copy != NULL && copy->refs < UINT8_MAX) {
+        copy->refs++;
+        retained = report;
+    } else if (held == NULL && copy == NULL && report == ps4_buffer_current_report) {
+        retained = ps4_buffer_hold();
+
+        if (retained == NULL) {
+            retained = ps4_buffer_copy();
+        }
+
+        if (retained == NULL) {
+            ps4_buffer_stats.exhausted++;
+            PS4_METRIC_INC(buffer_exhaustions);
+        }
+    }
+
+    portEXIT_CRITICAL(&ps4_buffer_lock);
+
+    return retained;
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4ReportRelease
+**
+** Description      Drops a reference taken by ps4ReportRetain. The buffer
+**                  or copy is given back once the last one is dropped. It
+**                  can be called from any task.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4ReportRelease( const uint8_t *report )
+{
+    void *release = NULL;
+
+    portENTER_CRITICAL(&ps4_buffer_lock);
+
+    ps4_buffer_held_t *held = ps4_buffer_find_held( report );
+    ps4_buffer_copy_t *copy = ps4_buffer_find_copy( report );
+
+    if (held != NULL) {
+        // A buffer still being dispatched is freed at the end of dispatch
+        if (--held->refs == 0 && held->buffer != ps4_buffer_current) {
+            release = held->buffer;
+            held->buffer = NULL;
+            ps4_buffer_stats.held--;
+        }
+    } else if (copy != NULL) {
+        if (--copy->refs == 0) {
+            ps4_buffer_stats.copies--;
+        }
+    }
+
+    portEXIT_CRITICAL(&ps4_buffer_lock);
+
+    if (release != NULL) {
+        ps4_l2cap_free_buffer( release );
+    } else if (held == NULL && copy == NULL) {
+        ESP_LOGW(PS4_TAG, "[%s] the report was not retained", __func__);
+    }
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4GetBufferStats
+**
+** Description      Copies the counters of retained reports, how many were
+**                  kept by reference or copied, or could not be retained,
+**                  and the buffers and copies held.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4GetBufferStats( ps4_buffer_stats_t *stats )
+{
+    portENTER_CRITICAL(&ps4_buffer_lock);
+    *stats = ps4_buffer_stats;
+    portEXIT_CRITICAL(&ps4_buffer_lock);
+}
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+/* Marks the buffer a report is dispatched from, from the Bluetooth task */
+void ps4_buffer_begin( void *buffer, const uint8_t *report, uint16_t len )
+{
+    portENTER_CRITICAL(&ps4_buffer_lock);
+    ps4_buffer_current = buffer;
+    ps4_buffer_current_report = report;
+    ps4_buffer_current_len = len;
+    portEXIT_CRITICAL(&ps4_buffer_lock);
+}
+
+
+/* Ends the dispatch of the current buffer.
+ * Returns whether it is still held, the caller frees it otherwise */
+bool ps4_buffer_end()
+{
+    bool kept = false;
+
+    portENTER_CRITICAL(&ps4_buffer_lock);
+
+    ps4_buffer_held_t *held = ps4_buffer_find_held( ps4_buffer_current_report );
+
+    if (held != NULL) {
+        kept = held->refs > 0;
+
+        // Retained and released again during the dispatch
+        if (!kept) {
+            held->buffer = NULL;
+            ps4_buffer_stats.held--;
+        }
+    }
+
+    ps4_buffer_current = NULL;
+    ps4_buffer_current_report = NULL;
+    ps4_buffer_current_len = 0;
+
+    portEXIT_CRITICAL(&ps4_buffer_lock);
+
+    return kept;
+}
+
+
+/* The lookups must be called with the lock held */
+static ps4_buffer_held_t* ps4_buffer_find_held( const uint8_t *report )
+{
+    if (report == NULL) {
+        return NULL;
+    }
+
+    for (uint8_t i = 0; i < PS4_REPORT_RETAIN_MAX; i++) {
+        if (ps4_buffer_held[i].buffer != NULL && ps4_buffer_held[i].report == report) {
+            return &ps4_buffer_held[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+static ps4_buffer_copy_t* ps4_buffer_find_copy( const uint8_t *report )
+{
+    for (uint8_t i = 0; i < PS4_REPORT_COPY_SLOTS; i++) {
+        if (ps4_buffer_copies[i].refs > 0 && ps4_buffer_copies[i].report == report) {
+            return &ps4_buffer_copies[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+/* Keeps the current buffer, when fewer than the maximum are held */
+static const uint8_t* ps4_buffer_hold()
+{
+    for (uint8_t i = 0; i < PS4_REPORT_RETAIN_MAX; i++) {
+        ps4_buffer_held_t *held = &ps4_buffer_held[i];
+
+        if (held->buffer == NULL) {
+            held->buffer = ps4_buffer_current;
+            held->report = ps4_buffer_current_report;
+            held->refs = 1;
+
+            ps4_buffer_stats.retained++;
+            ps4_buffer_stats.held++;
+
+            if (ps4_buffer_stats.held > ps4_buffer_stats.held_max) {
+                ps4_buffer_stats.held_max = ps4_buffer_stats.held;
+            }
+
+            return held->report;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* Copies the current report into a free slot */
+static const uint8_t* ps4_buffer_copy()
+{
+    if (ps4_buffer_current_len > PS4_HID_BUFFER_SIZE) {
+        return NULL;
+    }
+
+    for (uint8_t i = 0; i < PS4_REPORT_COPY_SLOTS; i++) {
+        ps4_buffer_copy_t *copy = &ps4_buffer_copies[i];
+
+        if (copy->refs == 0) {
+            memcpy( copy->report, ps4_buffer_current_report, ps4_buffer_current_len );
+            copy->refs = 1;
+
+            ps4_buffer_stats.copied++;
+            ps4_buffer_stats.copies++;
+
+            return copy->report;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,436 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "include/ps4.h"
+#include "include/ps4_int.h"
+#include "include/ps4_trace.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#define  PS4_TAG "PS4_CONNECTION"
+
+
+/********************************************************************************/
+/*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
+/********************************************************************************/
+
+static void ps4_connection_arm( uint8_t state );
+static void ps4_connection_timeout( void *arg );
+static void ps4_connection_check( void *arg );
+static void ps4_connection_lost( uint8_t reason );
+static void ps4_connection_watch( bool enabled );
+
+
+/********************************************************************************/
+/*                              C O N S T A N T S                               */
+/********************************************************************************/
+
+static const char *ps4_connection_state_names[ps4_connection_state_count] = {
+    [ps4_connection_state_idle]       = "idle",
+    [ps4_connection_state_control]    = "control",
+    [ps4_connection_state_interrupt]  = "interrupt",
+    [ps4_connection_state_configured] = "configured",
+    [ps4_connection_state_enabling]   = "enabling",
+    [ps4_connection_state_streaming]  = "streaming",
+    [ps4_connection_state_teardown]   = "teardown"
+};
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+static uint8_t ps4_connection_state = ps4_connection_state_idle;
+static int64_t ps4_connection_started = 0;
+static ps4_connection_stats_t ps4_connection_stats;
+static portMUX_TYPE ps4_connection_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static esp_timer_handle_t ps4_connection_timer = NULL;
+
+/* Silence watchdog, only running while streaming. The time of the last
+ * input report is kept in 32 bits so that it is written atomically, the
+ * difference still holds when it wraps around. A link it declared lost
+ * is handed over to the Bluetooth task to close, see ps4_connection_poll */
+static volatile uint32_t ps4_connection_last_report = 0;
+static bool ps4_connection_linked = false;
+static volatile bool ps4_connection_silent = false;
+static uint16_t ps4_connection_link_timeout_ms = PS4_LINK_TIMEOUT_MS;
+static esp_timer_handle_t ps4_connection_watchdog = NULL;
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ps4SetLinkTimeout
+**
+** Description      Declares the link lost when no input report arrived for
+**                  timeout_ms, rather than waiting for the Bluetooth stack
+**                  to notice. The silence is checked four times per
+**                  timeout while the controller streams, so a loss is
+**                  detected within 1.25 timeouts of the last report. The
+**                  controller is then disconnected from the Bluetooth task.
+**                  0 disables the watchdog.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4SetLinkTimeout( uint16_t timeout_ms )
+{
+    bool linked;
+
+    portENTER_CRITICAL(&ps4_connection_lock);
+    ps4_connection_link_timeout_ms = timeout_ms;
+    linked = ps4_connection_linked;
+    portEXIT_CRITICAL(&ps4_connection_lock);
+
+    ps4_connection_watch( linked );
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4GetConnectionState
+**
+** Description      Gets the step the connection of the controller is at.
+**
+**
+** Returns          uint8_t, the ps4_connection_state
+**
+*******************************************************************************/
+uint8_t ps4GetConnectionState()
+{
+    return ps4_connection_state;
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4GetConnectionStats
+**
+** Description      Copies the time each step of the current or last
+**                  connection was reached at, the time to the first input
+**                  report, and the counters of connections, retries of the
+**                  enable report and steps that timed out.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4GetConnectionStats( ps4_connection_stats_t *stats )
+{
+    portENTER_CRITICAL(&ps4_connection_lock);
+    *stats = ps4_connection_stats;
+    portEXIT_CRITICAL(&ps4_connection_lock);
+}
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+/* Creates the timeout and watchdog timers up front, from ps4Init, so that connecting or streaming
+ * never allocates */
+void ps4_connection_init()
+{
+    if (ps4_connection_timer == NULL) {
+        esp_timer_create_args_t args = {
+            .callback = &ps4_connection_timeout,
+            .name = "ps4_connection"
+        };
+
+        esp_err_t ret = esp_timer_create(&args, &ps4_connection_timer);
+        ps4_alloc_count( ps4_alloc_kind_library, ret == ESP_OK, 0 );
+
+        if (ret != ESP_OK) {
+            ESP_LOGE(PS4_TAG, "[%s] creating the timeout timer failed", __func__);
+        }
+    }
+
+    if (ps4_connection_watchdog == NULL) {
+        esp_timer_create_args_t args = {
+            .callback = &ps4_connection_check,
+            .name = "ps4_watchdog"
+        };
+
+        esp_err_t ret = esp_timer_create(&args, &ps4_connection_watchdog);
+        ps4_alloc_count( ps4_alloc_kind_library, ret == ESP_OK, 0 );
+
+        if (ret != ESP_OK) {
+            ESP_LOGE(PS4_TAG, "[%s] creating the watchdog timer failed", __func__);
+        }
+    }
+}
+
+
+/* Moves the connection to a state, timing it from the moment the first
+ * channel connected. Once configured, the enable report is sent and the
+ * connection waits for the first full input report */
+void ps4_connection_set_state( uint8_t state )
+{
+    int64_t now = esp_timer_get_time();
+    uint8_t previous;
+    uint32_t elapsed;
+
+    portENTER_CRITICAL(&ps4_connection_lock);
+
+    previous = ps4_connection_state;
+
+    if (state == previous) {
+        portEXIT_CRITICAL(&ps4_connection_lock);
+        return;
+    }
+
+    bool starting = previous == ps4_connection_state_idle || previous == ps4_connection_state_teardown;
+
+    starting &= state == ps4_connection_state_control || state == ps4_connection_state_interrupt;
+
+    if (starting) {
+        ps4_connection_silent = false;
+        ps4_connection_started = now;
+        ps4_connection_stats.connects++;
+        PS4_METRIC_INC(connects);
+
+        if (ps4_connection_stats.streams > 0) {
+            PS4_METRIC_INC(reconnects);
+        }
+        ps4_connection_stats.enable_retries = 0;
+        memset( ps4_connection_stats.state_us, 0, sizeof(ps4_connection_stats.state_us) );
+    }
+
+    elapsed = now - ps4_connection_started;
+
+    ps4_connection_state = state;
+    ps4_connection_stats.state = state;
+    ps4_connection_stats.state_us[state] = elapsed;
+
+    if (state == ps4_connection_state_streaming) {
+        ps4_connection_linked = true;
+        ps4_connection_stats.streams++;
+
+        if (ps4_connection_stats.boot_to_first_report_us == 0) {
+            ps4_connection_stats.boot_to_first_report_us = now;
+        }
+
+        ps4_connection_stats.first_report_us = elapsed;
+
+        if (elapsed > ps4_connection_stats.first_report_max_us) {
+            ps4_connection_stats.first_report_max_us = elapsed;
+        }
+    }
+
+    portEXIT_CRITICAL(&ps4_connection_lock);
+
+    if (starting) {
+        ps4_alloc_reset();
+    }
+
+    PS4_TRACE_INSTANT( ps4_trace_event_state, state );
+
+    ESP_LOGI(PS4_TAG, "[%s] %s -> %s after %u us", __func__,
+             ps4_connection_state_names[previous], ps4_connection_state_names[state], (unsigned)elapsed );
+
+    ps4_connection_arm( state );
+    ps4_connection_watch( state == ps4_connection_state_streaming );
+
+    if (state == ps4_connection_state_teardown || state == ps4_connection_state_idle) {
+        ps4_connection_lost( ps4_link_loss_disconnected );
+        ps4_connect_event( 0 );
+    }
+
+    if (state == ps4_connection_state_idle) {
+        ps4_connection_silent = false;
+        ps4_storage_disconnected();
+    }
+
+    if (state == ps4_connection_state_configured) {
+        ps4Enable();
+        ps4_connection_set_state( ps4_connection_state_enabling );
+    }
+}
+
+
+void ps4_connection_set_known( bool known )
+{
+    portENTER_CRITICAL(&ps4_connection_lock);
+    ps4_connection_stats.known = known;
+    portEXIT_CRITICAL(&ps4_connection_lock);
+}
+
+
+/* Notes the arrival of an input report for the watchdog */
+void ps4_connection_feed()
+{
+    ps4_connection_last_report = esp_timer_get_time();
+}
+
+
+/* Closes a link the watchdog declared lost, from the Bluetooth task, called
+ * by ps4_l2cap_call or as anything is received on it if that ran first.
+ * Returns whether it was, in which case what was received is dropped */
+bool ps4_connection_poll()
+{
+    if (!ps4_connection_silent) {
+        return false;
+    }
+
+    if (ps4_connection_state != ps4_connection_state_teardown &&
+        ps4_connection_state != ps4_connection_state_idle) {
+        ESP_LOGW(PS4_TAG, "[%s] link lost, disconnecting the controller", __func__);
+
+        ps4_connection_set_state( ps4_connection_state_teardown );
+        ps4_l2cap_disconnect();
+    }
+
+    return true;
+}
+
+
+/* Whether the watchdog declared the link lost, which ps4IsConnected
+ * reports before the Bluetooth task closed it */
+bool ps4_connection_is_silent()
+{
+    return ps4_connection_silent;
+}
+
+
+/* Bounds the time spent in the steps that wait for the controller */
+static void ps4_connection_arm( uint8_t state )
+{
+    uint32_t timeout_ms;
+
+    ps4_connection_init();
+
+    if (ps4_connection_timer == NULL) {
+        return;
+    }
+
+    esp_timer_stop( ps4_connection_timer );
+
+    switch (state) {
+    case ps4_connection_state_control:
+    case ps4_connection_state_interrupt:
+    case ps4_connection_state_configured:
+        timeout_ms = PS4_CONNECTION_SETUP_TIMEOUT_MS;
+        break;
+
+    case ps4_connection_state_enabling:
+        timeout_ms = PS4_CONNECTION_ENABLE_TIMEOUT_MS;
+        break;
+
+    default:
+        return;
+    }
+
+    esp_timer_start_once( ps4_connection_timer, (uint64_t)timeout_ms * 1000 );
+}
+
+
+static void ps4_connection_timeout( void *arg )
+{
+    bool retry = false;
+    uint8_t state;
+    uint8_t retries;
+
+    portENTER_CRITICAL(&ps4_connection_lock);
+
+    state = ps4_connection_state;
+
+    if (state == ps4_connection_state_enabling &&
+        ps4_connection_stats.enable_retries < PS4_CONNECTION_ENABLE_RETRIES) {
+        ps4_connection_stats.enable_retries++;
+        retry = true;
+    } else {
+        ps4_connection_stats.timeouts++;
+    }
+
+    retries = ps4_connection_stats.enable_retries;
+
+    portEXIT_CRITICAL(&ps4_connection_lock);
+
+    if (retry) {
+        ESP_LOGW(PS4_TAG, "[%s] no input report yet, sending the enable report again (%d)", __func__, retries);
+
+        ps4Enable();
+        ps4_connection_arm( state );
+    } else if (state == ps4_connection_state_enabling) {
+        ESP_LOGE(PS4_TAG, "[%s] no input report after %d retries of the enable report", __func__, retries);
+    } else {
+        ESP_LOGW(PS4_TAG, "[%s] connection stuck in %s", __func__, ps4_connection_state_names[state]);
+    }
+}
+
+
+static void ps4_connection_check( void *arg )
+{
+    uint32_t silence = (uint32_t)esp_timer_get_time() - ps4_connection_last_report;
+    bool lost;
+
+    portENTER_CRITICAL(&ps4_connection_lock);
+    lost = ps4_connection_linked && ps4_connection_link_timeout_ms > 0 &&
+           silence > (uint32_t)ps4_connection_link_timeout_ms * 1000;
+    portEXIT_CRITICAL(&ps4_connection_lock);
+
+    if (lost) {
+        ESP_LOGW(PS4_TAG, "[%s] no input report for %u us, link lost", __func__, (unsigned)silence);
+
+        esp_timer_stop( ps4_connection_watchdog );
+
+        // The rest of the library state belongs to the Bluetooth task
+        ps4_connection_silent = true;
+        ps4_connection_lost( ps4_link_loss_silence );
+        ps4_l2cap_call( ps4_l2cap_call_link, 0 );
+    }
+}
+
+
+/* Runs the watchdog while streaming with a link timeout set */
+static void ps4_connection_watch( bool enabled )
+{
+    uint16_t timeout_ms;
+
+    if (ps4_connection_watchdog == NULL) {
+        return;
+    }
+
+    portENTER_CRITICAL(&ps4_connection_lock);
+    timeout_ms = ps4_connection_link_timeout_ms;
+    portEXIT_CRITICAL(&ps4_connection_lock);
+
+    esp_timer_stop( ps4_connection_watchdog );
+
+    if (enabled && timeout_ms > 0) {
+        esp_timer_start_periodic( ps4_connection_watchdog, (uint64_t)timeout_ms * 1000 / 4 );
+    }
+}
+
+
+/* Declares the link lost once per connection, timing how long after the
+ * last input report it was noticed */
+static void ps4_connection_lost( uint8_t reason )
+{
+    uint32_t silence = (uint32_t)esp_timer_get_time() - ps4_connection_last_report;
+
+    portENTER_CRITICAL(&ps4_connection_lock);
+
+    if (!ps4_connection_linked) {
+        portEXIT_CRITICAL(&ps4_connection_lock);
+        return;
+    }
+
+    ps4_connection_linked = false;
+    ps4_connection_stats.link_losses++;
+    ps4_connection_stats.loss_detect_us = silence;
+
+    if (silence > ps4_connection_stats.loss_detect_max_us) {
+        ps4_connection_stats.loss_detect_max_us = silence;
+    }
+
+    portEXIT_CRITICAL(&ps4_connection_lock);
+
+    ps4_link_lost( reason );
+}
@@ -0,0 +1,135 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include "include/ps4.h"
+#include "include/ps4_int.h"
+#include "esp_log.h"
+#include "esp_bt.h"
+#include "esp_bt_main.h"
+#include "esp_gap_bt_api.h"
+#include "esp_bt_device.h"
+
+#define PS4_TAG "PS4_GAP"
+#define PS4_DEVICE_NAME "PS4 Host"
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ps4_gap_init
+**
+** Description      Makes the device connectable by configuring GAP directly,
+**                  without the SPP server and RFCOMM. Used instead of
+**                  ps4_spp_init when PS4_GAP_ONLY is defined.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4_gap_init()
+{
+    esp_err_t ret;
+
+#ifndef ARDUINO_ARCH_ESP32
+    esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
+    esp_bt_mode_t mode = BT_MODE;
+
+#ifdef PS4_RELEASE_BLE_MEMORY
+    /* Only possible before the controller is initialized */
+    if ((ret = esp_bt_controller_mem_release(ESP_BT_MODE_BLE)) != ESP_OK) {
+        ESP_LOGE(PS4_TAG, "%s release BLE memory failed: %s\n", __func__, esp_err_to_name(ret));
+    } else {
+        mode = ESP_BT_MODE_CLASSIC_BT;
+        bt_cfg.mode = mode;
+    }
+#endif
+
+    if ((ret = esp_bt_controller_init(&bt_cfg)) != ESP_OK) {
+        ESP_LOGE(PS4_TAG, "%s initialize controller failed: %s\n", __func__, esp_err_to_name(ret));
+        return;
+    }
+
+    if ((ret = esp_bt_controller_enable(mode)) != ESP_OK) {
+        ESP_LOGE(PS4_TAG, "%s enable controller failed: %s\n", __func__, esp_err_to_name(ret));
+        return;
+    }
+
+    if ((ret = esp_bluedroid_init()) != ESP_OK) {
+        ESP_LOGE(PS4_TAG, "%s initialize bluedroid failed: %s\n", __func__, esp_err_to_name(ret));
+        return;
+    }
+
+    if ((ret = esp_bluedroid_enable()) != ESP_OK) {
+        ESP_LOGE(PS4_TAG, "%s enable bluedroid failed: %s\n", __func__, esp_err_to_name(ret));
+        return;
+    }
+#endif
+
+    if ((ret = esp_bt_dev_set_device_name(PS4_DEVICE_NAME)) != ESP_OK) {
+        ESP_LOGE(PS4_TAG, "%s set device name failed: %s\n", __func__, esp_err_to_name(ret));
+        return;
+    }
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 0, 0)
+    ret = esp_bt_gap_set_scan_mode(ESP_BT_CONNECTABLE, ESP_BT_NON_DISCOVERABLE);
+#else
+    ret = esp_bt_gap_set_scan_mode(ESP_BT_SCAN_MODE_CONNECTABLE);
+#endif
+
+    if (ret != ESP_OK) {
+        ESP_LOGE(PS4_TAG, "%s set scan mode failed: %s\n", __func__, esp_err_to_name(ret));
+        return;
+    }
+
+    ps4_init_done();
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4_gap_deinit
+**
+** Description      Stops being connectable, and shuts Bluetooth down when
+**                  it was brought up by ps4_gap_init
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4_gap_deinit()
+{
+    esp_err_t ret;
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 0, 0)
+    ret = esp_bt_gap_set_scan_mode(ESP_BT_NON_CONNECTABLE, ESP_BT_NON_DISCOVERABLE);
+#else
+    ret = esp_bt_gap_set_scan_mode(ESP_BT_SCAN_MODE_NONE);
+#endif
+
+    if (ret != ESP_OK) {
+        ESP_LOGE(PS4_TAG, "%s set scan mode failed: %s\n", __func__, esp_err_to_name(ret));
+    }
+
+#ifndef ARDUINO_ARCH_ESP32
+    if ((ret = esp_bluedroid_disable()) != ESP_OK) {
+        ESP_LOGE(PS4_TAG, "%s disable bluedroid failed: %s\n", __func__, esp_err_to_name(ret));
+        return;
+    }
+
+    if ((ret = esp_bluedroid_deinit()) != ESP_OK) {
+        ESP_LOGE(PS4_TAG, "%s deinitialize bluedroid failed: %s\n", __func__, esp_err_to_name(ret));
+        return;
+    }
+
+    if ((ret = esp_bt_controller_disable()) != ESP_OK) {
+        ESP_LOGE(PS4_TAG, "%s disable controller failed: %s\n", __func__, esp_err_to_name(ret));
+        return;
+    }
+
+    if ((ret = esp_bt_controller_deinit()) != ESP_OK) {
+        ESP_LOGE(PS4_TAG, "%s deinitialize controller failed: %s\n", __func__, esp_err_to_name(ret));
+        return;
+    }
+#endif
+}
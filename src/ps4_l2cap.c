@@ -4,22 +4,23 @@
 #include <string.h>
 #include "include/ps4.h"
 #include "include/ps4_int.h"
+#include "include/ps4_report.h"
+#include "include/ps4_trace.h"
 #include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "esp_bt.h"
 #include "esp_bt_main.h"
 #include "esp_gap_bt_api.h"
 #include "stack/gap_api.h"
 #include "stack/bt_types.h"
 #include "stack/l2c_api.h"
+#include "bta/bta_sys.h"
 #include "osi/allocator.h"
 
 #define  PS4_TAG "PS4_L2CAP"
 
 
-#define PS4_L2CAP_ID_HIDC 0x40
-#define PS4_L2CAP_ID_HIDI 0x41
-
-
 /********************************************************************************/
 /*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
 /********************************************************************************/
@@ -34,6 +35,8 @@ static void ps4_l2cap_disconnect_ind_cback (uint16_t l2cap_cid, bool ack_needed)
 static void ps4_l2cap_disconnect_cfm_cback (uint16_t l2cap_cid, uint16_t result);
 static void ps4_l2cap_data_ind_cback (uint16_t l2cap_cid, BT_HDR *p_msg);
 static void ps4_l2cap_congest_cback (uint16_t cid, bool congested);
+static void ps4_l2cap_closed (uint16_t l2cap_cid);
+static void ps4_l2cap_called (void *p_tle);
 
 
 /********************************************************************************/
@@ -56,7 +59,15 @@ static const tL2CAP_APPL_INFO dyn_info = {
 
 static tL2CAP_CFG_INFO ps4_cfg_info;
 
-bool is_connected = false;
+/* The channel ids the stack allocated for the controller, 0 when closed */
+static uint16_t ps4_l2cap_hidc_cid = 0;
+static uint16_t ps4_l2cap_hidi_cid = 0;
+
+/* The task the stack runs the callbacks on, the only one sending */
+static TaskHandle_t ps4_l2cap_task = NULL;
+
+/* Timers of the work run on that task, see ps4_l2cap_call */
+static TIMER_LIST_ENT ps4_l2cap_calls[ps4_l2cap_call_count];
 
 
 /********************************************************************************/
@@ -76,6 +87,16 @@ void ps4_l2cap_init_services()
 {
     ps4_l2cap_init_service( "PS4-HIDC", BT_PSM_HIDC, BTM_SEC_SERVICE_FIRST_EMPTY   );
     ps4_l2cap_init_service( "PS4-HIDI", BT_PSM_HIDI, BTM_SEC_SERVICE_FIRST_EMPTY+1 );
+
+    /* The stack allocates the alarm of a timer the first time it is
+     * started, so that is done here rather than while streaming */
+    for (uint8_t call = 0; call < ps4_l2cap_call_count; call++) {
+        ps4_l2cap_calls[call].p_cback = ps4_l2cap_called;
+        ps4_l2cap_calls[call].param = call;
+
+        bta_sys_start_timer( &ps4_l2cap_calls[call], 0, 1000 );
+        bta_sys_stop_timer( &ps4_l2cap_calls[call] );
+    }
 }
 
 /*******************************************************************************
@@ -108,27 +129,194 @@ void ps4_l2cap_send_hid( hid_cmd_t *hid_cmd, uint8_t len )
     uint8_t result;
     BT_HDR     *p_buf;
 
-    p_buf = (BT_HDR *)osi_malloc(BT_DEFAULT_BUFFER_SIZE);
+    uint16_t size = len + ( sizeof(*hid_cmd) - sizeof(hid_cmd->data) );
+
+    p_buf = (BT_HDR *)osi_malloc(sizeof(BT_HDR) + L2CAP_MIN_OFFSET + size);
+    ps4_alloc_count( ps4_alloc_kind_send, p_buf != NULL, sizeof(BT_HDR) + L2CAP_MIN_OFFSET + size );
 
     if( !p_buf ){
+        PS4_METRIC_INC(buffer_exhaustions);
         ESP_LOGE(PS4_TAG, "[%s] allocating buffer for sending the command failed", __func__);
+        return;
     }
 
-    p_buf->len = len + ( sizeof(*hid_cmd) - sizeof(hid_cmd->data) );
+    p_buf->len = size;
     p_buf->offset = L2CAP_MIN_OFFSET;
 
     memcpy ((uint8_t *)(p_buf + 1) + p_buf->offset, (uint8_t*)hid_cmd, p_buf->len);
 
-    result = L2CA_DataWrite( PS4_L2CAP_ID_HIDC, p_buf );
+    PS4_TRACE_BEGIN( ps4_trace_event_send, size );
+
+    result = L2CA_DataWrite( ps4_l2cap_hidc_cid, p_buf );
+
+    PS4_TRACE_END( ps4_trace_event_send, result == L2CAP_DW_SUCCESS ? ps4_send_result_ok
+                                       : result == L2CAP_DW_CONGESTED ? ps4_send_result_congested
+                                       : ps4_send_result_failed );
 
     if (result == L2CAP_DW_SUCCESS)
-        ESP_LOGI(PS4_TAG, "[%s] sending command: success", __func__);
+        PS4_METRIC_INC(sends);
 
-    if (result == L2CAP_DW_CONGESTED)
+    if (result == L2CAP_DW_CONGESTED) {
+        PS4_METRIC_INC(send_congestions);
         ESP_LOGW(PS4_TAG, "[%s] sending command: congested", __func__);
+    }
 
-    if (result == L2CAP_DW_FAILED)
+    if (result == L2CAP_DW_FAILED) {
+        PS4_METRIC_INC(send_failures);
         ESP_LOGE(PS4_TAG, "[%s] sending command: failed", __func__);
+    }
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4_l2cap_send_report
+**
+** Description      This function sends an encoded output report on the
+**                  control channel. The report is copied once, into a
+**                  buffer sized for it, which the stack takes ownership of.
+**
+** Returns          uint8_t, the ps4_send_result
+**
+*******************************************************************************/
+uint8_t ps4_l2cap_send_report( const uint8_t *report, uint16_t len )
+{
+    uint8_t result;
+    BT_HDR     *p_buf;
+
+    p_buf = (BT_HDR *)osi_malloc(sizeof(BT_HDR) + L2CAP_MIN_OFFSET + len);
+    ps4_alloc_count( ps4_alloc_kind_send, p_buf != NULL, sizeof(BT_HDR) + L2CAP_MIN_OFFSET + len );
+
+    if( !p_buf ){
+        PS4_METRIC_INC(buffer_exhaustions);
+        ESP_LOGE(PS4_TAG, "[%s] allocating buffer for sending the report failed", __func__);
+        return ps4_send_result_failed;
+    }
+
+    p_buf->len = len;
+    p_buf->offset = L2CAP_MIN_OFFSET;
+
+    memcpy ((uint8_t *)(p_buf + 1) + p_buf->offset, report, len);
+
+    PS4_TRACE_BEGIN( ps4_trace_event_send, len );
+
+    result = L2CA_DataWrite( ps4_l2cap_hidc_cid, p_buf );
+
+    if (result == L2CAP_DW_CONGESTED) {
+        PS4_TRACE_END( ps4_trace_event_send, ps4_send_result_congested );
+        PS4_METRIC_INC(send_congestions);
+        ESP_LOGW(PS4_TAG, "[%s] sending report: congested", __func__);
+        return ps4_send_result_congested;
+    }
+
+    if (result == L2CAP_DW_FAILED) {
+        PS4_TRACE_END( ps4_trace_event_send, ps4_send_result_failed );
+        PS4_METRIC_INC(send_failures);
+        ESP_LOGE(PS4_TAG, "[%s] sending report: failed", __func__);
+        return ps4_send_result_failed;
+    }
+
+    PS4_TRACE_END( ps4_trace_event_send, ps4_send_result_ok );
+    PS4_METRIC_INC(sends);
+    return ps4_send_result_ok;
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4_l2cap_free_buffer
+**
+** Description      This function frees a received buffer that was kept for
+**                  raw report consumers, once the last one released it.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4_l2cap_free_buffer( void *buffer )
+{
+    osi_free( buffer );
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4_l2cap_in_task
+**
+** Description      This function tells whether it is called from the task
+**                  the stack runs the L2CAP callbacks on. The stack is not
+**                  safe to write to from any other.
+**
+** Returns          bool
+**
+*******************************************************************************/
+bool ps4_l2cap_in_task()
+{
+    return ps4_l2cap_task != NULL && xTaskGetCurrentTaskHandle() == ps4_l2cap_task;
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4_l2cap_disconnect
+**
+** Description      This function disconnects both channels of the controller,
+**                  the interrupt one first. It must be called from the task
+**                  the stack runs the L2CAP callbacks on.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4_l2cap_disconnect()
+{
+    if(ps4_l2cap_hidi_cid != 0){
+        L2CA_DisconnectReq( ps4_l2cap_hidi_cid );
+    }
+
+    if(ps4_l2cap_hidc_cid != 0){
+        L2CA_DisconnectReq( ps4_l2cap_hidc_cid );
+    }
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4_l2cap_call
+**
+** Description      This function runs work on the task the stack runs the
+**                  L2CAP callbacks on, after delay_ms. The timers of the
+**                  BTA system fire there, and can be started from any task.
+**                  Calling it again before the work ran moves the deadline.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4_l2cap_call( uint8_t call, uint32_t delay_ms )
+{
+    if (ps4_l2cap_calls[call].p_cback == NULL) {
+        return;
+    }
+
+    bta_sys_start_timer( &ps4_l2cap_calls[call], 0, delay_ms );
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4_l2cap_call_cancel
+**
+** Description      This function cancels work ps4_l2cap_call was asked
+**                  for, if it did not run yet.
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4_l2cap_call_cancel( uint8_t call )
+{
+    if (ps4_l2cap_calls[call].p_cback == NULL) {
+        return;
+    }
+
+    bta_sys_stop_timer( &ps4_l2cap_calls[call] );
 }
 
 
@@ -191,6 +379,8 @@ static void ps4_l2cap_deinit_service( char *name, uint16_t psm )
 *******************************************************************************/
 static void ps4_l2cap_connect_ind_cback (BD_ADDR  bd_addr, uint16_t l2cap_cid, uint16_t psm, uint8_t l2cap_id)
 {
+    ps4_l2cap_task = xTaskGetCurrentTaskHandle();
+
     ESP_LOGI(PS4_TAG, "[%s] bd_addr: %s\n  l2cap_cid: 0x%02x\n  psm: %d\n  id: %d", __func__, bd_addr, l2cap_cid, psm, l2cap_id );
 
     /* Send connection pending response to the L2CAP layer. */
@@ -201,6 +391,15 @@ static void ps4_l2cap_connect_ind_cback (BD_ADDR  bd_addr, uint16_t l2cap_cid, u
 
     /* Send a Configuration Request. */
     L2CA_CONFIG_REQ (l2cap_cid, &ps4_cfg_info);
+
+    if(psm == BT_PSM_HIDC){
+        ps4_l2cap_hidc_cid = l2cap_cid;
+        ps4_connection_set_state( ps4_connection_state_control );
+        ps4_connection_set_known( ps4_storage_connected( bd_addr ) );
+    }else{
+        ps4_l2cap_hidi_cid = l2cap_cid;
+        ps4_connection_set_state( ps4_connection_state_interrupt );
+    }
 }
 
 
@@ -236,10 +435,8 @@ void ps4_l2cap_config_cfm_cback(uint16_t l2cap_cid, tL2CAP_CFG_INFO *p_cfg)
 
     /* The PS4 controller is connected after    */
     /* receiving the second config confirmation */
-    is_connected = l2cap_cid == PS4_L2CAP_ID_HIDI;
-
-    if(is_connected){
-        ps4Enable();
+    if(l2cap_cid == ps4_l2cap_hidi_cid){
+        ps4_connection_set_state( ps4_connection_state_configured );
     }
 }
 
@@ -277,6 +474,8 @@ void ps4_l2cap_config_ind_cback(uint16_t l2cap_cid, tL2CAP_CFG_INFO *p_cfg)
 void ps4_l2cap_disconnect_ind_cback(uint16_t l2cap_cid, bool ack_needed)
 {
     ESP_LOGI(PS4_TAG, "[%s] l2cap_cid: 0x%02x\n  ack_needed: %d", __func__, l2cap_cid, ack_needed );
+
+    ps4_l2cap_closed( l2cap_cid );
 }
 
 
@@ -293,6 +492,9 @@ void ps4_l2cap_disconnect_ind_cback(uint16_t l2cap_cid, bool ack_needed)
 static void ps4_l2cap_disconnect_cfm_cback(uint16_t l2cap_cid, uint16_t result)
 {
     ESP_LOGI(PS4_TAG, "[%s] l2cap_cid: 0x%02x\n  result: %d", __func__, l2cap_cid, result );
+
+    /* Confirms a ps4_l2cap_disconnect */
+    ps4_l2cap_closed( l2cap_cid );
 }
 
 
@@ -308,12 +510,45 @@ static void ps4_l2cap_disconnect_cfm_cback(uint16_t l2cap_cid, uint16_t result)
 *******************************************************************************/
 static void ps4_l2cap_data_ind_cback(uint16_t l2cap_cid, BT_HDR *p_buf)
 {
-    if ( p_buf->len > 2 )
-    {
-        ps4_parse_packet( p_buf->data );
+    uint8_t channel;
+
+    if(l2cap_cid == ps4_l2cap_hidi_cid){
+        channel = ps4_report_channel_interrupt;
+    }else if(l2cap_cid == ps4_l2cap_hidc_cid){
+        channel = ps4_report_channel_control;
+    }else{
+        ESP_LOGW(PS4_TAG, "[%s] data on unknown l2cap_cid: 0x%02x", __func__, l2cap_cid);
+        osi_free( p_buf );
+        return;
+    }
+
+    PS4_TRACE_INSTANT( ps4_trace_event_report, p_buf->len );
+
+    /* Nothing is taken from a link the watchdog declared lost */
+    if (ps4_connection_poll()) {
+        osi_free( p_buf );
+        return;
+    }
+
+    /* An enable report asked for from another task goes out first */
+    ps4_enable_poll();
+
+    /* The report is validated against its length and channel before parsing */
+    ps4_buffer_begin( p_buf, p_buf->data + p_buf->offset, p_buf->len );
+    ps4_report_event( channel, p_buf->data + p_buf->offset, p_buf->len );
+
+    /* Raw report consumers may have retained the buffer */
+    if (!ps4_buffer_end()) {
+        osi_free( p_buf );
     }
 
-    osi_free( p_buf );
+    /* Posted commands, output held back for alignment and output changed
+     * from other tasks go out in the gap after the report */
+    if (channel == ps4_report_channel_interrupt) {
+        PS4_TRACE_BEGIN( ps4_trace_event_output, 0 );
+        ps4_mailbox_drain();
+        PS4_TRACE_END( ps4_trace_event_output, 0 );
+    }
 }
 
 
@@ -328,5 +563,58 @@ static void ps4_l2cap_data_ind_cback(uint16_t l2cap_cid, BT_HDR *p_buf)
 *******************************************************************************/
 static void ps4_l2cap_congest_cback (uint16_t l2cap_cid, bool congested)
 {
+    PS4_TRACE_INSTANT( ps4_trace_event_congested, congested );
+
     ESP_LOGI(PS4_TAG, "[%s] l2cap_cid: 0x%02x\n  congested: %d", __func__, l2cap_cid, congested );
 }
+
+
+/*******************************************************************************
+**
+** Function         ps4_l2cap_closed
+**
+** Description      This moves the connection on as a channel of the
+**                  controller closes, whichever side disconnected it.
+**
+** Returns          void
+**
+*******************************************************************************/
+static void ps4_l2cap_closed (uint16_t l2cap_cid)
+{
+    /* The control channel is the last one to go */
+    if(l2cap_cid == ps4_l2cap_hidc_cid){
+        ps4_l2cap_hidc_cid = 0;
+        ps4_connection_set_state( ps4_connection_state_idle );
+    }else if(l2cap_cid == ps4_l2cap_hidi_cid){
+        ps4_l2cap_hidi_cid = 0;
+        ps4_connection_set_state( ps4_connection_state_teardown );
+    }
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4_l2cap_called
+**
+** Description      This runs the work of a timer started by ps4_l2cap_call,
+**                  on the task the stack runs the L2CAP callbacks on.
+**
+** Returns          void
+**
+*******************************************************************************/
+static void ps4_l2cap_called (void *p_tle)
+{
+    switch (((TIMER_LIST_ENT *)p_tle)->param) {
+    case ps4_l2cap_call_output:
+        ps4_mixer_handoff();
+        break;
+
+    case ps4_l2cap_call_enable:
+        ps4_enable_poll();
+        break;
+
+    case ps4_l2cap_call_link:
+        ps4_connection_poll();
+        break;
+    }
+}
@@ -0,0 +1,540 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "include/ps4.h"
+#include "include/ps4_int.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#define  PS4_TAG "PS4_LIGHTBAR"
+
+
+/********************************************************************************/
+/*                            L O C A L    T Y P E S                            */
+/********************************************************************************/
+
+enum ps4_lightbar_mode {
+    ps4_lightbar_mode_idle,
+    ps4_lightbar_mode_animation,
+    ps4_lightbar_mode_battery
+};
+
+typedef struct {
+    uint8_t mode;
+    uint8_t generation;
+    ps4_lightbar_keyframe_t keyframes[PS4_LIGHTBAR_MAX_KEYFRAMES];
+    uint8_t count;
+    bool loop;
+    int64_t start;
+    uint8_t from[3];
+} ps4_lightbar_state_t;
+
+
+/********************************************************************************/
+/*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
+/********************************************************************************/
+
+static void ps4_lightbar_start( uint8_t mode, const ps4_lightbar_keyframe_t *keyframes, uint8_t count, bool loop );
+static void ps4_lightbar_tick( void *arg );
+static bool ps4_lightbar_animation( const ps4_lightbar_state_t *state, int64_t now, uint8_t *color );
+static void ps4_lightbar_battery( int64_t now, uint8_t *color );
+static uint8_t ps4_lightbar_interpolate( uint8_t from, uint8_t to, uint32_t t, uint32_t duration );
+static uint8_t ps4_lightbar_quantize( uint8_t value );
+
+
+/********************************************************************************/
+/*                              C O N S T A N T S                               */
+/********************************************************************************/
+
+/* Colors for the battery levels, indexed by enum ps4_status_battery */
+static const uint8_t ps4_lightbar_battery_colors[][3] = {
+    { 0x10, 0x10, 0x10 },   /* unknown  */
+    { 0x40, 0x00, 0x00 },   /* shutdown */
+    { 0x40, 0x10, 0x00 },   /* dying    */
+    { 0x40, 0x30, 0x00 },   /* low      */
+    { 0x20, 0x40, 0x00 },   /* high     */
+    { 0x00, 0x40, 0x00 }    /* full     */
+};
+
+/* Period of the pulse shown while charging */
+#define PS4_LIGHTBAR_CHARGING_PERIOD_MS 2000
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+static ps4_lightbar_state_t ps4_lightbar;
+static ps4_lightbar_stats_t ps4_lightbar_stats;
+static uint8_t ps4_lightbar_budget = PS4_LIGHTBAR_BUDGET;
+static bool ps4_lightbar_running = false;
+static portMUX_TYPE ps4_lightbar_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static esp_timer_handle_t ps4_lightbar_timer = NULL;
+
+/* Only touched from the timer */
+static int64_t ps4_lightbar_last_sent = 0;
+
+/* Written from the report dispatcher */
+static volatile uint8_t ps4_lightbar_battery_status = 0;
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ps4LightbarAnimate
+**
+** Description      Plays an animation on the lightbar, starting from its
+**                  current color. The keyframes are copied, so they don't
+**                  need to outlive the call. The animation is evaluated
+**                  on a timer, and an output report is only sent when the
+**                  quantized color changes, within the report budget.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4LightbarAnimate( const ps4_lightbar_keyframe_t *keyframes, uint8_t count, bool loop )
+{
+    if (keyframes == NULL || count == 0) {
+        ps4LightbarStop();
+        return;
+    }
+
+    if (count > PS4_LIGHTBAR_MAX_KEYFRAMES) {
+        ESP_LOGW(PS4_TAG, "[%s] animation truncated to %d keyframes", __func__, PS4_LIGHTBAR_MAX_KEYFRAMES);
+        count = PS4_LIGHTBAR_MAX_KEYFRAMES;
+    }
+
+    ps4_lightbar_start( ps4_lightbar_mode_animation, keyframes, count, loop );
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4LightbarFade
+**
+** Description      Fades the lightbar from its current color to another.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4LightbarFade( uint8_t r, uint8_t g, uint8_t b, uint16_t duration_ms )
+{
+    ps4_lightbar_keyframe_t keyframe = { duration_ms, r, g, b, ps4_lightbar_curve_linear };
+
+    ps4LightbarAnimate( &keyframe, 1, false );
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4LightbarPulse
+**
+** Description      Repeatedly fades the lightbar in to a color and back
+**                  out to off, until another color or animation is set.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4LightbarPulse( uint8_t r, uint8_t g, uint8_t b, uint16_t period_ms )
+{
+    ps4_lightbar_keyframe_t keyframes[] = {
+        { period_ms / 2, r, g, b, ps4_lightbar_curve_linear },
+        { period_ms - period_ms / 2, 0, 0, 0, ps4_lightbar_curve_linear }
+    };
+
+    ps4LightbarAnimate( keyframes, 2, true );
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4LightbarBattery
+**
+** Description      Shows the battery level of the controller on the
+**                  lightbar, from green when full to red when empty, and
+**                  pulsing while charging.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4LightbarBattery()
+{
+    ps4_lightbar_start( ps4_lightbar_mode_battery, NULL, 0, false );
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4LightbarStop
+**
+** Description      Stops the running animation or color, returning the
+**                  lightbar to the color set with ps4Cmd or ps4SetLed.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4LightbarStop()
+{
+    portENTER_CRITICAL(&ps4_lightbar_lock);
+    ps4_lightbar.mode = ps4_lightbar_mode_idle;
+    ps4_lightbar.generation++;
+    ps4_mixer_update( ps4_mixer_channel_lightbar, NULL, 0, ps4_mixer_field_lightbar );
+    portEXIT_CRITICAL(&ps4_lightbar_lock);
+
+    ps4_mixer_flush();
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4SetLightbar
+**
+** Description      Sets the lightbar to a steady color, stopping any
+**                  running animation. The color takes precedence over the
+**                  player color until ps4LightbarStop is called.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4SetLightbar( uint8_t r, uint8_t g, uint8_t b )
+{
+    ps4_cmd_t cmd = { .r = r, .g = g, .b = b };
+
+    portENTER_CRITICAL(&ps4_lightbar_lock);
+    ps4_lightbar.mode = ps4_lightbar_mode_idle;
+    ps4_lightbar.generation++;
+    ps4_mixer_update( ps4_mixer_channel_lightbar, &cmd, ps4_mixer_field_lightbar, 0 );
+    portEXIT_CRITICAL(&ps4_lightbar_lock);
+
+    ps4_mixer_flush();
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4SetLightbarFlash
+**
+** Description      Makes the lightbar flash, alternating between on and
+**                  off for the given durations, in units of 10 ms. Both 0
+**                  keep the lightbar on.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4SetLightbarFlash( uint8_t on, uint8_t off )
+{
+    ps4_cmd_t cmd = { .flash_on = on, .flash_off = off };
+
+    ps4MixerSet( ps4_mixer_channel_lightbar, &cmd, ps4_mixer_field_flash );
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4LightbarSetBudget
+**
+** Description      Limits the number of output reports sent per second for
+**                  animations. Changes in between are skipped, the latest
+**                  color is sent once the budget allows. 0 removes the
+**                  limit, leaving only the evaluation interval.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4LightbarSetBudget( uint8_t reports_per_second )
+{
+    portENTER_CRITICAL(&ps4_lightbar_lock);
+    ps4_lightbar_budget = reports_per_second;
+    portEXIT_CRITICAL(&ps4_lightbar_lock);
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4LightbarGetStats
+**
+** Description      Copies the counters of evaluated animation frames, and
+**                  of those that changed the color, were unchanged after
+**                  quantization, or were deferred by the report budget.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4LightbarGetStats( ps4_lightbar_stats_t *stats )
+{
+    portENTER_CRITICAL(&ps4_lightbar_lock);
+    *stats = ps4_lightbar_stats;
+    portEXIT_CRITICAL(&ps4_lightbar_lock);
+}
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+/* Creates the animation timer up front, from ps4Init, so that starting an animation
+ * never allocates */
+void ps4_lightbar_init()
+{
+    if (ps4_lightbar_timer == NULL) {
+        esp_timer_create_args_t args = {
+            .callback = &ps4_lightbar_tick,
+            .name = "ps4_lightbar"
+        };
+
+        esp_err_t ret = esp_timer_create(&args, &ps4_lightbar_timer);
+        ps4_alloc_count( ps4_alloc_kind_library, ret == ESP_OK, 0 );
+
+        if (ret != ESP_OK) {
+            ESP_LOGE(PS4_TAG, "[%s] creating the animation timer failed", __func__);
+        }
+    }
+}
+
+
+void ps4_lightbar_status( const ps4_status_t *status )
+{
+    ps4_lightbar_battery_status = status->battery;
+}
+
+
+/* Status fields that must be decoded for the running animation */
+uint8_t ps4_lightbar_interest()
+{
+    return ps4_lightbar.mode == ps4_lightbar_mode_battery
+        ? ps4_interest_status_battery | ps4_interest_status_charging
+        : 0;
+}
+
+
+static void ps4_lightbar_start( uint8_t mode, const ps4_lightbar_keyframe_t *keyframes, uint8_t count, bool loop )
+{
+    ps4_cmd_t cmd;
+    bool start_timer = false;
+
+    // Animations start from the color that is currently shown
+    ps4MixerGetOutput( &cmd );
+
+    ps4_lightbar_init();
+
+    if (ps4_lightbar_timer == NULL) {
+        return;
+    }
+
+    portENTER_CRITICAL(&ps4_lightbar_lock);
+
+    ps4_lightbar.mode = mode;
+    ps4_lightbar.generation++;
+    ps4_lightbar.count = count;
+    ps4_lightbar.loop = loop;
+    ps4_lightbar.start = esp_timer_get_time();
+    ps4_lightbar.from[0] = cmd.r;
+    ps4_lightbar.from[1] = cmd.g;
+    ps4_lightbar.from[2] = cmd.b;
+
+    if (count > 0) {
+        memcpy( ps4_lightbar.keyframes, keyframes, count * sizeof(*keyframes) );
+    }
+
+    // The timer rearms itself while an animation is running,
+    // so it must only be started when it has stopped doing so
+    if (!ps4_lightbar_running) {
+        ps4_lightbar_running = true;
+        start_timer = true;
+    }
+
+    portEXIT_CRITICAL(&ps4_lightbar_lock);
+
+    if (start_timer) {
+        esp_timer_start_once( ps4_lightbar_timer, 0 );
+    }
+}
+
+
+static void ps4_lightbar_tick( void *arg )
+{
+    int64_t now = esp_timer_get_time();
+    ps4_lightbar_state_t state;
+    uint8_t budget;
+    uint8_t color[3];
+    bool finished = false;
+    bool shown = false;
+    bool rearm;
+
+    portENTER_CRITICAL(&ps4_lightbar_lock);
+    state = ps4_lightbar;
+    budget = ps4_lightbar_budget;
+    portEXIT_CRITICAL(&ps4_lightbar_lock);
+
+    ps4_lightbar_stats_t stats = {0};
+
+    if (state.mode == ps4_lightbar_mode_animation) {
+        finished = ps4_lightbar_animation( &state, now, color );
+    } else if (state.mode == ps4_lightbar_mode_battery) {
+        ps4_lightbar_battery( now, color );
+    }
+
+    ps4_cmd_t cmd = {0};
+    bool send = false;
+
+    if (state.mode != ps4_lightbar_mode_idle) {
+        ps4_mixer_get( ps4_mixer_channel_lightbar, &cmd );
+
+        stats.frames++;
+
+        for (int i = 0; i < 3; i++) {
+            color[i] = ps4_lightbar_quantize( color[i] );
+        }
+
+        if (cmd.r == color[0] && cmd.g == color[1] && cmd.b == color[2]) {
+            stats.unchanged++;
+            shown = true;
+        } else if (budget && now - ps4_lightbar_last_sent < 1000000 / budget) {
+            stats.deferred++;
+        } else {
+            cmd.r = color[0];
+            cmd.g = color[1];
+            cmd.b = color[2];
+            send = true;
+        }
+    }
+
+    portENTER_CRITICAL(&ps4_lightbar_lock);
+
+    // The animation may have been stopped or replaced while this frame
+    // was evaluated, in which case the frame is dropped
+    if (ps4_lightbar.generation == state.generation) {
+        if (send) {
+            ps4_mixer_update( ps4_mixer_channel_lightbar, &cmd, ps4_mixer_field_lightbar, 0 );
+            ps4_lightbar_last_sent = now;
+            stats.sent++;
+            shown = true;
+        }
+
+        if (finished && shown) {
+            ps4_lightbar.mode = ps4_lightbar_mode_idle;
+        }
+    }
+
+    rearm = ps4_lightbar.mode != ps4_lightbar_mode_idle;
+    ps4_lightbar_running = rearm;
+
+    ps4_lightbar_stats.frames    += stats.frames;
+    ps4_lightbar_stats.sent      += stats.sent;
+    ps4_lightbar_stats.unchanged += stats.unchanged;
+    ps4_lightbar_stats.deferred  += stats.deferred;
+
+    portEXIT_CRITICAL(&ps4_lightbar_lock);
+
+    ps4_mixer_flush();
+
+    if (rearm) {
+        esp_timer_start_once( ps4_lightbar_timer, PS4_LIGHTBAR_TICK_MS * 1000 );
+    }
+}
+
+
+/* Evaluates the keyframes at the given time, returns true once the last
+ * keyframe of an animation that doesn't loop has been reached */
+static bool ps4_lightbar_animation( const ps4_lightbar_state_t *state, int64_t now, uint8_t *color )
+{
+    const ps4_lightbar_keyframe_t *last = &state->keyframes[state->count - 1];
+    const uint8_t *from = state->from;
+    uint32_t total = 0;
+    uint32_t t = (now - state->start) / 1000;
+
+    for (uint8_t i = 0; i < state->count; i++) {
+        total += state->keyframes[i].duration_ms;
+    }
+
+    if (t >= total) {
+        if (!state->loop || total == 0) {
+            color[0] = last->r;
+            color[1] = last->g;
+            color[2] = last->b;
+            return !state->loop;
+        }
+
+        // Every pass after the first starts from the last keyframe
+        t = (t - total) % total;
+        from = &last->r;
+    }
+
+    for (uint8_t i = 0; i < state->count; i++) {
+        const ps4_lightbar_keyframe_t *keyframe = &state->keyframes[i];
+
+        if (t < keyframe->duration_ms) {
+            if (keyframe->curve == ps4_lightbar_curve_linear) {
+                color[0] = ps4_lightbar_interpolate( from[0], keyframe->r, t, keyframe->duration_ms );
+                color[1] = ps4_lightbar_interpolate( from[1], keyframe->g, t, keyframe->duration_ms );
+                color[2] = ps4_lightbar_interpolate( from[2], keyframe->b, t, keyframe->duration_ms );
+            } else {
+                memcpy( color, from, 3 );
+            }
+
+            return false;
+        }
+
+        t -= keyframe->duration_ms;
+        from = &keyframe->r;
+    }
+
+    memcpy( color, from, 3 );
+    return false;
+}
+
+
+static void ps4_lightbar_battery( int64_t now, uint8_t *color )
+{
+    uint8_t battery = ps4_lightbar_battery_status;
+
+    if (battery == ps4_status_battery_charging) {
+        // Triangle wave between a quarter and full brightness
+        uint32_t phase = (now / 1000) % PS4_LIGHTBAR_CHARGING_PERIOD_MS;
+        uint32_t half = PS4_LIGHTBAR_CHARGING_PERIOD_MS / 2;
+        uint32_t level = phase < half ? phase : PS4_LIGHTBAR_CHARGING_PERIOD_MS - phase;
+
+        const uint8_t *full = ps4_lightbar_battery_colors[ps4_status_battery_full];
+
+        for (int i = 0; i < 3; i++) {
+            color[i] = full[i] / 4 + (uint32_t)(full[i] - full[i] / 4) * level / half;
+        }
+
+        return;
+    }
+
+    if (battery > ps4_status_battery_full) {
+        battery = 0;
+    }
+
+    memcpy( color, ps4_lightbar_battery_colors[battery], 3 );
+}
+
+
+static uint8_t ps4_lightbar_interpolate( uint8_t from, uint8_t to, uint32_t t, uint32_t duration )
+{
+    return from + ((int32_t)to - (int32_t)from) * (int32_t)t / (int32_t)duration;
+}
+
+
+static uint8_t ps4_lightbar_quantize( uint8_t value )
+{
+    const uint8_t mask = (1 << PS4_LIGHTBAR_QUANTIZE_BITS) - 1;
+
+    // Keeps full brightness reachable
+    return (value | mask) == 0xff ? 0xff : value & ~mask;
+}
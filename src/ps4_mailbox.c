@@ -0,0 +1,287 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "include/ps4.h"
+#include "include/ps4_int.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#define  PS4_TAG "PS4_MAILBOX"
+
+
+/********************************************************************************/
+/*                            L O C A L    T Y P E S                            */
+/********************************************************************************/
+
+typedef struct {
+    ps4_cmd_t cmd;
+    ps4_mixer_channel_t channel;
+    uint8_t fields;
+    uint8_t status;
+    ps4_cmd_handle_t handle;
+    int64_t posted_at;
+} ps4_mailbox_entry_t;
+
+/* Twice the depth, so the status of a command is kept for at least as
+ * many further commands as can be waiting */
+#define PS4_MAILBOX_SLOTS (2 * PS4_MAILBOX_DEPTH)
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+/* Commands are numbered from 1 as posted. Those from tail up to head are
+ * waiting, the ones before keep their status until the slot is reused.
+ * Those from tail up to applied are in the mixer, waiting for it to send */
+static ps4_mailbox_entry_t ps4_mailbox[PS4_MAILBOX_SLOTS];
+static uint32_t ps4_mailbox_head = 0;
+static uint32_t ps4_mailbox_tail = 0;
+static uint32_t ps4_mailbox_applied = 0;
+
+static ps4_mailbox_stats_t ps4_mailbox_stats;
+static portMUX_TYPE ps4_mailbox_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ps4CmdPost
+**
+** Description      Posts a command to be sent from the Bluetooth task,
+**                  right after the next input report. It never blocks, and
+**                  can be called from any task.
+**
+**
+** Returns          ps4_cmd_handle_t, 0 when the mailbox is full
+**
+*******************************************************************************/
+ps4_cmd_handle_t ps4CmdPost( ps4_cmd_t cmd )
+{
+    return ps4MixerPost( ps4_mixer_channel_base, &cmd, ps4_mixer_field_all );
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4MixerPost
+**
+** Description      Posts fields of a mixer channel to be set from the
+**                  Bluetooth task, as ps4MixerSet would.
+**
+**
+** Returns          ps4_cmd_handle_t, 0 when the mailbox is full
+**
+*******************************************************************************/
+ps4_cmd_handle_t ps4MixerPost( ps4_mixer_channel_t channel, const ps4_cmd_t *cmd, uint8_t fields )
+{
+    ps4_cmd_handle_t handle = 0;
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&ps4_mailbox_lock);
+
+    uint32_t depth = ps4_mailbox_head - ps4_mailbox_tail;
+
+    if (depth < PS4_MAILBOX_DEPTH) {
+        ps4_mailbox_entry_t *entry = &ps4_mailbox[ps4_mailbox_head % PS4_MAILBOX_SLOTS];
+
+        entry->cmd = *cmd;
+        entry->channel = channel;
+        entry->fields = fields;
+        entry->status = ps4_cmd_status_queued;
+        entry->handle = ++ps4_mailbox_head;
+        entry->posted_at = now;
+
+        handle = entry->handle;
+        depth++;
+
+        ps4_mailbox_stats.posted++;
+        ps4_mailbox_stats.depth = depth;
+
+        if (depth > ps4_mailbox_stats.depth_max) {
+            ps4_mailbox_stats.depth_max = depth;
+        }
+    } else {
+        ps4_mailbox_stats.dropped++;
+    }
+
+    portEXIT_CRITICAL(&ps4_mailbox_lock);
+
+    return handle;
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4CmdStatus
+**
+** Description      Gets the status of a posted command.
+**
+**
+** Returns          uint8_t, the ps4_cmd_status
+**
+*******************************************************************************/
+uint8_t ps4CmdStatus( ps4_cmd_handle_t handle )
+{
+    uint8_t status = ps4_cmd_status_expired;
+
+    if (handle == 0) {
+        return ps4_cmd_status_dropped;
+    }
+
+    portENTER_CRITICAL(&ps4_mailbox_lock);
+
+    const ps4_mailbox_entry_t *entry = &ps4_mailbox[(handle - 1) % PS4_MAILBOX_SLOTS];
+
+    if (entry->handle == handle) {
+        status = entry->status;
+    }
+
+    portEXIT_CRITICAL(&ps4_mailbox_lock);
+
+    return status;
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4CmdWait
+**
+** Description      Waits until a posted command has left the mailbox, or
+**                  for at most timeout_ms. The calling task sleeps between
+**                  checks, so it must not be called from the Bluetooth task.
+**
+**
+** Returns          uint8_t, the ps4_cmd_status, queued after a timeout
+**
+*******************************************************************************/
+uint8_t ps4CmdWait( ps4_cmd_handle_t handle, uint32_t timeout_ms )
+{
+    int64_t deadline = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+    uint8_t status;
+
+    while ((status = ps4CmdStatus( handle )) == ps4_cmd_status_queued &&
+           esp_timer_get_time() < deadline) {
+        vTaskDelay( 1 );
+    }
+
+    return status;
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4GetMailboxStats
+**
+** Description      Copies the counters of posted commands and their
+**                  outcome, the number of commands waiting, and the time
+**                  they waited.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4GetMailboxStats( ps4_mailbox_stats_t *stats )
+{
+    portENTER_CRITICAL(&ps4_mailbox_lock);
+    *stats = ps4_mailbox_stats;
+    portEXIT_CRITICAL(&ps4_mailbox_lock);
+}
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+/* Applies the waiting commands to the mixer and sends the result, from
+ * the Bluetooth task after an input report has been processed. They are
+ * settled by the send, see ps4_mailbox_settle */
+void ps4_mailbox_drain()
+{
+    portENTER_CRITICAL(&ps4_mailbox_lock);
+
+    for (uint32_t i = ps4_mailbox_applied; i != ps4_mailbox_head; i++) {
+        const ps4_mailbox_entry_t *entry = &ps4_mailbox[i % PS4_MAILBOX_SLOTS];
+
+        ps4_mixer_update( entry->channel, &entry->cmd, entry->fields, 0 );
+    }
+
+    ps4_mailbox_applied = ps4_mailbox_head;
+
+    portEXIT_CRITICAL(&ps4_mailbox_lock);
+
+    ps4_mixer_input_done();
+}
+
+
+/* Gives the commands applied to the mixer the outcome of the send that
+ * carried them. A send left to the one in progress is not an outcome, so
+ * the mixer only settles them once it is done sending */
+void ps4_mailbox_settle( uint8_t result )
+{
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&ps4_mailbox_lock);
+
+    for (uint32_t i = ps4_mailbox_tail; i != ps4_mailbox_applied; i++) {
+        ps4_mailbox_entry_t *entry = &ps4_mailbox[i % PS4_MAILBOX_SLOTS];
+        uint32_t latency = now - entry->posted_at;
+
+        switch (result) {
+        case ps4_send_result_ok:
+            entry->status = ps4_cmd_status_sent;
+            ps4_mailbox_stats.sent++;
+            break;
+
+        case ps4_send_result_congested:
+            entry->status = ps4_cmd_status_congested;
+            ps4_mailbox_stats.congested++;
+            break;
+
+        default:
+            entry->status = ps4_cmd_status_dropped;
+            ps4_mailbox_stats.dropped++;
+            break;
+        }
+
+        if (ps4_mailbox_stats.latency_us == 0) {
+            ps4_mailbox_stats.latency_us = latency;
+        } else {
+            ps4_mailbox_stats.latency_us += ((int32_t)latency - (int32_t)ps4_mailbox_stats.latency_us) / 8;
+        }
+
+        if (latency > ps4_mailbox_stats.latency_max_us) {
+            ps4_mailbox_stats.latency_max_us = latency;
+        }
+    }
+
+    // Commands posted from now on go to slots after these, which are
+    // only reused once as many more were posted
+    ps4_mailbox_tail = ps4_mailbox_applied;
+    ps4_mailbox_stats.depth = ps4_mailbox_head - ps4_mailbox_tail;
+
+    portEXIT_CRITICAL(&ps4_mailbox_lock);
+}
+
+
+/* Drops the waiting commands, as after disconnecting */
+void ps4_mailbox_reset()
+{
+    portENTER_CRITICAL(&ps4_mailbox_lock);
+
+    for (uint32_t i = ps4_mailbox_tail; i != ps4_mailbox_head; i++) {
+        ps4_mailbox[i % PS4_MAILBOX_SLOTS].status = ps4_cmd_status_dropped;
+        ps4_mailbox_stats.dropped++;
+    }
+
+    ps4_mailbox_tail = ps4_mailbox_head;
+    ps4_mailbox_applied = ps4_mailbox_head;
+    ps4_mailbox_stats.depth = 0;
+
+    portEXIT_CRITICAL(&ps4_mailbox_lock);
+}
@@ -0,0 +1,47 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "include/ps4.h"
+#include "include/ps4_int.h"
+
+#define  PS4_TAG "PS4_METRICS"
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+/* Incremented where things happen with PS4_METRIC_INC, see ps4_int.h */
+ps4_metrics_t ps4_metrics;
+
+_Static_assert( sizeof(ps4_metrics_t) % sizeof(uint32_t) == 0, "ps4_metrics_t must only hold uint32_t counters" );
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ps4GetMetrics
+**
+** Description      Copies the health counters of the whole library, and
+**                  starts them from 0 again when reset is set. Each counter
+**                  is read and cleared in one atomic step, so no increment
+**                  is lost between two snapshots, but the counters are not
+**                  taken at exactly the same time.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4GetMetrics( ps4_metrics_t *metrics, bool reset )
+{
+    uint32_t *counters = (uint32_t*)&ps4_metrics;
+    uint32_t *snapshot = (uint32_t*)metrics;
+
+    for (size_t i = 0; i < sizeof(ps4_metrics_t) / sizeof(uint32_t); i++) {
+        snapshot[i] = reset ? __atomic_exchange_n( &counters[i], 0, __ATOMIC_RELAXED )
+                            : __atomic_load_n( &counters[i], __ATOMIC_RELAXED );
+    }
+}
@@ -0,0 +1,608 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "include/ps4.h"
+#include "include/ps4_int.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#define  PS4_TAG "PS4_MIXER"
+
+
+/********************************************************************************/
+/*                            L O C A L    T Y P E S                            */
+/********************************************************************************/
+
+typedef struct {
+    ps4_cmd_t value;
+    uint8_t fields;
+    uint8_t priority;
+    uint8_t blend;
+    uint8_t generation;
+    bool in_use;
+} ps4_mixer_slot_t;
+
+
+/********************************************************************************/
+/*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
+/********************************************************************************/
+
+static ps4_mixer_slot_t* ps4_mixer_slot( ps4_mixer_channel_t channel );
+static void ps4_mixer_resolve();
+static void ps4_mixer_apply( ps4_cmd_t *output, const ps4_mixer_slot_t *slot );
+static bool ps4_mixer_equal( const ps4_cmd_t *a, const ps4_cmd_t *b );
+static uint8_t ps4_mixer_blend_value( uint8_t value, uint8_t channel, uint8_t blend );
+static uint8_t ps4_mixer_send();
+static void ps4_mixer_release( bool timeout );
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+/* The built-in channels are always open */
+static ps4_mixer_slot_t ps4_mixer_slots[PS4_MIXER_MAX_CHANNELS] = {
+    [ps4_mixer_channel_base] = {
+        .priority = ps4_mixer_priority_base,
+        .blend = ps4_mixer_blend_override,
+        .in_use = true
+    },
+    [ps4_mixer_channel_lightbar] = {
+        .priority = ps4_mixer_priority_effects,
+        .blend = ps4_mixer_blend_override,
+        .in_use = true
+    },
+    [ps4_mixer_channel_rumble] = {
+        .priority = ps4_mixer_priority_effects,
+        .blend = ps4_mixer_blend_max,
+        .in_use = true
+    }
+};
+
+/* Resolved output, and whether it still has to be sent */
+static ps4_cmd_t ps4_mixer_output = {0};
+static bool ps4_mixer_dirty = false;
+static bool ps4_mixer_sending = false;
+
+/* Output held back until the next input report, see ps4SetOutputAlignment */
+static bool ps4_mixer_align = false;
+static bool ps4_mixer_held = false;
+static uint16_t ps4_mixer_max_hold_ms = PS4_OUTPUT_MAX_HOLD_MS;
+static int64_t ps4_mixer_held_since = 0;
+static ps4_output_hold_stats_t ps4_mixer_hold_stats;
+
+static portMUX_TYPE ps4_mixer_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ps4MixerOpen
+**
+** Description      Opens a channel of the output mixer. The channels are
+**                  applied from the lowest to the highest priority, each
+**                  combining the fields it drives with the result so far
+**                  using its blend rule. Channels of the same priority are
+**                  applied in the order they were opened.
+**
+**
+** Returns          ps4_mixer_channel_t, negative when all channels are open
+**
+*******************************************************************************/
+ps4_mixer_channel_t ps4MixerOpen( uint8_t priority, uint8_t blend )
+{
+    ps4_mixer_channel_t channel = -1;
+
+    portENTER_CRITICAL(&ps4_mixer_lock);
+
+    for (int i = 0; i < PS4_MIXER_MAX_CHANNELS; i++) {
+        ps4_mixer_slot_t *slot = &ps4_mixer_slots[i];
+
+        if (!slot->in_use) {
+            memset( &slot->value, 0, sizeof(slot->value) );
+            slot->fields = 0;
+            slot->priority = priority;
+            slot->blend = blend;
+            slot->generation++;
+            slot->in_use = true;
+
+            channel = (slot->generation << 8) | i;
+            break;
+        }
+    }
+
+    portEXIT_CRITICAL(&ps4_mixer_lock);
+
+    if (channel < 0) {
+        ESP_LOGE(PS4_TAG, "[%s] all %d channels are in use", __func__, PS4_MIXER_MAX_CHANNELS);
+    }
+
+    return channel;
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4MixerClose
+**
+** Description      Closes a channel, removing its fields from the output.
+**                  The built-in channels can't be closed.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4MixerClose( ps4_mixer_channel_t channel )
+{
+    portENTER_CRITICAL(&ps4_mixer_lock);
+
+    ps4_mixer_slot_t *slot = ps4_mixer_slot( channel );
+
+    if (slot != NULL && (channel & 0xff) >= ps4_mixer_channel_count) {
+        slot->in_use = false;
+        ps4_mixer_resolve();
+    }
+
+    portEXIT_CRITICAL(&ps4_mixer_lock);
+
+    ps4_mixer_flush();
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4MixerSet
+**
+** Description      Sets the given fields of a channel from the command, and
+**                  makes the channel drive them. A report is sent when the
+**                  resolved output changes.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4MixerSet( ps4_mixer_channel_t channel, const ps4_cmd_t *cmd, uint8_t fields )
+{
+    ps4_mixer_update( channel, cmd, fields, 0 );
+    ps4_mixer_flush();
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4MixerRelease
+**
+** Description      Stops a channel from driving the given fields, leaving
+**                  them to the channels of lower priority.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4MixerRelease( ps4_mixer_channel_t channel, uint8_t fields )
+{
+    ps4_mixer_update( channel, NULL, 0, fields );
+    ps4_mixer_flush();
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4MixerGetOutput
+**
+** Description      Copies the resolved output, as last sent or about to be
+**                  sent to the controller.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4MixerGetOutput( ps4_cmd_t *cmd )
+{
+    portENTER_CRITICAL(&ps4_mixer_lock);
+    *cmd = ps4_mixer_output;
+    portEXIT_CRITICAL(&ps4_mixer_lock);
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4SetOutputAlignment
+**
+** Description      Holds changed output back until the next input report
+**                  has been processed, and sends it then, so that output
+**                  reports go out in the gap after an input report rather
+**                  than competing with the next one on the link. Output is
+**                  never held longer than max_hold_ms, or a default when 0.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4SetOutputAlignment( bool enabled, uint16_t max_hold_ms )
+{
+    portENTER_CRITICAL(&ps4_mixer_lock);
+    ps4_mixer_align = enabled;
+    ps4_mixer_max_hold_ms = max_hold_ms ? max_hold_ms : PS4_OUTPUT_MAX_HOLD_MS;
+    portEXIT_CRITICAL(&ps4_mixer_lock);
+
+    if (!enabled) {
+        ps4_mixer_release( false );
+        ps4_mixer_flush();
+    }
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4GetOutputHoldStats
+**
+** Description      Copies how often held output was sent after an input
+**                  report or after the maximum hold time, and how long it
+**                  was held.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4GetOutputHoldStats( ps4_output_hold_stats_t *stats )
+{
+    portENTER_CRITICAL(&ps4_mixer_lock);
+    *stats = ps4_mixer_hold_stats;
+    portEXIT_CRITICAL(&ps4_mixer_lock);
+}
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+/* Sets and releases fields of a channel without sending the result, so
+ * that it can be called while holding the lock of an effect engine.
+ * ps4_mixer_flush must be called afterwards */
+void ps4_mixer_update( ps4_mixer_channel_t channel, const ps4_cmd_t *cmd, uint8_t set, uint8_t release )
+{
+    portENTER_CRITICAL(&ps4_mixer_lock);
+
+    ps4_mixer_slot_t *slot = ps4_mixer_slot( channel );
+
+    if (slot != NULL) {
+        if (set & ps4_mixer_field_heavy) {
+            slot->value.rumble_left_intensity = cmd->rumble_left_intensity;
+        }
+
+        if (set & ps4_mixer_field_light) {
+            slot->value.rumble_right_intensity = cmd->rumble_right_intensity;
+        }
+
+        if (set & ps4_mixer_field_lightbar) {
+            slot->value.r = cmd->r;
+            slot->value.g = cmd->g;
+            slot->value.b = cmd->b;
+            slot->value.led1 = cmd->led1;
+            slot->value.led2 = cmd->led2;
+            slot->value.led3 = cmd->led3;
+            slot->value.led4 = cmd->led4;
+        }
+
+        if (set & ps4_mixer_field_flash) {
+            slot->value.flash_on = cmd->flash_on;
+            slot->value.flash_off = cmd->flash_off;
+        }
+
+        slot->fields = (slot->fields | set) & ~release;
+        ps4_mixer_resolve();
+    }
+
+    portEXIT_CRITICAL(&ps4_mixer_lock);
+}
+
+
+/* Copies the value of a channel */
+void ps4_mixer_get( ps4_mixer_channel_t channel, ps4_cmd_t *cmd )
+{
+    portENTER_CRITICAL(&ps4_mixer_lock);
+
+    ps4_mixer_slot_t *slot = ps4_mixer_slot( channel );
+
+    if (slot != NULL) {
+        *cmd = slot->value;
+    }
+
+    portEXIT_CRITICAL(&ps4_mixer_lock);
+}
+
+
+/* Sends the resolved output again, as after connecting or when settings
+ * outside of the mixer, such as the report rate, have changed */
+void ps4_mixer_resend()
+{
+    portENTER_CRITICAL(&ps4_mixer_lock);
+    ps4_mixer_dirty = true;
+    portEXIT_CRITICAL(&ps4_mixer_lock);
+
+    ps4_mixer_flush();
+}
+
+
+/* Must be called with the lock held */
+static ps4_mixer_slot_t* ps4_mixer_slot( ps4_mixer_channel_t channel )
+{
+    if (channel < 0) {
+        return NULL;
+    }
+
+    ps4_mixer_slot_t *slot = &ps4_mixer_slots[(channel & 0xff) % PS4_MIXER_MAX_CHANNELS];
+
+    if (!slot->in_use || slot->generation != (uint8_t)(channel >> 8)) {
+        return NULL;
+    }
+
+    return slot;
+}
+
+
+/* Must be called with the lock held */
+static void ps4_mixer_resolve()
+{
+    ps4_cmd_t output = {0};
+    int last_priority = -1;
+
+    // Applies the channels in order of priority, without sorting them
+    for (;;) {
+        int priority = 256;
+
+        for (int i = 0; i < PS4_MIXER_MAX_CHANNELS; i++) {
+            const ps4_mixer_slot_t *slot = &ps4_mixer_slots[i];
+
+            if (slot->in_use && slot->priority > last_priority && slot->priority < priority) {
+                priority = slot->priority;
+            }
+        }
+
+        if (priority == 256) {
+            break;
+        }
+
+        for (int i = 0; i < PS4_MIXER_MAX_CHANNELS; i++) {
+            const ps4_mixer_slot_t *slot = &ps4_mixer_slots[i];
+
+            if (slot->in_use && slot->priority == priority) {
+                ps4_mixer_apply( &output, slot );
+            }
+        }
+
+        last_priority = priority;
+    }
+
+    if (!ps4_mixer_equal( &output, &ps4_mixer_output )) {
+        ps4_mixer_output = output;
+        ps4_mixer_dirty = true;
+    }
+}
+
+
+/* Sends the resolved output when it changed, or holds it back until the
+ * next input report when output is aligned to them, at most for the
+ * maximum hold time. The stack is only written to from the Bluetooth task,
+ * so output changed from any other, such as the application or the effect
+ * timers, is handed over to it, see ps4_mixer_handoff */
+void ps4_mixer_flush()
+{
+    bool in_task = ps4_l2cap_in_task();
+    bool hold;
+    bool arm = false;
+    bool handoff;
+    uint16_t max_hold_ms;
+
+    if (!ps4IsConnected()) {
+        return;
+    }
+
+    portENTER_CRITICAL(&ps4_mixer_lock);
+
+    hold = ps4_mixer_dirty && ps4_mixer_align;
+
+    if (hold && !ps4_mixer_held) {
+        ps4_mixer_held = true;
+        ps4_mixer_held_since = esp_timer_get_time();
+        arm = true;
+    }
+
+    handoff = ps4_mixer_dirty && !hold && !in_task;
+    max_hold_ms = ps4_mixer_max_hold_ms;
+
+    portEXIT_CRITICAL(&ps4_mixer_lock);
+
+    if (arm) {
+        ps4_l2cap_call( ps4_l2cap_call_output, max_hold_ms );
+    } else if (handoff) {
+        ps4_l2cap_call( ps4_l2cap_call_output, 0 );
+    }
+
+    if (in_task && !hold) {
+        ps4_mixer_send();
+    }
+}
+
+
+/* Sends the output held back, and any other output changed without
+ * being flushed, once an input report has been processed */
+uint8_t ps4_mixer_input_done()
+{
+    ps4_mixer_release( false );
+
+    return ps4_mixer_send();
+}
+
+
+/* Sends the output ps4_mixer_flush left for the Bluetooth task, called
+ * from it once the maximum hold time has passed without an input report,
+ * or right away for output changed from another task */
+void ps4_mixer_handoff()
+{
+    ps4_mixer_release( true );
+    ps4_mixer_send();
+}
+
+
+/* Only called from the Bluetooth task. It keeps sending until no further
+ * change was made while it was, so the last resolved output is always
+ * the last one sent, and a send made while one is in progress is left
+ * to it. The commands of the mailbox applied until then are settled with
+ * the outcome */
+static uint8_t ps4_mixer_send()
+{
+    ps4_cmd_t output;
+    uint8_t result = ps4_send_result_ok;
+
+    if (!ps4IsConnected()) {
+        ps4_mailbox_settle( ps4_send_result_failed );
+        return ps4_send_result_failed;
+    }
+
+    portENTER_CRITICAL(&ps4_mixer_lock);
+
+    if (ps4_mixer_sending) {
+        portEXIT_CRITICAL(&ps4_mixer_lock);
+        return ps4_send_result_deferred;
+    }
+
+    ps4_mixer_sending = true;
+
+    while (ps4_mixer_dirty) {
+        ps4_mixer_dirty = false;
+        output = ps4_mixer_output;
+
+        portEXIT_CRITICAL(&ps4_mixer_lock);
+
+        uint8_t sent = ps4_output_send( &output );
+
+        if (sent > result) {
+            result = sent;
+        }
+
+        portENTER_CRITICAL(&ps4_mixer_lock);
+    }
+
+    ps4_mixer_sending = false;
+
+    portEXIT_CRITICAL(&ps4_mixer_lock);
+
+    ps4_mailbox_settle( result );
+
+    return result;
+}
+
+
+/* Records how long the output was held, before it is sent. Released by
+ * an input report, the maximum hold time no longer has to be waited for */
+static void ps4_mixer_release( bool timeout )
+{
+    portENTER_CRITICAL(&ps4_mixer_lock);
+
+    if (!ps4_mixer_held) {
+        portEXIT_CRITICAL(&ps4_mixer_lock);
+        return;
+    }
+
+    ps4_mixer_held = false;
+
+    uint32_t hold_us = esp_timer_get_time() - ps4_mixer_held_since;
+    uint8_t bucket = 0;
+
+    // Doubling buckets from 1 ms up
+    for (uint32_t ms = hold_us / 1000; ms > 0 && bucket < PS4_OUTPUT_HOLD_BUCKETS - 1; ms >>= 1) {
+        bucket++;
+    }
+
+    ps4_mixer_hold_stats.hold_histogram[bucket]++;
+
+    if (hold_us > ps4_mixer_hold_stats.hold_max_us) {
+        ps4_mixer_hold_stats.hold_max_us = hold_us;
+    }
+
+    if (timeout) {
+        ps4_mixer_hold_stats.released_by_timeout++;
+    } else {
+        ps4_mixer_hold_stats.released_by_input++;
+    }
+
+    portEXIT_CRITICAL(&ps4_mixer_lock);
+
+    if (!timeout) {
+        ps4_l2cap_call_cancel( ps4_l2cap_call_output );
+    }
+}
+
+
+static void ps4_mixer_apply( ps4_cmd_t *output, const ps4_mixer_slot_t *slot )
+{
+    const ps4_cmd_t *value = &slot->value;
+    uint8_t blend = slot->blend;
+
+    if (slot->fields & ps4_mixer_field_heavy) {
+        output->rumble_left_intensity = ps4_mixer_blend_value( output->rumble_left_intensity, value->rumble_left_intensity, blend );
+    }
+
+    if (slot->fields & ps4_mixer_field_light) {
+        output->rumble_right_intensity = ps4_mixer_blend_value( output->rumble_right_intensity, value->rumble_right_intensity, blend );
+    }
+
+    if (slot->fields & ps4_mixer_field_lightbar) {
+        output->r = ps4_mixer_blend_value( output->r, value->r, blend );
+        output->g = ps4_mixer_blend_value( output->g, value->g, blend );
+        output->b = ps4_mixer_blend_value( output->b, value->b, blend );
+
+        if (blend == ps4_mixer_blend_override) {
+            output->led1 = value->led1;
+            output->led2 = value->led2;
+            output->led3 = value->led3;
+            output->led4 = value->led4;
+        } else {
+            output->led1 |= value->led1;
+            output->led2 |= value->led2;
+            output->led3 |= value->led3;
+            output->led4 |= value->led4;
+        }
+    }
+
+    // Flash durations are timings rather than levels, so they are only
+    // ever taken as a whole
+    if (slot->fields & ps4_mixer_field_flash) {
+        if (blend == ps4_mixer_blend_override || value->flash_on || value->flash_off) {
+            output->flash_on = value->flash_on;
+            output->flash_off = value->flash_off;
+        }
+    }
+}
+
+
+static bool ps4_mixer_equal( const ps4_cmd_t *a, const ps4_cmd_t *b )
+{
+    return a->rumble_left_intensity == b->rumble_left_intensity
+        && a->rumble_right_intensity == b->rumble_right_intensity
+        && a->r == b->r && a->g == b->g && a->b == b->b
+        && a->led1 == b->led1 && a->led2 == b->led2
+        && a->led3 == b->led3 && a->led4 == b->led4
+        && a->flash_on == b->flash_on && a->flash_off == b->flash_off;
+}
+
+
+static uint8_t ps4_mixer_blend_value( uint8_t value, uint8_t channel, uint8_t blend )
+{
+    switch (blend) {
+    case ps4_mixer_blend_max:
+        return channel > value ? channel : value;
+
+    case ps4_mixer_blend_additive:
+        return value + channel > UINT8_MAX ? UINT8_MAX : value + channel;
+
+    default:
+        return channel;
+    }
+}
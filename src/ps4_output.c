@@ -0,0 +1,195 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include "include/ps4.h"
+#include "include/ps4_int.h"
+#include "include/ps4_report.h"
+#include "esp_log.h"
+
+#define  PS4_TAG "PS4_OUTPUT"
+
+
+/********************************************************************************/
+/*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
+/********************************************************************************/
+
+static void ps4_output_init();
+static bool ps4_output_patch( uint8_t slot, uint8_t value );
+static void ps4_output_write_crc();
+
+
+/********************************************************************************/
+/*                              C O N S T A N T S                               */
+/********************************************************************************/
+
+/* Bytes of the report data that change after the report was encoded */
+static const uint8_t ps4_output_patchable[] = {
+    ps4_control_packet_index_hw_control,
+    ps4_control_packet_index_rumble_right,
+    ps4_control_packet_index_rumble_left,
+    ps4_control_packet_index_lightbar_red,
+    ps4_control_packet_index_lightbar_green,
+    ps4_control_packet_index_lightbar_blue,
+    ps4_control_packet_index_flash_on,
+    ps4_control_packet_index_flash_off
+};
+
+enum ps4_output_slot {
+    ps4_output_slot_hw_control,
+    ps4_output_slot_rumble_right,
+    ps4_output_slot_rumble_left,
+    ps4_output_slot_lightbar_red,
+    ps4_output_slot_lightbar_green,
+    ps4_output_slot_lightbar_blue,
+    ps4_output_slot_flash_on,
+    ps4_output_slot_flash_off,
+    ps4_output_slot_count
+};
+
+/* Bytes covered by the CRC: a HID header, the report ID and the data before
+ * it. The controller checks the CRC as if the report had been sent as DATA
+ * OUTPUT (0xa2), whatever header it was actually sent with */
+#define PS4_OUTPUT_CRC_COVERED (sizeof(hid_cmd_t) - PS4_REPORT_CRC_SIZE)
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+/* The encoded report, only touched from the Bluetooth task, see ps4_mixer_flush */
+static hid_cmd_t ps4_output_report;
+static uint32_t ps4_output_crc;
+static bool ps4_output_ready = false;
+
+/* Change of the CRC for each bit of the patchable bytes. The CRC is
+ * linear over messages of the same length, so flipping a bit always
+ * changes the CRC by the same value, whatever the rest of the message */
+static uint32_t ps4_output_crc_delta[ps4_output_slot_count][8];
+
+static uint8_t ps4_output_interval = 0;
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ps4_output_send
+**
+** Description      Sends a resolved output state to the controller. The
+**                  encoded report is kept between calls, only the bytes
+**                  that changed are patched, and the CRC is updated for
+**                  those bytes rather than calculated over the report.
+**
+**
+** Returns          uint8_t, the ps4_send_result
+**
+*******************************************************************************/
+uint8_t ps4_output_send( const ps4_cmd_t *cmd )
+{
+    bool changed = false;
+
+    if (!ps4_output_ready) {
+        ps4_output_init();
+    }
+
+    changed |= ps4_output_patch( ps4_output_slot_hw_control, ps4_control_hw_control_hid | ps4_control_hw_control_crc | ps4_output_interval );
+    changed |= ps4_output_patch( ps4_output_slot_rumble_right, cmd->rumble_right_intensity );
+    changed |= ps4_output_patch( ps4_output_slot_rumble_left, cmd->rumble_left_intensity );
+    changed |= ps4_output_patch( ps4_output_slot_lightbar_red, cmd->r );
+    changed |= ps4_output_patch( ps4_output_slot_lightbar_green, cmd->g );
+    changed |= ps4_output_patch( ps4_output_slot_lightbar_blue, cmd->b );
+    changed |= ps4_output_patch( ps4_output_slot_flash_on, cmd->flash_on );
+    changed |= ps4_output_patch( ps4_output_slot_flash_off, cmd->flash_off );
+
+    if (changed) {
+        ps4_output_write_crc();
+    }
+
+    return ps4_l2cap_send_report( (const uint8_t*)&ps4_output_report, sizeof(ps4_output_report) );
+}
+
+
+/* Sets the input report interval encoded in the next report */
+void ps4_output_set_interval( uint8_t interval )
+{
+    ps4_output_interval = interval < PS4_REPORT_INTERVAL_MAX_MS ? interval : PS4_REPORT_INTERVAL_MAX_MS;
+}
+
+
+uint8_t ps4_output_get_interval()
+{
+    return ps4_output_interval;
+}
+
+
+/* Encodes the report with everything off, and derives the CRC change of
+ * every patchable bit from the CRC of an all zero message. The change
+ * doesn't depend on the rest of the message, header included */
+static void ps4_output_init()
+{
+    uint8_t message[PS4_OUTPUT_CRC_COVERED] = {0};
+    uint32_t zero = ps4Crc32( 0, message, sizeof(message) );
+    const size_t data = offsetof(hid_cmd_t, data);
+
+    for (uint8_t slot = 0; slot < ps4_output_slot_count; slot++) {
+        uint8_t *byte = &message[data + ps4_output_patchable[slot]];
+
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            *byte = 1 << bit;
+            ps4_output_crc_delta[slot][bit] = ps4Crc32( 0, message, sizeof(message) ) ^ zero;
+        }
+
+        *byte = 0;
+    }
+
+    memset( &ps4_output_report, 0, sizeof(ps4_output_report) );
+
+    ps4_output_report.code = hid_cmd_code_set_report | hid_cmd_code_type_output;
+    ps4_output_report.identifier = hid_cmd_identifier_ps4_control;
+    ps4_output_report.data[ps4_control_packet_index_hw_control] = ps4_control_hw_control_hid | ps4_control_hw_control_crc;
+    ps4_output_report.data[ps4_control_packet_index_flags] = ps4_control_flags_rumble | ps4_control_flags_lightbar | ps4_control_flags_flash;
+
+    // Sent as SET_REPORT, but checked against a DATA OUTPUT header
+    const uint8_t header = ps4_hid_header_output;
+
+    ps4_output_crc = ps4Crc32( 0, &header, sizeof(header) );
+    ps4_output_crc = ps4Crc32( ps4_output_crc, &ps4_output_report.identifier, PS4_OUTPUT_CRC_COVERED - sizeof(header) );
+    ps4_output_write_crc();
+
+    ps4_output_ready = true;
+}
+
+
+/* Sets a patchable byte, updating the CRC for the bits that flipped */
+static bool ps4_output_patch( uint8_t slot, uint8_t value )
+{
+    uint8_t *byte = &ps4_output_report.data[ps4_output_patchable[slot]];
+    uint8_t flipped = *byte ^ value;
+
+    if (flipped == 0) {
+        return false;
+    }
+
+    for (uint8_t bit = 0; bit < 8; bit++) {
+        if (flipped & (1 << bit)) {
+            ps4_output_crc ^= ps4_output_crc_delta[slot][bit];
+        }
+    }
+
+    *byte = value;
+    return true;
+}
+
+
+static void ps4_output_write_crc()
+{
+    uint8_t *crc = &ps4_output_report.data[ps4_control_packet_index_crc];
+
+    crc[0] = ps4_output_crc;
+    crc[1] = ps4_output_crc >> 8;
+    crc[2] = ps4_output_crc >> 16;
+    crc[3] = ps4_output_crc >> 24;
+}
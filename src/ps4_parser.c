@@ -3,7 +3,9 @@
 #include <string.h>
 #include "include/ps4.h"
 #include "include/ps4_int.h"
+#include "include/ps4_report.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #define  PS4_TAG "PS4_PARSER"
 
@@ -12,26 +14,6 @@
 /*                            L O C A L    T Y P E S                            */
 /********************************************************************************/
 
-enum ps4_packet_index {
-
-    ps4_packet_index_analog_stick_lx = 11,
-    ps4_packet_index_analog_stick_ly = 12,
-    ps4_packet_index_analog_stick_rx = 13,
-    ps4_packet_index_analog_stick_ry = 14,
-
-    ps4_packet_index_buttons_raw = 15,
-
-    ps4_packet_index_analog_button_l2 = 18,
-    ps4_packet_index_analog_button_r2 = 19,
-
-    ps4_packet_index_status = 39,
-
-    ps4_packet_index_sensor_accelerometer_x = 51,
-    ps4_packet_index_sensor_accelerometer_y = 53,
-    ps4_packet_index_sensor_accelerometer_z = 55,
-    ps4_packet_index_sensor_gyroscope_z = 57
-};
-
 enum ps4_button_mask {
 
     ps4_button_mask_direct   = 0xf,
@@ -56,8 +38,17 @@ enum ps4_button_mask {
 };
 
 enum ps4_status_mask {
-    ps4_status_mask_rumbling = 0x02,
-    ps4_status_mask_bluetooth = 0x04
+    ps4_status_mask_battery = 0x0f,
+    ps4_status_mask_cable   = 0x10
+};
+
+/* Battery levels reported in the status byte */
+enum ps4_status_level {
+    ps4_status_level_dying = 1,
+    ps4_status_level_low   = 3,
+    ps4_status_level_high  = 5,
+    ps4_status_level_full  = 9,
+    ps4_status_level_max   = 10
 };
 
 
@@ -65,12 +56,15 @@ enum ps4_status_mask {
 /*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
 /********************************************************************************/
 
-ps4_sensor_t ps4_parse_packet_sensor( uint8_t *packet );
-ps4_status_t ps4_parse_packet_status( uint8_t *packet );
-ps4_analog_stick_t ps4_parse_packet_analog_stick( uint8_t *packet );
-ps4_analog_button_t ps4_parse_packet_analog_button( uint8_t *packet );
-ps4_button_t ps4_parse_packet_buttons( uint8_t *packet );
+ps4_sensor_t ps4_parse_packet_sensor( const uint8_t *fields );
+ps4_status_t ps4_parse_packet_status( const uint8_t *fields );
+ps4_analog_stick_t ps4_parse_packet_analog_stick( const uint8_t *fields );
+ps4_analog_button_t ps4_parse_packet_analog_button( const uint8_t *fields );
+ps4_button_t ps4_parse_packet_buttons( const uint8_t *fields );
 ps4_event_t ps4_parse_event( ps4_t prev, ps4_t cur );
+static void ps4_parse_notify( const ps4_t *prev_ps4 );
+static int16_t ps4_parse_int16( const uint8_t *bytes );
+static void ps4_parse_report_timing();
 
 
 /********************************************************************************/
@@ -79,6 +73,9 @@ ps4_event_t ps4_parse_event( ps4_t prev, ps4_t cur );
 
 static ps4_t ps4;
 static ps4_event_callback_t ps4_event_cb = NULL;
+static ps4_report_stats_t ps4_report_stats;
+static bool ps4_crc_check = false;
+static int64_t ps4_report_last_time = 0;
 
 
 /********************************************************************************/
@@ -89,19 +86,173 @@ void ps4_parser_set_event_cb( ps4_event_callback_t cb )
     ps4_event_cb = cb;
 }
 
-void ps4_parse_packet( uint8_t *packet)
+/*******************************************************************************
+**
+** Function         ps4_parse_report_type
+**
+** Description      Validates the HID header, report ID and length of an
+**                  incoming report against the channel it arrived on, and
+**                  determines which decoder it must be routed to. Every
+**                  report is counted in the report statistics.
+**
+**                  Nothing past len is ever read, whatever the content of
+**                  the report, as it comes from a link we don't control.
+**
+**
+** Returns          enum ps4_report_type
+**
+*******************************************************************************/
+enum ps4_report_type ps4_parse_report_type( uint8_t channel, const uint8_t *report, uint16_t len )
+{
+    ps4_report_stats.received++;
+    PS4_METRIC_INC(reports_received);
+
+    if (report == NULL || len < 1) {
+        ps4_report_stats.rejected_length++;
+        return ps4_report_type_rejected;
+    }
+
+    uint8_t header = report[ps4_report_prefix_header];
+
+    if (channel == ps4_report_channel_control) {
+        if ((header & ps4_hid_header_type_mask) == ps4_hid_header_type_handshake) {
+            ps4_report_stats.handshake++;
+            return ps4_report_type_handshake;
+        }
+
+        if (header == ps4_hid_header_feature) {
+            ps4_report_stats.feature++;
+            return ps4_report_type_feature;
+        }
+
+        ps4_report_stats.rejected_channel++;
+        return ps4_report_type_rejected;
+    }
+
+    if (header != ps4_hid_header_input) {
+        ps4_report_stats.rejected_header++;
+        return ps4_report_type_rejected;
+    }
+
+    if (len <= ps4_report_prefix_id) {
+        ps4_report_stats.rejected_length++;
+        return ps4_report_type_rejected;
+    }
+
+    switch (report[ps4_report_prefix_id]) {
+    case ps4_report_id_short:
+        if (len < ps4_report_prefix_short + ps4_report_fields_length_short) break;
+        ps4_report_stats.parsed_short++;
+        PS4_METRIC_INC(reports_short);
+        ps4_parse_report_timing();
+        return ps4_report_type_short;
+
+    case ps4_report_id_full:
+        if (len < ps4_report_prefix_full + ps4_report_fields_length_full) break;
+
+        if (ps4_crc_check) {
+            if (len < ps4_report_crc_full + ps4_report_crc_length) break;
+
+            const uint8_t *crc = &report[ps4_report_crc_full];
+            uint32_t expected = (uint32_t)crc[0]
+                              | (uint32_t)crc[1] << 8
+                              | (uint32_t)crc[2] << 16
+                              | (uint32_t)crc[3] << 24;
+
+            if (ps4Crc32(0, report, ps4_report_crc_full) != expected) {
+                ps4_report_stats.rejected_crc++;
+                return ps4_report_type_rejected;
+            }
+        }
+
+        ps4_report_stats.parsed_full++;
+        PS4_METRIC_INC(reports_full);
+        ps4_parse_report_timing();
+        return ps4_report_type_full;
+
+    default:
+        ps4_report_stats.rejected_id++;
+        PS4_METRIC_INC(reports_unknown_id);
+        return ps4_report_type_rejected;
+    }
+
+    ps4_report_stats.rejected_length++;
+    return ps4_report_type_rejected;
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4_parse_packet_short
+**
+** Description      Decodes a short 0x01 report, which only carries the
+**                  buttons, sticks and triggers. The length must have been
+**                  validated by ps4_parse_report_type.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4_parse_packet_short( const uint8_t *report )
 {
     ps4_t prev_ps4 = ps4;
+    const uint8_t *fields = report + ps4_report_prefix_short;
 
-    ps4.button        = ps4_parse_packet_buttons(packet);
-    ps4.analog.stick  = ps4_parse_packet_analog_stick(packet);
-    ps4.analog.button = ps4_parse_packet_analog_button(packet);
-    ps4.sensor        = ps4_parse_packet_sensor(packet);
-    ps4.status        = ps4_parse_packet_status(packet);
+    ps4.button        = ps4_parse_packet_buttons(fields);
+    ps4.analog.stick  = ps4_parse_packet_analog_stick(fields);
+    ps4.analog.button = ps4_parse_packet_analog_button(fields);
 
-    ps4_event_t ps4_event = ps4_parse_event( prev_ps4, ps4 );
-    
-    ps4_packet_event( ps4, ps4_event );
+    ps4_parse_notify( &prev_ps4 );
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4_parse_packet_full
+**
+** Description      Decodes a full 0x11 report. The motion sensors and status
+**                  are only decoded when someone is interested in them. The
+**                  length must have been validated by ps4_parse_report_type.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4_parse_packet_full( const uint8_t *report, const ps4_interest_t *wanted )
+{
+    ps4_t prev_ps4 = ps4;
+    const uint8_t *fields = report + ps4_report_prefix_full;
+
+    ps4.button        = ps4_parse_packet_buttons(fields);
+    ps4.analog.stick  = ps4_parse_packet_analog_stick(fields);
+    ps4.analog.button = ps4_parse_packet_analog_button(fields);
+
+    if (wanted->sensor) {
+        ps4.sensor    = ps4_parse_packet_sensor(fields);
+    }
+
+    if (wanted->status) {
+        ps4.status    = ps4_parse_packet_status(fields);
+    }
+
+    ps4_parse_notify( &prev_ps4 );
+}
+
+
+void ps4_parse_get_stats( ps4_report_stats_t *stats )
+{
+    *stats = ps4_report_stats;
+}
+
+/* Smoothed time between input reports, 0 until two have arrived */
+uint32_t ps4_parse_get_interval()
+{
+    return ps4_report_stats.interval_us;
+}
+
+void ps4_parse_set_crc_check( bool enabled )
+{
+    ps4_crc_check = enabled;
 }
 
 
@@ -109,9 +260,50 @@ void ps4_parse_packet( uint8_t *packet)
 /*                      L O C A L    F U N C T I O N S                          */
 /********************************************************************************/
 
+/********************/
+/*    T I M I N G   */
+/********************/
+
+/* Gaps longer than this are pauses in the link rather than report intervals */
+#define PS4_REPORT_INTERVAL_MAX_US 1000000
+
+static void ps4_parse_report_timing()
+{
+    int64_t now = esp_timer_get_time();
+    int64_t interval = now - ps4_report_last_time;
+
+    ps4_report_last_time = now;
+
+    if (interval <= 0 || interval > PS4_REPORT_INTERVAL_MAX_US) {
+        return;
+    }
+
+    // Moving averages over roughly the last 8 reports
+    if (ps4_report_stats.interval_us == 0) {
+        ps4_report_stats.interval_us = interval;
+    } else {
+        int32_t deviation = (int32_t)interval - (int32_t)ps4_report_stats.interval_us;
+
+        if (deviation < 0) {
+            deviation = -deviation;
+        }
+
+        ps4_report_stats.jitter_us += (deviation - (int32_t)ps4_report_stats.jitter_us) / 8;
+        ps4_report_stats.interval_us += ((int32_t)interval - (int32_t)ps4_report_stats.interval_us) / 8;
+    }
+}
+
 /******************/
 /*    E V E N T   */
 /******************/
+static void ps4_parse_notify( const ps4_t *prev_ps4 )
+{
+    ps4_event_t ps4_event = ps4_parse_event( *prev_ps4, ps4 );
+    ps4_interest_t ps4_changed = ps4_parse_changes( *prev_ps4, ps4, ps4_event );
+
+    ps4_packet_event( &ps4, &ps4_event, &ps4_changed );
+}
+
 ps4_event_t ps4_parse_event( ps4_t prev, ps4_t cur )
 {
     ps4_event_t ps4_event;
@@ -176,29 +368,60 @@ ps4_event_t ps4_parse_event( ps4_t prev, ps4_t cur )
     return ps4_event;
 }
 
+/**********************/
+/*    C H A N G E S   */
+/**********************/
+ps4_interest_t ps4_parse_changes( ps4_t prev, ps4_t cur, ps4_event_t event )
+{
+    ps4_interest_t changed = {0};
+
+    /* Buttons only count as changed on an edge */
+    changed.button = ps4ButtonMask( &event.button_down )
+                   | ps4ButtonMask( &event.button_up );
+
+    if (event.analog_changed.stick.lx)  changed.analog |= ps4_interest_analog_stick_lx;
+    if (event.analog_changed.stick.ly)  changed.analog |= ps4_interest_analog_stick_ly;
+    if (event.analog_changed.stick.rx)  changed.analog |= ps4_interest_analog_stick_rx;
+    if (event.analog_changed.stick.ry)  changed.analog |= ps4_interest_analog_stick_ry;
+    if (event.analog_changed.button.l2) changed.analog |= ps4_interest_analog_button_l2;
+    if (event.analog_changed.button.r2) changed.analog |= ps4_interest_analog_button_r2;
+
+    if (cur.sensor.accelerometer.x != prev.sensor.accelerometer.x) changed.sensor |= ps4_interest_sensor_accelerometer_x;
+    if (cur.sensor.accelerometer.y != prev.sensor.accelerometer.y) changed.sensor |= ps4_interest_sensor_accelerometer_y;
+    if (cur.sensor.accelerometer.z != prev.sensor.accelerometer.z) changed.sensor |= ps4_interest_sensor_accelerometer_z;
+    if (cur.sensor.gyroscope.z     != prev.sensor.gyroscope.z)     changed.sensor |= ps4_interest_sensor_gyroscope_z;
+
+    if (cur.status.battery    != prev.status.battery)    changed.status |= ps4_interest_status_battery;
+    if (cur.status.connection != prev.status.connection) changed.status |= ps4_interest_status_connection;
+    if (cur.status.charging   != prev.status.charging)   changed.status |= ps4_interest_status_charging;
+    if (cur.status.rumbling   != prev.status.rumbling)   changed.status |= ps4_interest_status_rumbling;
+
+    return changed;
+}
+
 /********************/
 /*    A N A L O G   */
 /********************/
-ps4_analog_stick_t ps4_parse_packet_analog_stick( uint8_t *packet )
+ps4_analog_stick_t ps4_parse_packet_analog_stick( const uint8_t *fields )
 {
     ps4_analog_stick_t ps4_analog_stick;
 
     const uint8_t int_offset = 0x80;
 
-    ps4_analog_stick.lx = (int16_t)packet[ps4_packet_index_analog_stick_lx] - int_offset;
-    ps4_analog_stick.ly = (int16_t)packet[ps4_packet_index_analog_stick_ly] - int_offset;
-    ps4_analog_stick.rx = (int16_t)packet[ps4_packet_index_analog_stick_rx] - int_offset;
-    ps4_analog_stick.ry = (int16_t)packet[ps4_packet_index_analog_stick_ry] - int_offset;
+    ps4_analog_stick.lx = (int16_t)fields[ps4_report_index_analog_stick_lx] - int_offset;
+    ps4_analog_stick.ly = (int16_t)fields[ps4_report_index_analog_stick_ly] - int_offset;
+    ps4_analog_stick.rx = (int16_t)fields[ps4_report_index_analog_stick_rx] - int_offset;
+    ps4_analog_stick.ry = (int16_t)fields[ps4_report_index_analog_stick_ry] - int_offset;
 
     return ps4_analog_stick;
 }
 
-ps4_analog_button_t ps4_parse_packet_analog_button( uint8_t *packet )
+ps4_analog_button_t ps4_parse_packet_analog_button( const uint8_t *fields )
 {
     ps4_analog_button_t ps4_analog_button;
 
-    ps4_analog_button.l2       = packet[ps4_packet_index_analog_button_l2];
-    ps4_analog_button.r2       = packet[ps4_packet_index_analog_button_r2];
+    ps4_analog_button.l2       = fields[ps4_report_index_analog_button_l2];
+    ps4_analog_button.r2       = fields[ps4_report_index_analog_button_r2];
 
     return ps4_analog_button;
 }
@@ -207,10 +430,15 @@ ps4_analog_button_t ps4_parse_packet_analog_button( uint8_t *packet )
 /*   B U T T O N S   */
 /*********************/
 
-ps4_button_t ps4_parse_packet_buttons( uint8_t *packet )
+ps4_button_t ps4_parse_packet_buttons( const uint8_t *fields )
 {
     ps4_button_t ps4_button;
-    uint32_t ps4_buttons_raw = *((uint32_t*)&packet[ps4_packet_index_buttons_raw]);
+    const uint8_t *buttons = &fields[ps4_report_index_buttons];
+
+    /* Assembled bytewise, the buttons are not aligned in the report */
+    uint32_t ps4_buttons_raw = (uint32_t)buttons[0]
+                             | (uint32_t)buttons[1] << 8
+                             | (uint32_t)buttons[2] << 16;
 
     uint8_t direct         = (uint8_t)(ps4_buttons_raw & ps4_button_mask_direct);
     switch (direct)
@@ -295,14 +523,22 @@ ps4_button_t ps4_parse_packet_buttons( uint8_t *packet )
 /*******************************/
 /*   S T A T U S   F L A G S   */
 /*******************************/
-ps4_status_t ps4_parse_packet_status( uint8_t *packet )
+ps4_status_t ps4_parse_packet_status( const uint8_t *fields )
 {
-    ps4_status_t ps4_status;
+    ps4_status_t ps4_status = {0};
+
+    uint8_t status = fields[ps4_report_index_status];
+    uint8_t level  = status & ps4_status_mask_battery;
 
-    // ps4_status.battery    =  packet[ps4_packet_index_status+1];
-    // ps4_status.charging   =  ps4_status.battery == ps4_status_battery_charging;
-    // ps4_status.connection = (packet[ps4_packet_index_status+2] & ps4_status_mask_bluetooth) ? ps4_status_connection_bluetooth : ps4_status_connection_usb;
-    // ps4_status.rumbling   = (packet[ps4_packet_index_status+2] & ps4_status_mask_rumbling) ? false: true;
+    ps4_status.connection = ps4_status_connection_bluetooth;
+    ps4_status.charging   = (status & ps4_status_mask_cable) && level <= ps4_status_level_max;
+
+    if      (ps4_status.charging)                ps4_status.battery = ps4_status_battery_charging;
+    else if (level >= ps4_status_level_full)     ps4_status.battery = ps4_status_battery_full;
+    else if (level >= ps4_status_level_high)     ps4_status.battery = ps4_status_battery_high;
+    else if (level >= ps4_status_level_low)      ps4_status.battery = ps4_status_battery_low;
+    else if (level >= ps4_status_level_dying)    ps4_status.battery = ps4_status_battery_dying;
+    else                                         ps4_status.battery = ps4_status_battery_shutdown;
 
     return ps4_status;
 }
@@ -310,17 +546,19 @@ ps4_status_t ps4_parse_packet_status( uint8_t *packet )
 /********************/
 /*   S E N S O R S  */
 /********************/
-ps4_sensor_t ps4_parse_packet_sensor( uint8_t *packet )
+ps4_sensor_t ps4_parse_packet_sensor( const uint8_t *fields )
 {
-    ps4_sensor_t ps4_sensor;
-
-    const uint16_t int_offset = 0x200;
+    ps4_sensor_t ps4_sensor = {0};
 
-    // ps4_sensor.accelerometer.x = (packet[ps4_packet_index_sensor_accelerometer_x] << 8) + packet[ps4_packet_index_sensor_accelerometer_x+1] - int_offset;
-    // ps4_sensor.accelerometer.y = (packet[ps4_packet_index_sensor_accelerometer_y] << 8) + packet[ps4_packet_index_sensor_accelerometer_y+1] - int_offset;
-    // ps4_sensor.accelerometer.z = (packet[ps4_packet_index_sensor_accelerometer_z] << 8) + packet[ps4_packet_index_sensor_accelerometer_z+1] - int_offset;
-    // ps4_sensor.gyroscope.z     = (packet[ps4_packet_index_sensor_gyroscope_z]     << 8) + packet[ps4_packet_index_sensor_gyroscope_z+1]     - int_offset;
+    ps4_sensor.accelerometer.x = ps4_parse_int16( &fields[ps4_report_index_sensor_accelerometer_x] );
+    ps4_sensor.accelerometer.y = ps4_parse_int16( &fields[ps4_report_index_sensor_accelerometer_y] );
+    ps4_sensor.accelerometer.z = ps4_parse_int16( &fields[ps4_report_index_sensor_accelerometer_z] );
+    ps4_sensor.gyroscope.z     = ps4_parse_int16( &fields[ps4_report_index_sensor_gyroscope_z] );
 
     return ps4_sensor;
+}
 
+static int16_t ps4_parse_int16( const uint8_t *bytes )
+{
+    return (int16_t)((uint16_t)bytes[0] | (uint16_t)bytes[1] << 8);
 }
@@ -0,0 +1,378 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "include/ps4.h"
+#include "include/ps4_int.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#define  PS4_TAG "PS4_RUMBLE"
+
+
+/********************************************************************************/
+/*                            L O C A L    T Y P E S                            */
+/********************************************************************************/
+
+enum ps4_rumble_track_index {
+    ps4_rumble_track_heavy,
+    ps4_rumble_track_light,
+    ps4_rumble_track_count
+};
+
+/* Precomputed step of a single motor */
+typedef struct {
+    uint16_t duration_ms;
+    uint8_t level;
+} ps4_rumble_level_t;
+
+typedef struct {
+    ps4_rumble_level_t steps[PS4_RUMBLE_MAX_STEPS];
+    uint8_t count;
+} ps4_rumble_table_t;
+
+/* Playback of a step table on one motor */
+typedef struct {
+    ps4_rumble_table_t table;
+    uint8_t index;
+    uint8_t repeat;
+    uint8_t priority;
+    bool active;
+    int64_t step_end;
+} ps4_rumble_track_t;
+
+
+/********************************************************************************/
+/*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
+/********************************************************************************/
+
+static bool ps4_rumble_start( uint8_t motors, const ps4_rumble_table_t *tables, uint8_t repeat, uint8_t priority );
+static void ps4_rumble_tick( void *arg );
+static void ps4_rumble_envelope( ps4_rumble_table_t *table, const ps4_rumble_envelope_t *envelope, uint8_t peak, uint16_t pause_ms );
+static void ps4_rumble_ramp( ps4_rumble_table_t *table, uint8_t from, uint8_t to, uint16_t duration_ms );
+static void ps4_rumble_append( ps4_rumble_table_t *table, uint16_t duration_ms, uint8_t level );
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+static ps4_rumble_track_t ps4_rumble_tracks[ps4_rumble_track_count];
+static ps4_rumble_stats_t ps4_rumble_stats;
+static portMUX_TYPE ps4_rumble_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static esp_timer_handle_t ps4_rumble_timer = NULL;
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ps4RumblePlay
+**
+** Description      Plays a rumble effect on the motors with a non-zero peak
+**                  intensity. The envelope is precomputed into a table of
+**                  steps per motor, and an output report is only sent on
+**                  the boundaries of those steps. Motors that are playing
+**                  an effect of a higher priority are left alone.
+**
+**
+** Returns          bool, whether the effect replaced the effect on any motor
+**
+*******************************************************************************/
+bool ps4RumblePlay( const ps4_rumble_effect_t *effect )
+{
+    ps4_rumble_table_t tables[ps4_rumble_track_count] = {0};
+    uint8_t motors = 0;
+
+    if (effect->heavy) {
+        ps4_rumble_envelope( &tables[ps4_rumble_track_heavy], &effect->envelope, effect->heavy, effect->pause_ms );
+        motors |= ps4_rumble_motor_heavy;
+    }
+
+    if (effect->light) {
+        ps4_rumble_envelope( &tables[ps4_rumble_track_light], &effect->envelope, effect->light, effect->pause_ms );
+        motors |= ps4_rumble_motor_light;
+    }
+
+    return ps4_rumble_start( motors, tables, effect->repeat, effect->priority );
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4RumblePlaySteps
+**
+** Description      Plays a pattern of fixed intensity steps on the given
+**                  motors, repeat times or until stopped when 0. Steps
+**                  beyond PS4_RUMBLE_MAX_STEPS are ignored.
+**
+**
+** Returns          bool, whether the pattern replaced the effect on any motor
+**
+*******************************************************************************/
+bool ps4RumblePlaySteps( uint8_t motors, const ps4_rumble_step_t *steps, uint8_t count, uint8_t repeat, uint8_t priority )
+{
+    ps4_rumble_table_t tables[ps4_rumble_track_count] = {0};
+
+    for (uint8_t i = 0; i < count; i++) {
+        ps4_rumble_append( &tables[ps4_rumble_track_heavy], steps[i].duration_ms, steps[i].heavy );
+        ps4_rumble_append( &tables[ps4_rumble_track_light], steps[i].duration_ms, steps[i].light );
+    }
+
+    return ps4_rumble_start( motors, tables, repeat, priority );
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4RumbleStop
+**
+** Description      Stops the effects playing on the given motors, whatever
+**                  their priority.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4RumbleStop( uint8_t motors )
+{
+    ps4_rumble_table_t tables[ps4_rumble_track_count] = {0};
+
+    ps4_rumble_start( motors, tables, 1, UINT8_MAX );
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4RumbleGetStats
+**
+** Description      Copies the counters of played and rejected effects, of
+**                  the steps played back and the motor changes passed on
+**                  to the output mixer.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4RumbleGetStats( ps4_rumble_stats_t *stats )
+{
+    portENTER_CRITICAL(&ps4_rumble_lock);
+    *stats = ps4_rumble_stats;
+    portEXIT_CRITICAL(&ps4_rumble_lock);
+}
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+/* Creates the playback timer up front, from ps4Init, so that starting an effect
+ * never allocates */
+void ps4_rumble_init()
+{
+    if (ps4_rumble_timer == NULL) {
+        esp_timer_create_args_t args = {
+            .callback = &ps4_rumble_tick,
+            .name = "ps4_rumble"
+        };
+
+        esp_err_t ret = esp_timer_create(&args, &ps4_rumble_timer);
+        ps4_alloc_count( ps4_alloc_kind_library, ret == ESP_OK, 0 );
+
+        if (ret != ESP_OK) {
+            ESP_LOGE(PS4_TAG, "[%s] creating the playback timer failed", __func__);
+        }
+    }
+}
+
+
+/* Replaces the tracks of the motors with the tables. Empty tables stop
+ * the motor, and are accepted whatever the priority of the track */
+static bool ps4_rumble_start( uint8_t motors, const ps4_rumble_table_t *tables, uint8_t repeat, uint8_t priority )
+{
+    int64_t now = esp_timer_get_time();
+    bool accepted = false;
+
+    ps4_rumble_init();
+
+    if (ps4_rumble_timer == NULL) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&ps4_rumble_lock);
+
+    for (uint8_t i = 0; i < ps4_rumble_track_count; i++) {
+        ps4_rumble_track_t *track = &ps4_rumble_tracks[i];
+
+        if (!(motors & (1 << i))) {
+            continue;
+        }
+
+        if (track->active && track->priority > priority && tables[i].count > 0) {
+            continue;
+        }
+
+        track->table = tables[i];
+        track->index = 0;
+        track->repeat = repeat;
+        track->priority = priority;
+        track->active = tables[i].count > 0;
+        track->step_end = now + (int64_t)tables[i].steps[0].duration_ms * 1000;
+
+        accepted = true;
+    }
+
+    if (accepted) {
+        ps4_rumble_stats.played++;
+    } else {
+        ps4_rumble_stats.rejected++;
+    }
+
+    portEXIT_CRITICAL(&ps4_rumble_lock);
+
+    // Applies the first step right away, whenever the next
+    // boundary of the tracks that were already playing is.
+    // A tick running meanwhile may rearm the timer between the
+    // stop and the start, which then fails: stopping it again
+    // cancels that, and the tick can't run again to rearm it
+    if (accepted) {
+        esp_timer_stop( ps4_rumble_timer );
+
+        if (esp_timer_start_once( ps4_rumble_timer, 0 ) != ESP_OK) {
+            esp_timer_stop( ps4_rumble_timer );
+            esp_timer_start_once( ps4_rumble_timer, 0 );
+        }
+    }
+
+    return accepted;
+}
+
+
+static void ps4_rumble_tick( void *arg )
+{
+    int64_t now = esp_timer_get_time();
+    int64_t next = INT64_MAX;
+    uint8_t levels[ps4_rumble_track_count] = {0};
+    uint32_t steps = 0;
+
+    portENTER_CRITICAL(&ps4_rumble_lock);
+
+    for (uint8_t i = 0; i < ps4_rumble_track_count; i++) {
+        ps4_rumble_track_t *track = &ps4_rumble_tracks[i];
+
+        // Catches up with every boundary that has passed, in case
+        // the timer ran late
+        while (track->active && now >= track->step_end) {
+            steps++;
+
+            if (++track->index == track->table.count) {
+                track->index = 0;
+
+                if (track->repeat == 1) {
+                    track->active = false;
+                    break;
+                }
+
+                if (track->repeat > 1) {
+                    track->repeat--;
+                }
+            }
+
+            track->step_end += (int64_t)track->table.steps[track->index].duration_ms * 1000;
+        }
+
+        if (track->active) {
+            levels[i] = track->table.steps[track->index].level;
+
+            if (track->step_end < next) {
+                next = track->step_end;
+            }
+        }
+    }
+
+    ps4_rumble_stats.steps += steps;
+
+    // Set while still holding the lock, so that a newer effect can't be
+    // overwritten by the levels of the one it replaced
+    ps4_cmd_t cmd = {0};
+    ps4_mixer_get( ps4_mixer_channel_rumble, &cmd );
+
+    if (cmd.rumble_left_intensity != levels[ps4_rumble_track_heavy] ||
+        cmd.rumble_right_intensity != levels[ps4_rumble_track_light]) {
+        cmd.rumble_left_intensity = levels[ps4_rumble_track_heavy];
+        cmd.rumble_right_intensity = levels[ps4_rumble_track_light];
+
+        ps4_mixer_update( ps4_mixer_channel_rumble, &cmd, ps4_mixer_field_rumble, 0 );
+        ps4_rumble_stats.sent++;
+    }
+
+    portEXIT_CRITICAL(&ps4_rumble_lock);
+
+    ps4_mixer_flush();
+
+    if (next != INT64_MAX) {
+        esp_timer_start_once( ps4_rumble_timer, next > now ? next - now : 0 );
+    }
+}
+
+
+static void ps4_rumble_envelope( ps4_rumble_table_t *table, const ps4_rumble_envelope_t *envelope, uint8_t peak, uint16_t pause_ms )
+{
+    uint8_t sustain = (uint16_t)envelope->sustain * peak / UINT8_MAX;
+
+    ps4_rumble_ramp( table, 0, peak, envelope->attack_ms );
+    ps4_rumble_ramp( table, peak, sustain, envelope->decay_ms );
+    ps4_rumble_append( table, envelope->sustain_ms, sustain );
+    ps4_rumble_ramp( table, sustain, 0, envelope->release_ms );
+    ps4_rumble_append( table, pause_ms, 0 );
+}
+
+
+/* Approximates a linear ramp with steps of at least the ramp step, taking
+ * the level halfway each step */
+static void ps4_rumble_ramp( ps4_rumble_table_t *table, uint8_t from, uint8_t to, uint16_t duration_ms )
+{
+    uint16_t count = (duration_ms + PS4_RUMBLE_RAMP_STEP_MS - 1) / PS4_RUMBLE_RAMP_STEP_MS;
+    uint16_t elapsed = 0;
+
+    if (count > PS4_RUMBLE_RAMP_STEPS) {
+        count = PS4_RUMBLE_RAMP_STEPS;
+    }
+
+    for (uint16_t i = 1; i <= count; i++) {
+        uint16_t end = (uint32_t)duration_ms * i / count;
+        int32_t level = from + ((int32_t)to - from) * (2 * i - 1) / (2 * count);
+
+        ps4_rumble_append( table, end - elapsed, level );
+        elapsed = end;
+    }
+}
+
+
+/* Appends a step, merging it with the last one when the level is the same */
+static void ps4_rumble_append( ps4_rumble_table_t *table, uint16_t duration_ms, uint8_t level )
+{
+    if (duration_ms == 0) {
+        return;
+    }
+
+    if (table->count > 0) {
+        ps4_rumble_level_t *last = &table->steps[table->count - 1];
+
+        if (last->level == level && last->duration_ms <= UINT16_MAX - duration_ms) {
+            last->duration_ms += duration_ms;
+            return;
+        }
+    }
+
+    if (table->count == PS4_RUMBLE_MAX_STEPS) {
+        return;
+    }
+
+    table->steps[table->count].duration_ms = duration_ms;
+    table->steps[table->count].level = level;
+    table->count++;
+}
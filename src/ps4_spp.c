@@ -19,6 +19,9 @@
 #define PS4_DEVICE_NAME "PS4 Host"
 #define PS4_SERVER_NAME "PS4_SERVER"
 
+/* Left out in favour of ps4_gap.c */
+#ifndef PS4_GAP_ONLY
+
 /********************************************************************************/
 /*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
 /********************************************************************************/
@@ -130,7 +133,8 @@ void ps4_spp_deinit()
 ** Function         ps4_spp_callback
 **
 ** Description      Callback for SPP events, only used for the init event to
-**                  configure the SPP server
+**                  configure the SPP server, and the start event to know
+**                  it is running
 **
 ** Returns          void
 **
@@ -149,4 +153,10 @@ static void ps4_spp_callback(esp_spp_cb_event_t event, esp_spp_cb_param_t *param
 
         esp_spp_start_srv(ESP_SPP_SEC_NONE,ESP_SPP_ROLE_SLAVE, 0, PS4_SERVER_NAME);
     }
+
+    if (event == ESP_SPP_START_EVT) {
+        ps4_init_done();
+    }
 }
+
+#endif
@@ -0,0 +1,180 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <esp_system.h>
+#include "include/ps4.h"
+#include "include/ps4_int.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+
+#define  PS4_TAG "PS4_STACK"
+
+/* Byte FreeRTOS fills new stacks with, which its high water mark looks for */
+#define PS4_STACK_FILL 0xa5
+
+/* Stack left alone below the dispatching frame while filling, for the
+ * frames of the filling itself and register spills */
+#define PS4_STACK_MARGIN 256
+
+/* Bottom of the stack left alone, as it may be watched for overflows */
+#define PS4_STACK_BOTTOM 32
+
+
+/********************************************************************************/
+/*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
+/********************************************************************************/
+
+static void ps4_stack_record( uint32_t left, uint32_t used );
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+static ps4_stack_stats_t ps4_stack_stats = {
+    .stack_free_min = UINT32_MAX
+};
+
+static uint16_t ps4_stack_guard = PS4_STACK_GUARD_BYTES;
+static portMUX_TYPE ps4_stack_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* Measurement in progress, only touched from the dispatching task */
+static uint32_t ps4_stack_reports = 0;
+static uint8_t *ps4_stack_base = NULL;
+static uint8_t *ps4_stack_top = NULL;
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ps4SetStackGuard
+**
+** Description      Warns when less than min_free bytes of stack were left on
+**                  the task reports are dispatched on, which is the stack
+**                  the callbacks run on. 0 disables the warning.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4SetStackGuard( uint16_t min_free )
+{
+    ps4_stack_guard = min_free;
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4GetStackStats
+**
+** Description      Copies the least stack left on the task reports are
+**                  dispatched on, the most stack the report callbacks used,
+**                  the allocations the library counted, as ps4GetAllocStats
+**                  copies them, and the least heap left.
+**                  The stack is measured on one report out of
+**                  PS4_STACK_SAMPLE_REPORTS.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4GetStackStats( ps4_stack_stats_t *stats )
+{
+    portENTER_CRITICAL(&ps4_stack_lock);
+    *stats = ps4_stack_stats;
+    portEXIT_CRITICAL(&ps4_stack_lock);
+
+    ps4GetAllocStats( &stats->heap );
+    stats->heap_free_min = esp_get_minimum_free_heap_size();
+}
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+/* Starts measuring the stack the dispatch of a report uses, on a sample of
+ * the reports. The unused stack is filled again, so that the deepest point
+ * reached is found afterwards, as the high water mark of FreeRTOS would be */
+void ps4_stack_enter()
+{
+    if (++ps4_stack_reports % PS4_STACK_SAMPLE_REPORTS != 0) {
+        return;
+    }
+
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    uint8_t *base = pxTaskGetStackStart( task );
+    uint8_t *top = (uint8_t*)__builtin_frame_address(0) - PS4_STACK_MARGIN;
+
+    if (ps4_stack_stats.task[0] == '\0') {
+        strncpy( ps4_stack_stats.task, pcTaskGetTaskName( task ), sizeof(ps4_stack_stats.task) - 1 );
+    }
+
+    // Deepest point since the previous sample, in bytes with ESP-IDF.
+    // The fill below keeps the high water mark working
+    ps4_stack_record( uxTaskGetStackHighWaterMark( task ), 0 );
+
+    if (base == NULL || top <= base + PS4_STACK_BOTTOM) {
+        return;
+    }
+
+    memset( base + PS4_STACK_BOTTOM, PS4_STACK_FILL, top - base - PS4_STACK_BOTTOM );
+
+    ps4_stack_base = base;
+    ps4_stack_top = top;
+}
+
+
+/* Finds the deepest point the dispatch reached */
+void ps4_stack_leave()
+{
+    uint8_t *deepest;
+
+    if (ps4_stack_base == NULL) {
+        return;
+    }
+
+    for (deepest = ps4_stack_base + PS4_STACK_BOTTOM; deepest < ps4_stack_top && *deepest == PS4_STACK_FILL; deepest++) {
+    }
+
+    ps4_stack_record( deepest - ps4_stack_base, ps4_stack_top + PS4_STACK_MARGIN - deepest );
+
+    ps4_stack_base = NULL;
+}
+
+
+/* Keeps the least stack left and the most used by the callbacks, and warns
+ * when the stack left got below the guard */
+static void ps4_stack_record( uint32_t left, uint32_t used )
+{
+    bool warn = false;
+
+    portENTER_CRITICAL(&ps4_stack_lock);
+
+    if (used > 0) {
+        ps4_stack_stats.samples++;
+    }
+
+    if (used > ps4_stack_stats.callback_stack_max) {
+        ps4_stack_stats.callback_stack_max = used;
+    }
+
+    if (left < ps4_stack_stats.stack_free_min) {
+        ps4_stack_stats.stack_free_min = left;
+        warn = left < ps4_stack_guard;
+    }
+
+    if (warn) {
+        ps4_stack_stats.guard_warnings++;
+    }
+
+    portEXIT_CRITICAL(&ps4_stack_lock);
+
+    if (warn) {
+        ESP_LOGW(PS4_TAG, "[%s] only %u bytes of stack left on %s", __func__, (unsigned)left, ps4_stack_stats.task );
+    }
+}
@@ -0,0 +1,395 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "include/ps4.h"
+#include "include/ps4_int.h"
+#include "freertos/FreeRTOS.h"
+#include "nvs.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#define  PS4_TAG "PS4_STORAGE"
+
+#define PS4_STORAGE_NAMESPACE "ps4"
+#define PS4_STORAGE_KEY       "controllers"
+
+/* Changed whenever the layout of the stored table changes */
+#define PS4_STORAGE_VERSION   2
+
+
+/********************************************************************************/
+/*                            L O C A L    T Y P E S                            */
+/********************************************************************************/
+
+typedef struct {
+    uint8_t version;
+    uint8_t count;
+    uint32_t sequence;
+    ps4_controller_record_t records[PS4_CONTROLLER_TABLE_SIZE];
+} ps4_storage_table_t;
+
+
+/********************************************************************************/
+/*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
+/********************************************************************************/
+
+static bool ps4_storage_nvs_load( void *object, const char *key, void *data, size_t len );
+static bool ps4_storage_nvs_save( void *object, const char *key, const void *data, size_t len );
+static void ps4_storage_load();
+static void ps4_storage_save();
+static void ps4_storage_save_later();
+static void ps4_storage_saved( void *arg );
+static ps4_controller_record_t* ps4_storage_find( const uint8_t *address );
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+static ps4_storage_t ps4_storage = {
+    .load = &ps4_storage_nvs_load,
+    .save = &ps4_storage_nvs_save,
+    .object = NULL
+};
+
+static bool ps4_storage_enabled = true;
+static bool ps4_storage_loaded = false;
+
+static ps4_storage_table_t ps4_storage_table;
+static ps4_controller_record_t *ps4_storage_current = NULL;
+static uint8_t ps4_storage_interval = 0;
+static portMUX_TYPE ps4_storage_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* Saves from the Bluetooth task are left to this timer, writing to flash
+ * takes too long to hold the stack up for */
+static esp_timer_handle_t ps4_storage_timer = NULL;
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ps4SetStorage
+**
+** Description      Replaces the store the known controllers are kept in,
+**                  NVS by default, and loads them from it. NULL disables
+**                  persistence, controllers are then only remembered until
+**                  the next reset.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4SetStorage( const ps4_storage_t *storage )
+{
+    if (storage != NULL) {
+        ps4_storage = *storage;
+    }
+
+    ps4_storage_enabled = storage != NULL;
+    ps4_storage_loaded = false;
+
+    ps4_storage_init();
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4GetKnownControllers
+**
+** Description      Copies up to max of the known controllers, the most
+**                  recently connected first.
+**
+**
+** Returns          uint8_t, the number of records copied
+**
+*******************************************************************************/
+uint8_t ps4GetKnownControllers( ps4_controller_record_t *records, uint8_t max )
+{
+    uint8_t count = 0;
+
+    portENTER_CRITICAL(&ps4_storage_lock);
+
+    // Selection by recency, the table is too small to be worth sorting
+    for (uint32_t newer_than = UINT32_MAX; count < max; count++) {
+        const ps4_controller_record_t *next = NULL;
+
+        for (uint8_t i = 0; i < ps4_storage_table.count; i++) {
+            const ps4_controller_record_t *record = &ps4_storage_table.records[i];
+
+            if (record->last_used < newer_than && (next == NULL || record->last_used > next->last_used)) {
+                next = record;
+            }
+        }
+
+        if (next == NULL) {
+            break;
+        }
+
+        records[count] = *next;
+        newer_than = next->last_used;
+    }
+
+    portEXIT_CRITICAL(&ps4_storage_lock);
+
+    return count;
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4ForgetControllers
+**
+** Description      Removes all known controllers, from the store as well.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4ForgetControllers()
+{
+    portENTER_CRITICAL(&ps4_storage_lock);
+
+    memset( &ps4_storage_table, 0, sizeof(ps4_storage_table) );
+    ps4_storage_table.version = PS4_STORAGE_VERSION;
+    ps4_storage_current = NULL;
+
+    portEXIT_CRITICAL(&ps4_storage_lock);
+
+    ps4_storage_save();
+}
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+/* Loads the known controllers once, ahead of any connection, and creates
+ * the timer saving them */
+void ps4_storage_init()
+{
+    if (!ps4_storage_loaded) {
+        ps4_storage_load();
+        ps4_storage_loaded = true;
+    }
+
+    if (ps4_storage_timer == NULL) {
+        esp_timer_create_args_t args = {
+            .callback = &ps4_storage_saved,
+            .name = "ps4_storage"
+        };
+
+        esp_err_t ret = esp_timer_create(&args, &ps4_storage_timer);
+        ps4_alloc_count( ps4_alloc_kind_library, ret == ESP_OK, 0 );
+
+        if (ret != ESP_OK) {
+            ESP_LOGE(PS4_TAG, "[%s] creating the save timer failed", __func__);
+        }
+    }
+}
+
+
+/* Looks the controller up when its control channel connects. A known
+ * controller gets its report rate and lightbar back before the first
+ * input report, so that they are in the first output report. A new one
+ * replaces the least recently used record.
+ * Returns whether the controller was known */
+bool ps4_storage_connected( const uint8_t *address )
+{
+    ps4_controller_record_t *record;
+    ps4_cmd_t cmd = {0};
+    bool known;
+
+    portENTER_CRITICAL(&ps4_storage_lock);
+
+    record = ps4_storage_find( address );
+    known = record != NULL;
+
+    if (!known) {
+        if (ps4_storage_table.count < PS4_CONTROLLER_TABLE_SIZE) {
+            record = &ps4_storage_table.records[ps4_storage_table.count++];
+        } else {
+            record = &ps4_storage_table.records[0];
+
+            for (uint8_t i = 1; i < ps4_storage_table.count; i++) {
+                if (ps4_storage_table.records[i].last_used < record->last_used) {
+                    record = &ps4_storage_table.records[i];
+                }
+            }
+        }
+
+        memset( record, 0, sizeof(*record) );
+        memcpy( record->address, address, sizeof(record->address) );
+    }
+
+    record->connects++;
+    record->last_used = ++ps4_storage_table.sequence;
+    ps4_storage_current = record;
+
+    if (known) {
+        cmd.r = record->r;
+        cmd.g = record->g;
+        cmd.b = record->b;
+        cmd.flash_on = record->flash_on;
+        cmd.flash_off = record->flash_off;
+    }
+
+    uint8_t interval = record->report_interval;
+
+    portEXIT_CRITICAL(&ps4_storage_lock);
+
+    if (known) {
+        // A report rate set by the application takes precedence
+        if (ps4_output_get_interval() == ps4_storage_interval) {
+            ps4_output_set_interval( interval );
+            ps4_storage_interval = ps4_output_get_interval();
+        }
+
+        ps4_mixer_update( ps4_mixer_channel_base, &cmd, ps4_mixer_field_lightbar | ps4_mixer_field_flash, 0 );
+    } else {
+        // Saved right away, so the controller is known after a reset
+        ps4_storage_save_later();
+    }
+
+    return known;
+}
+
+
+/* Keeps the settings the controller had when it disconnected */
+void ps4_storage_disconnected()
+{
+    ps4_cmd_t cmd = {0};
+
+    ps4_mixer_get( ps4_mixer_channel_base, &cmd );
+
+    portENTER_CRITICAL(&ps4_storage_lock);
+
+    ps4_controller_record_t *record = ps4_storage_current;
+
+    if (record != NULL) {
+        record->report_interval = ps4_output_get_interval();
+        record->r = cmd.r;
+        record->g = cmd.g;
+        record->b = cmd.b;
+        record->flash_on = cmd.flash_on;
+        record->flash_off = cmd.flash_off;
+    }
+
+    ps4_storage_current = NULL;
+
+    portEXIT_CRITICAL(&ps4_storage_lock);
+
+    if (record != NULL) {
+        ps4_storage_save_later();
+    }
+}
+
+
+static void ps4_storage_load()
+{
+    ps4_storage_table_t table;
+
+    if (!ps4_storage_enabled || !ps4_storage.load( ps4_storage.object, PS4_STORAGE_KEY, &table, sizeof(table) ) ||
+        table.version != PS4_STORAGE_VERSION || table.count > PS4_CONTROLLER_TABLE_SIZE) {
+        memset( &table, 0, sizeof(table) );
+        table.version = PS4_STORAGE_VERSION;
+    }
+
+    portENTER_CRITICAL(&ps4_storage_lock);
+    ps4_storage_table = table;
+    ps4_storage_current = NULL;
+    portEXIT_CRITICAL(&ps4_storage_lock);
+
+    ESP_LOGI(PS4_TAG, "[%s] %d known controllers", __func__, table.count);
+}
+
+
+static void ps4_storage_save()
+{
+    ps4_storage_table_t table;
+
+    if (!ps4_storage_enabled) {
+        return;
+    }
+
+    portENTER_CRITICAL(&ps4_storage_lock);
+    table = ps4_storage_table;
+    portEXIT_CRITICAL(&ps4_storage_lock);
+
+    if (!ps4_storage.save( ps4_storage.object, PS4_STORAGE_KEY, &table, sizeof(table) )) {
+        ESP_LOGE(PS4_TAG, "[%s] saving the known controllers failed", __func__);
+    }
+}
+
+
+/* Saves from the timer task. A save already pending takes the latest
+ * table as it runs, so a further one isn't needed */
+static void ps4_storage_save_later()
+{
+    if (ps4_storage_timer == NULL) {
+        ESP_LOGE(PS4_TAG, "[%s] no save timer, the known controllers are not saved", __func__);
+        return;
+    }
+
+    esp_timer_start_once( ps4_storage_timer, 0 );
+}
+
+
+static void ps4_storage_saved( void *arg )
+{
+    ps4_storage_save();
+}
+
+
+/* Must be called with the lock held */
+static ps4_controller_record_t* ps4_storage_find( const uint8_t *address )
+{
+    for (uint8_t i = 0; i < ps4_storage_table.count; i++) {
+        if (memcmp( ps4_storage_table.records[i].address, address, 6 ) == 0) {
+            return &ps4_storage_table.records[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+static bool ps4_storage_nvs_load( void *object, const char *key, void *data, size_t len )
+{
+    nvs_handle_t handle;
+    size_t size = len;
+    esp_err_t ret;
+
+    if (nvs_open( PS4_STORAGE_NAMESPACE, NVS_READONLY, &handle ) != ESP_OK) {
+        return false;
+    }
+
+    ret = nvs_get_blob( handle, key, data, &size );
+    nvs_close( handle );
+
+    return ret == ESP_OK && size == len;
+}
+
+
+static bool ps4_storage_nvs_save( void *object, const char *key, const void *data, size_t len )
+{
+    nvs_handle_t handle;
+    esp_err_t ret;
+
+    if ((ret = nvs_open( PS4_STORAGE_NAMESPACE, NVS_READWRITE, &handle )) != ESP_OK) {
+        ESP_LOGE(PS4_TAG, "[%s] opening the storage failed: %s", __func__, esp_err_to_name(ret));
+        return false;
+    }
+
+    ret = nvs_set_blob( handle, key, data, len );
+
+    if (ret == ESP_OK) {
+        ret = nvs_commit( handle );
+    }
+
+    nvs_close( handle );
+
+    return ret == ESP_OK;
+}
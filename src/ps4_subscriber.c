@@ -0,0 +1,531 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "include/ps4.h"
+#include "include/ps4_int.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#define  PS4_TAG "PS4_SUBSCRIBER"
+
+
+/********************************************************************************/
+/*                            L O C A L    T Y P E S                            */
+/********************************************************************************/
+
+typedef struct {
+    ps4_subscriber_t subscriber;
+    uint8_t generation;
+    bool in_use;
+} ps4_subscriber_slot_t;
+
+typedef struct {
+    ps4_subscriber_t subscriber;
+    uint8_t index;
+    uint8_t generation;
+} ps4_subscriber_entry_t;
+
+/* Delivery state, only touched from the Bluetooth task, which dispatches
+ * the reports and reports the connection changes */
+typedef struct {
+    uint8_t generation;
+    bool pending;
+    int64_t last_delivery;
+    ps4_t ps4;
+    ps4_event_t event;
+    uint16_t batch_count;
+} ps4_subscriber_state_t;
+
+
+/********************************************************************************/
+/*              L O C A L    F U N C T I O N     P R O T O T Y P E S            */
+/********************************************************************************/
+
+static bool ps4_interest_matches( const ps4_interest_t *interest, const ps4_interest_t *changed );
+static uint8_t ps4_subscribers_snapshot( ps4_subscriber_entry_t *snapshot );
+static ps4_subscriber_state_t* ps4_subscriber_state( const ps4_subscriber_entry_t *entry, int64_t now );
+static void ps4_subscriber_deliver_latest( const ps4_subscriber_entry_t *entry, const ps4_t *ps4, const ps4_event_t *event, bool matches, int64_t now );
+static void ps4_subscriber_deliver_batched( const ps4_subscriber_entry_t *entry, const ps4_t *ps4, const ps4_event_t *event, bool matches, int64_t now );
+static void ps4_subscriber_flush( const ps4_subscriber_entry_t *entry );
+static void ps4_event_merge( ps4_event_t *merged, const ps4_event_t *event );
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+static ps4_subscriber_slot_t ps4_subscribers[PS4_MAX_SUBSCRIBERS];
+static ps4_subscriber_state_t ps4_subscriber_states[PS4_MAX_SUBSCRIBERS];
+static portMUX_TYPE ps4_subscribers_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ps4Subscribe
+**
+** Description      Registers a subscriber for PS4 controller events. The
+**                  event callback is only invoked for reports in which at
+**                  least one of the fields in its interest changed. Safe to
+**                  call from any task while reports are being received.
+**
+**
+** Returns          ps4_subscription_t, negative when the registry is full
+**
+*******************************************************************************/
+ps4_subscription_t ps4Subscribe( const ps4_subscriber_t *subscriber )
+{
+    ps4_subscription_t subscription = -1;
+
+    if (subscriber == NULL) {
+        return subscription;
+    }
+
+    portENTER_CRITICAL(&ps4_subscribers_lock);
+
+    for (uint8_t i = 0; i < PS4_MAX_SUBSCRIBERS; i++) {
+        ps4_subscriber_slot_t *slot = &ps4_subscribers[i];
+
+        if (!slot->in_use) {
+            slot->subscriber = *subscriber;
+            slot->generation++;
+            slot->in_use = true;
+
+            subscription = (slot->generation << 8) | i;
+            break;
+        }
+    }
+
+    portEXIT_CRITICAL(&ps4_subscribers_lock);
+
+    if (subscription < 0) {
+        ESP_LOGE(PS4_TAG, "[%s] no free subscriber slot", __func__);
+    }
+
+    return subscription;
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4Unsubscribe
+**
+** Description      Removes a subscriber registered with ps4Subscribe. Safe to
+**                  call from any task, including from within a callback.
+**                  A dispatch that already started may still invoke the
+**                  removed subscriber once.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4Unsubscribe( ps4_subscription_t subscription )
+{
+    if (subscription < 0) {
+        return;
+    }
+
+    uint8_t index = subscription & 0xff;
+    uint8_t generation = (subscription >> 8) & 0xff;
+
+    if (index >= PS4_MAX_SUBSCRIBERS) {
+        return;
+    }
+
+    portENTER_CRITICAL(&ps4_subscribers_lock);
+
+    ps4_subscriber_slot_t *slot = &ps4_subscribers[index];
+
+    if (slot->in_use && slot->generation == generation) {
+        slot->in_use = false;
+    }
+
+    portEXIT_CRITICAL(&ps4_subscribers_lock);
+}
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ps4_subscribers_dispatch
+**
+** Description      Forwards a parsed report to every subscriber whose
+**                  interest overlaps with the fields that changed, honouring
+**                  the delivery mode and interval of each subscriber.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4_subscribers_dispatch( const ps4_t *ps4, const ps4_event_t *event, const ps4_interest_t *changed )
+{
+    ps4_subscriber_entry_t snapshot[PS4_MAX_SUBSCRIBERS];
+    uint8_t count = ps4_subscribers_snapshot(snapshot);
+    int64_t now = esp_timer_get_time();
+
+    for (uint8_t i = 0; i < count; i++) {
+        ps4_subscriber_entry_t *entry = &snapshot[i];
+        ps4_subscriber_t *subscriber = &entry->subscriber;
+        bool matches = ps4_interest_matches(&subscriber->interest, changed);
+
+        switch (subscriber->delivery) {
+        case ps4_delivery_latest:
+            ps4_subscriber_deliver_latest( entry, ps4, event, matches, now );
+            break;
+        case ps4_delivery_batched:
+            ps4_subscriber_deliver_batched( entry, ps4, event, matches, now );
+            break;
+        default:
+            if (matches && subscriber->event_cb != NULL) {
+                subscriber->event_cb( subscriber->object, ps4, event );
+            }
+            break;
+        }
+    }
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4_subscribers_connection
+**
+** Description      Forwards a connection state change to every subscriber.
+**                  The controller streams reports for as long as it is
+**                  connected, so held back deliveries only stop being
+**                  flushed by later reports once it disconnects. They are
+**                  delivered here before the disconnection is reported.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4_subscribers_connection( uint8_t is_connected )
+{
+    ps4_subscriber_entry_t snapshot[PS4_MAX_SUBSCRIBERS];
+    uint8_t count = ps4_subscribers_snapshot(snapshot);
+
+    for (uint8_t i = 0; i < count; i++) {
+        if (!is_connected) {
+            ps4_subscriber_flush( &snapshot[i] );
+        }
+
+        ps4_subscriber_state_t *state = &ps4_subscriber_states[snapshot[i].index];
+
+        state->pending = false;
+        state->batch_count = 0;
+
+        if (snapshot[i].subscriber.connection_cb != NULL) {
+            snapshot[i].subscriber.connection_cb( snapshot[i].subscriber.object, is_connected );
+        }
+    }
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4_subscribers_raw
+**
+** Description      Hands an unparsed report to every subscriber with a raw
+**                  report callback. The report is only valid for the
+**                  duration of the callback.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4_subscribers_raw( const uint8_t *report, uint16_t len )
+{
+    ps4_subscriber_entry_t snapshot[PS4_MAX_SUBSCRIBERS];
+    uint8_t count = ps4_subscribers_snapshot(snapshot);
+
+    for (uint8_t i = 0; i < count; i++) {
+        if (snapshot[i].subscriber.raw_cb != NULL) {
+            snapshot[i].subscriber.raw_cb( snapshot[i].subscriber.object, report, len );
+        }
+    }
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4_subscribers_interest
+**
+** Description      Combines the interests of all subscribers that receive
+**                  parsed reports, to skip decoding fields nobody reads.
+**
+**
+** Returns          ps4_interest_t
+**
+*******************************************************************************/
+ps4_interest_t ps4_subscribers_interest()
+{
+    ps4_interest_t interest = {0};
+
+    portENTER_CRITICAL(&ps4_subscribers_lock);
+
+    for (uint8_t i = 0; i < PS4_MAX_SUBSCRIBERS; i++) {
+        const ps4_subscriber_t *subscriber = &ps4_subscribers[i].subscriber;
+
+        if (!ps4_subscribers[i].in_use) continue;
+        if (subscriber->event_cb == NULL && subscriber->batch_cb == NULL) continue;
+
+        interest.button |= subscriber->interest.button;
+        interest.analog |= subscriber->interest.analog;
+        interest.sensor |= subscriber->interest.sensor;
+        interest.status |= subscriber->interest.status;
+    }
+
+    portEXIT_CRITICAL(&ps4_subscribers_lock);
+
+    return interest;
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4_subscribers_snapshot
+**
+** Description      Copies the active subscribers so that callbacks can be
+**                  invoked without holding the registry lock.
+**
+**
+** Returns          uint8_t, number of subscribers copied
+**
+*******************************************************************************/
+static uint8_t ps4_subscribers_snapshot( ps4_subscriber_entry_t *snapshot )
+{
+    uint8_t count = 0;
+
+    portENTER_CRITICAL(&ps4_subscribers_lock);
+
+    for (uint8_t i = 0; i < PS4_MAX_SUBSCRIBERS; i++) {
+        if (ps4_subscribers[i].in_use) {
+            snapshot[count].subscriber = ps4_subscribers[i].subscriber;
+            snapshot[count].generation = ps4_subscribers[i].generation;
+            snapshot[count].index = i;
+            count++;
+        }
+    }
+
+    portEXIT_CRITICAL(&ps4_subscribers_lock);
+
+    return count;
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4_subscriber_state
+**
+** Description      Returns the delivery state of a subscriber, resetting it
+**                  when the slot has been taken by a new registration.
+**
+**
+** Returns          ps4_subscriber_state_t*
+**
+*******************************************************************************/
+static ps4_subscriber_state_t* ps4_subscriber_state( const ps4_subscriber_entry_t *entry, int64_t now )
+{
+    ps4_subscriber_state_t *state = &ps4_subscriber_states[entry->index];
+
+    if (state->generation != entry->generation) {
+        memset(state, 0, sizeof(*state));
+        state->generation = entry->generation;
+        state->last_delivery = now - (int64_t)entry->subscriber.interval_ms * 1000;
+    }
+
+    return state;
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4_subscriber_deliver_latest
+**
+** Description      Delivers the newest state at most once per interval. The
+**                  button edges and analog changes of the reports that were
+**                  held back are merged into the delivered event.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+static void ps4_subscriber_deliver_latest( const ps4_subscriber_entry_t *entry, const ps4_t *ps4, const ps4_event_t *event, bool matches, int64_t now )
+{
+    const ps4_subscriber_t *subscriber = &entry->subscriber;
+    ps4_subscriber_state_t *state = ps4_subscriber_state(entry, now);
+
+    if (matches) {
+        if (state->pending) {
+            ps4_event_merge(&state->event, event);
+        } else {
+            state->event = *event;
+            state->pending = true;
+        }
+
+        state->ps4 = *ps4;
+    }
+
+    if (!state->pending) return;
+    if (now - state->last_delivery < (int64_t)subscriber->interval_ms * 1000) return;
+
+    state->pending = false;
+    state->last_delivery = now;
+
+    if (subscriber->event_cb != NULL) {
+        subscriber->event_cb( subscriber->object, ps4, &state->event );
+    }
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4_subscriber_deliver_batched
+**
+** Description      Collects every report of interest into the storage of the
+**                  subscriber, and hands them over once per interval or as
+**                  soon as the storage is full.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+static void ps4_subscriber_deliver_batched( const ps4_subscriber_entry_t *entry, const ps4_t *ps4, const ps4_event_t *event, bool matches, int64_t now )
+{
+    const ps4_subscriber_t *subscriber = &entry->subscriber;
+    ps4_subscriber_state_t *state = ps4_subscriber_state(entry, now);
+
+    if (subscriber->batch == NULL || subscriber->batch_size == 0) return;
+
+    if (matches) {
+        ps4_sample_t *sample = &subscriber->batch[state->batch_count++];
+        sample->ps4 = *ps4;
+        sample->event = *event;
+    }
+
+    if (state->batch_count == 0) return;
+
+    if (state->batch_count < subscriber->batch_size
+        && now - state->last_delivery < (int64_t)subscriber->interval_ms * 1000) return;
+
+    uint16_t count = state->batch_count;
+    state->batch_count = 0;
+    state->last_delivery = now;
+
+    if (subscriber->batch_cb != NULL) {
+        subscriber->batch_cb( subscriber->object, subscriber->batch, count );
+    }
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4_subscriber_flush
+**
+** Description      Hands over whatever a subscriber has held back, without
+**                  waiting for its interval to elapse.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+static void ps4_subscriber_flush( const ps4_subscriber_entry_t *entry )
+{
+    const ps4_subscriber_t *subscriber = &entry->subscriber;
+    ps4_subscriber_state_t *state = &ps4_subscriber_states[entry->index];
+
+    // Nothing was held back for a new registration
+    if (state->generation != entry->generation) return;
+
+    if (subscriber->delivery == ps4_delivery_latest && state->pending) {
+        state->pending = false;
+
+        if (subscriber->event_cb != NULL) {
+            subscriber->event_cb( subscriber->object, &state->ps4, &state->event );
+        }
+    } else if (subscriber->delivery == ps4_delivery_batched && state->batch_count > 0) {
+        uint16_t count = state->batch_count;
+        state->batch_count = 0;
+
+        if (subscriber->batch_cb != NULL && subscriber->batch != NULL) {
+            subscriber->batch_cb( subscriber->object, subscriber->batch, count );
+        }
+    }
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4_event_merge
+**
+** Description      Accumulates an event into an event that was held back, so
+**                  no button edge is lost when reports are skipped.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+static void ps4_event_merge( ps4_event_t *merged, const ps4_event_t *event )
+{
+    merged->button_down.up       |= event->button_down.up;
+    merged->button_down.right    |= event->button_down.right;
+    merged->button_down.down     |= event->button_down.down;
+    merged->button_down.left     |= event->button_down.left;
+    merged->button_down.square   |= event->button_down.square;
+    merged->button_down.cross    |= event->button_down.cross;
+    merged->button_down.circle   |= event->button_down.circle;
+    merged->button_down.triangle |= event->button_down.triangle;
+    merged->button_down.l1       |= event->button_down.l1;
+    merged->button_down.r1       |= event->button_down.r1;
+    merged->button_down.l2       |= event->button_down.l2;
+    merged->button_down.r2       |= event->button_down.r2;
+    merged->button_down.share    |= event->button_down.share;
+    merged->button_down.option   |= event->button_down.option;
+    merged->button_down.l3       |= event->button_down.l3;
+    merged->button_down.r3       |= event->button_down.r3;
+    merged->button_down.ps       |= event->button_down.ps;
+    merged->button_down.touch    |= event->button_down.touch;
+
+    merged->button_up.up         |= event->button_up.up;
+    merged->button_up.right      |= event->button_up.right;
+    merged->button_up.down       |= event->button_up.down;
+    merged->button_up.left       |= event->button_up.left;
+    merged->button_up.square     |= event->button_up.square;
+    merged->button_up.cross      |= event->button_up.cross;
+    merged->button_up.circle     |= event->button_up.circle;
+    merged->button_up.triangle   |= event->button_up.triangle;
+    merged->button_up.l1         |= event->button_up.l1;
+    merged->button_up.r1         |= event->button_up.r1;
+    merged->button_up.l2         |= event->button_up.l2;
+    merged->button_up.r2         |= event->button_up.r2;
+    merged->button_up.share      |= event->button_up.share;
+    merged->button_up.option     |= event->button_up.option;
+    merged->button_up.l3         |= event->button_up.l3;
+    merged->button_up.r3         |= event->button_up.r3;
+    merged->button_up.ps         |= event->button_up.ps;
+    merged->button_up.touch      |= event->button_up.touch;
+
+    /* Summing the deltas yields the change since the last delivery */
+    merged->analog_changed.stick.lx  += event->analog_changed.stick.lx;
+    merged->analog_changed.stick.ly  += event->analog_changed.stick.ly;
+    merged->analog_changed.stick.rx  += event->analog_changed.stick.rx;
+    merged->analog_changed.stick.ry  += event->analog_changed.stick.ry;
+    merged->analog_changed.button.l2 += event->analog_changed.button.l2;
+    merged->analog_changed.button.r2 += event->analog_changed.button.r2;
+}
+
+
+static bool ps4_interest_matches( const ps4_interest_t *interest, const ps4_interest_t *changed )
+{
+    return (interest->button & changed->button)
+        || (interest->analog & changed->analog)
+        || (interest->sensor & changed->sensor)
+        || (interest->status & changed->status);
+}
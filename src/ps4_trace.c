@@ -0,0 +1,204 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "include/ps4.h"
+#include "include/ps4_int.h"
+#include "include/ps4_trace.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#ifdef PS4_TRACE
+#include "freertos/FreeRTOS.h"
+#include "esp_ipc.h"
+#endif
+
+#define  PS4_TAG "PS4_TRACE"
+
+/* Records printed per line by ps4TraceDump */
+#define PS4_TRACE_DUMP_LINE 8
+
+
+/********************************************************************************/
+/*                         L O C A L    V A R I A B L E S                       */
+/********************************************************************************/
+
+#ifdef PS4_TRACE
+ps4_trace_record_t ps4_trace_ring[PS4_TRACE_RECORDS];
+uint32_t ps4_trace_head = 0;
+volatile bool ps4_trace_on = true;
+
+/* The cycle counter of each core next to the time of esp_timer, taken when
+ * recording last stopped, which tools/ps4_trace.py lines the cores up by */
+typedef struct {
+    uint32_t cycles;
+    int64_t time_us;
+} ps4_trace_clock_t;
+
+static ps4_trace_clock_t ps4_trace_clocks[portNUM_PROCESSORS];
+#endif
+
+
+/********************************************************************************/
+/*                      L O C A L    F U N C T I O N S                          */
+/********************************************************************************/
+
+#ifdef PS4_TRACE
+static void ps4_trace_clock_read( void *arg )
+{
+    ps4_trace_clock_t *clock = arg;
+
+    clock->cycles = PS4_TRACE_CLOCK();
+    clock->time_us = esp_timer_get_time();
+}
+
+
+/* Reads each clock on its own core, the counters are not in step */
+static void ps4_trace_clocks_read()
+{
+#if portNUM_PROCESSORS > 1
+    for (uint32_t core = 0; core < portNUM_PROCESSORS; core++) {
+        esp_ipc_call_blocking( core, ps4_trace_clock_read, &ps4_trace_clocks[core] );
+    }
+#else
+    ps4_trace_clock_read( &ps4_trace_clocks[0] );
+#endif
+}
+#endif
+
+
+/********************************************************************************/
+/*                      P U B L I C    F U N C T I O N S                        */
+/********************************************************************************/
+
+/*******************************************************************************
+**
+** Function         ps4SetTrace
+**
+** Description      Pauses or resumes recording events, when the library is
+**                  built with PS4_TRACE. Recording starts right away. Must
+**                  not be called from an interrupt.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4SetTrace( bool enabled )
+{
+#ifdef PS4_TRACE
+    if (ps4_trace_on && !enabled) {
+        ps4_trace_on = false;
+        ps4_trace_clocks_read();
+    }
+
+    ps4_trace_on = enabled;
+#else
+    ESP_LOGW(PS4_TAG, "[%s] the library was built without PS4_TRACE", __func__);
+#endif
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4TraceRead
+**
+** Description      Copies up to max of the most recent events, the oldest
+**                  first. Events recorded while copying may overwrite the
+**                  oldest ones, so recording should be paused first.
+**
+**
+** Returns          uint16_t, the number of events copied
+**
+*******************************************************************************/
+uint16_t ps4TraceRead( ps4_trace_record_t *records, uint16_t max )
+{
+#ifdef PS4_TRACE
+    uint32_t head = __atomic_load_n( &ps4_trace_head, __ATOMIC_RELAXED );
+    uint32_t count = head < PS4_TRACE_RECORDS ? head : PS4_TRACE_RECORDS;
+
+    if (count > max) {
+        count = max;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        records[i] = ps4_trace_ring[(head - count + i) & (PS4_TRACE_RECORDS - 1)];
+    }
+
+    return count;
+#else
+    return 0;
+#endif
+}
+
+
+/*******************************************************************************
+**
+** Function         ps4TraceDump
+**
+** Description      Prints the recorded events to the console as hex, with
+**                  the CPU clock rate the cycle counts convert with, for
+**                  tools/ps4_trace.py to turn into a Chrome trace, and the
+**                  cycle count of each core at a shared time, taken when
+**                  recording stopped, to line the cores up with. Recording
+**                  is paused while printing.
+**
+**
+** Returns          void
+**
+*******************************************************************************/
+void ps4TraceDump()
+{
+#ifdef PS4_TRACE
+    ps4_trace_record_t records[PS4_TRACE_DUMP_LINE];
+    bool was_on = ps4_trace_on;
+
+    ps4_trace_on = false;
+
+    if (was_on) {
+        ps4_trace_clocks_read();
+    }
+
+    // Measures the clock rate rather than depending on where the
+    // configured one is found in each IDF release
+    int64_t started = esp_timer_get_time();
+    uint32_t cycles = PS4_TRACE_CLOCK();
+    int64_t elapsed;
+
+    while ((elapsed = esp_timer_get_time() - started) < 1000) {
+    }
+
+    uint32_t hz = (uint64_t)(PS4_TRACE_CLOCK() - cycles) * 1000000 / elapsed;
+
+    uint32_t head = ps4_trace_head;
+    uint32_t count = head < PS4_TRACE_RECORDS ? head : PS4_TRACE_RECORDS;
+
+    printf( "ps4_trace: begin %u %u\n", (unsigned)hz, (unsigned)count );
+
+    for (uint32_t core = 0; core < portNUM_PROCESSORS; core++) {
+        printf( "ps4_trace: clock %u %u %lld\n", (unsigned)core,
+                (unsigned)ps4_trace_clocks[core].cycles, (long long)ps4_trace_clocks[core].time_us );
+    }
+
+    for (uint32_t i = 0; i < count; i += PS4_TRACE_DUMP_LINE) {
+        uint32_t line = count - i < PS4_TRACE_DUMP_LINE ? count - i : PS4_TRACE_DUMP_LINE;
+
+        for (uint32_t j = 0; j < line; j++) {
+            records[j] = ps4_trace_ring[(head - count + i + j) & (PS4_TRACE_RECORDS - 1)];
+        }
+
+        printf( "ps4_trace: " );
+
+        for (uint32_t j = 0; j < line * sizeof(*records); j++) {
+            printf( "%02x", ((const uint8_t*)records)[j] );
+        }
+
+        printf( "\n" );
+    }
+
+    printf( "ps4_trace: end\n" );
+
+    ps4_trace_on = was_on;
+#else
+    ESP_LOGW(PS4_TAG, "[%s] the library was built without PS4_TRACE", __func__);
+#endif
+}
@@ -44,6 +44,27 @@ typedef struct {
 } BT_HDR;
 
 
+/* Define the timer types.
+*/
+typedef void (TIMER_CBACK)(void *p_tle);
+#ifndef TIMER_PARAM_TYPE
+#define TIMER_PARAM_TYPE    UINT32
+#endif
+/* Define a timer list entry
+*/
+typedef struct _tle {
+    struct _tle  *p_next;
+    struct _tle  *p_prev;
+    TIMER_CBACK  *p_cback;
+    INT32         ticks;
+    INT32         ticks_initial;
+    TIMER_PARAM_TYPE   param;
+    TIMER_PARAM_TYPE   data;
+    UINT16        event;
+    UINT8         in_use;
+} TIMER_LIST_ENT;
+
+
 #define BT_PSM_HIDC                     0x0011
 #define BT_PSM_HIDI                     0x0013
 
@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+"""Converts the output of ps4TraceDump() to a Chrome trace.
+
+Feed it a serial log containing a dump, and open the result in
+chrome://tracing or https://ui.perfetto.dev:
+
+    python3 ps4_trace.py monitor.log trace.json
+
+Only the last dump in the log is converted.
+
+The cycle counters the events are stamped with are per core and not in
+step, so the dump carries the counter of each core next to the time of
+esp_timer, taken when recording stopped. Each core's events are placed
+back from there, which lines the cores up to within a few microseconds.
+
+A counter wraps every 2^32 cycles, about 17.9 s at 240 MHz. When a core
+recorded nothing for longer than that, or recording stopped that long
+after its last event, whole wraps are lost without a trace, and its
+earlier events show up late by a multiple of the wrap period. Pause
+recording with ps4SetTrace(false) right after what is of interest.
+"""
+
+import json
+import re
+import struct
+import sys
+
+# enum ps4_trace_event and enum ps4_trace_phase in ps4.h
+EVENTS = ["report", "parse", "raw", "dispatch", "output", "send", "congested", "state"]
+PHASES = ["B", "E", "i"]
+
+# enum ps4_connection_state, enum ps4_report_type and enum ps4_send_result
+STATES = ["idle", "control", "interrupt", "configured", "enabling", "streaming", "teardown"]
+REPORT_TYPES = ["rejected", "handshake", "feature", "short", "full"]
+SEND_RESULTS = ["ok", "congested", "failed", "deferred"]
+
+RECORD = struct.Struct("<IBBH")
+LINE = re.compile(r"ps4_trace: (.*)$")
+
+
+def read_dump(lines):
+    hz, data, clocks, dump = None, b"", {}, None
+
+    for line in lines:
+        match = LINE.search(line.rstrip())
+        if not match:
+            continue
+
+        fields = match.group(1).split()
+        if fields[0] == "begin":
+            hz, data, clocks = int(fields[1]), b"", {}
+        elif fields[0] == "clock" and hz:
+            clocks[int(fields[1])] = (int(fields[2]), int(fields[3]))
+        elif fields[0] == "end" and hz:
+            dump = (hz, data, clocks)
+        elif hz:
+            data += bytes.fromhex(fields[0])
+
+    if dump is None:
+        sys.exit("no complete ps4_trace dump found")
+
+    return dump
+
+
+def describe(event, phase, arg):
+    name = EVENTS[event] if event < len(EVENTS) else "event %d" % event
+
+    if event == EVENTS.index("state") and arg < len(STATES):
+        return name, {"state": STATES[arg]}
+    if event == EVENTS.index("parse") and arg < len(REPORT_TYPES):
+        return name, {"type": REPORT_TYPES[arg]}
+    if event == EVENTS.index("send") and phase == "E" and arg < len(SEND_RESULTS):
+        return name, {"result": SEND_RESULTS[arg]}
+
+    return name, {"arg": arg}
+
+
+def convert(hz, data, clocks):
+    records = [RECORD.unpack_from(data, offset)
+               for offset in range(0, len(data) - RECORD.size + 1, RECORD.size)]
+    times = [0.0] * len(records)
+    later = {}
+
+    if not clocks:
+        print("no clock references in the dump, the cores are lined up at "
+              "their last event", file=sys.stderr)
+
+    # Walks each core's records back from its reference, a record of a core
+    # is never later than the next one of the same core
+    for index in reversed(range(len(records))):
+        cycles, _, phase, _ = records[index]
+        core = phase >> 7
+
+        if core not in later:
+            reference = clocks.get(core, (cycles, 0))
+            later[core] = (reference[0], reference[1] * hz / 1e6)
+
+        later_cycles, later_time = later[core]
+        time = later_time - ((later_cycles - cycles) & 0xffffffff)
+        later[core] = (cycles, time)
+        times[index] = time
+
+    start = min(times, default=0)
+    events = []
+
+    for (cycles, event, phase, arg), time in zip(records, times):
+        core = phase >> 7
+        phase = PHASES[phase & 0x7f] if (phase & 0x7f) < len(PHASES) else "i"
+
+        name, args = describe(event, phase, arg)
+        record = {"name": name, "ph": phase, "ts": (time - start) * 1e6 / hz,
+                  "pid": 1, "tid": core, "args": args}
+        if phase == "i":
+            record["s"] = "t"
+        events.append(record)
+
+    return {"traceEvents": events, "displayTimeUnit": "ns"}
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        sys.exit(__doc__)
+
+    with open(sys.argv[1], errors="replace") as log:
+        trace = convert(*read_dump(log))
+
+    output = open(sys.argv[2], "w") if len(sys.argv) == 3 else sys.stdout
+    json.dump(trace, output, indent=1)
+
+
+if __name__ == "__main__":
+    main()